@@ -0,0 +1,411 @@
+/*=========================================================================*\
+* alpn and npn
+* lua-openssl toolkit
+*
+* application protocol negotiation. protocol list is compiled to wire
+* format once, client send it in ALPN (and select from NPN list of server),
+* server choose from client list with its own preference in callback of
+* ssl_ctx, no lua is called in handshake.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+#define ALPN_WIRE_MAX	65535
+
+/* list replaced by ssl_ctx:alpn, handshake in other thread may still use it */
+typedef struct alpn_retired {
+	struct alpn_retired *next;
+	unsigned char *wire;
+} ALPN_RETIRED;
+
+typedef struct {
+#ifdef PTHREADS
+	pthread_mutex_t lock;
+#endif
+	unsigned char *wire;		/* length prefixed protocols, preference order */
+	unsigned int len;
+	ALPN_RETIRED *retired;		/* freed with ssl_ctx */
+	int strict;			/* fail handshake when nothing in common */
+	long selected;
+	long mismatch;
+} ALPN;
+
+static int alpn_idx = -1;
+
+static void alpn_lock(ALPN *a)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&a->lock);
+#else
+	(void)a;
+#endif
+}
+
+static void alpn_unlock(ALPN *a)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&a->lock);
+#else
+	(void)a;
+#endif
+}
+
+static void alpn_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	ALPN *a = (ALPN *)ptr;
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (a == NULL)
+		return;
+	free(a->wire);
+	while (a->retired) {
+		ALPN_RETIRED *r = a->retired;
+		a->retired = r->next;
+		free(r->wire);
+		free(r);
+	}
+#ifdef PTHREADS
+	pthread_mutex_destroy(&a->lock);
+#endif
+	free(a);
+}
+
+static ALPN *alpn_get(const SSL_CTX *ctx)
+{
+	if (alpn_idx < 0 || ctx == NULL)
+		return NULL;
+	return (ALPN *)SSL_CTX_get_ex_data(ctx, alpn_idx);
+}
+
+static ALPN *alpn_attach(SSL_CTX *ctx)
+{
+	ALPN *a;
+	if (alpn_idx < 0) {
+		alpn_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, alpn_free);
+		if (alpn_idx < 0)
+			return NULL;
+	}
+	a = alpn_get(ctx);
+	if (a == NULL) {
+		a = (ALPN *)calloc(1, sizeof(ALPN));
+		if (a == NULL)
+			return NULL;
+#ifdef PTHREADS
+		pthread_mutex_init(&a->lock, NULL);
+#endif
+		if (!SSL_CTX_set_ex_data(ctx, alpn_idx, a)) {
+			alpn_free(NULL, a, NULL, 0, 0, NULL);
+			return NULL;
+		}
+	}
+	return a;
+}
+
+/* replace list, old one kept until ctx freed, called locked */
+static int alpn_replace(ALPN *a, unsigned char *wire, unsigned int len)
+{
+	if (a->wire) {
+		ALPN_RETIRED *r = (ALPN_RETIRED *)malloc(sizeof(ALPN_RETIRED));
+		if (r == NULL)
+			return 0;
+		r->wire = a->wire;
+		r->next = a->retired;
+		a->retired = r;
+	}
+	a->wire = wire;
+	a->len = len;
+	return 1;
+}
+
+/* protocol list at idx to wire format, malloc result */
+static unsigned char *alpn_compile(lua_State *L, int idx, unsigned int *len)
+{
+	int n = (int)lua_objlen(L, idx);
+	size_t total = 0;
+	unsigned char *wire, *p;
+	int i;
+
+	luaL_argcheck(L, n > 0, idx, "empty protocol list");
+	for (i = 1; i <= n; i++) {
+		size_t l;
+		lua_rawgeti(L, idx, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_argerror(L, idx, "protocol must be string");
+		lua_tolstring(L, -1, &l);
+		luaL_argcheck(L, l > 0 && l <= 255, idx, "protocol length out of range");
+		total += l + 1;
+		lua_pop(L, 1);
+	}
+	luaL_argcheck(L, total <= ALPN_WIRE_MAX, idx, "protocol list too long");
+	wire = p = (unsigned char *)malloc(total);
+	if (wire == NULL)
+		luaL_error(L, "out of memory");
+	for (i = 1; i <= n; i++) {
+		size_t l;
+		const char *s;
+		lua_rawgeti(L, idx, i);
+		s = lua_tolstring(L, -1, &l);
+		*p++ = (unsigned char)l;
+		memcpy(p, s, l);
+		p += l;
+		lua_pop(L, 1);
+	}
+	*len = (unsigned int)total;
+	return wire;
+}
+
+static void alpn_push_list(lua_State *L, const unsigned char *wire, unsigned int len)
+{
+	unsigned int i = 0;
+	int n = 0;
+	lua_newtable(L);
+	while (i < len) {
+		unsigned int l = wire[i];
+		if (i + 1 + l > len)
+			break;
+		lua_pushlstring(L, (const char *)wire + i + 1, l);
+		lua_rawseti(L, -2, ++n);
+		i += l + 1;
+	}
+}
+
+#ifndef OPENSSL_NO_TLSEXT
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+/* server choose first protocol of its list that client offered */
+static int alpn_select_cb(SSL *s, const unsigned char **out, unsigned char *outlen,
+                          const unsigned char *in, unsigned int inlen, void *arg)
+{
+	ALPN *a = alpn_get(SSL_get_SSL_CTX(s));
+	int ret = SSL_TLSEXT_ERR_NOACK;
+	(void)arg;
+
+	if (a == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+	alpn_lock(a);
+	if (a->wire) {
+		unsigned char *sel = NULL;
+		/* out point into wire, OpenSSL copy it after return, wire is not
+		   freed before ctx */
+		if (SSL_select_next_proto(&sel, outlen, a->wire, a->len, in, inlen) == OPENSSL_NPN_NEGOTIATED) {
+			*out = sel;
+			a->selected++;
+			ret = SSL_TLSEXT_ERR_OK;
+		} else {
+			a->mismatch++;
+			ret = a->strict ? SSL_TLSEXT_ERR_ALERT_FATAL : SSL_TLSEXT_ERR_NOACK;
+		}
+	}
+	alpn_unlock(a);
+	return ret;
+}
+#endif
+
+#ifndef OPENSSL_NO_NEXTPROTONEG
+/* server advertise its list in NPN */
+static int npn_advertise_cb(SSL *s, const unsigned char **out, unsigned int *outlen, void *arg)
+{
+	ALPN *a = alpn_get(SSL_get_SSL_CTX(s));
+	int ret = SSL_TLSEXT_ERR_NOACK;
+	(void)arg;
+	if (a == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+	alpn_lock(a);
+	if (a->wire) {
+		*out = a->wire;
+		*outlen = a->len;
+		ret = SSL_TLSEXT_ERR_OK;
+	}
+	alpn_unlock(a);
+	return ret;
+}
+
+/* client choose from server list with its own preference. any return but
+   OK fail handshake, with nothing in common client go on with its first
+   protocol as NPN says */
+static int npn_select_cb(SSL *s, unsigned char **out, unsigned char *outlen,
+                         const unsigned char *in, unsigned int inlen, void *arg)
+{
+	ALPN *a = alpn_get(SSL_get_SSL_CTX(s));
+	int ret = SSL_TLSEXT_ERR_NOACK;
+	(void)arg;
+	if (a == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+	alpn_lock(a);
+	if (a->wire) {
+		/* own list as server side of select, for own preference */
+		if (SSL_select_next_proto(out, outlen, a->wire, a->len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+			*out = a->wire + 1;
+			*outlen = a->wire[0];
+		}
+		ret = SSL_TLSEXT_ERR_OK;
+	}
+	alpn_unlock(a);
+	return ret;
+}
+#endif
+#endif
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:alpn([table protocols [, boolean strict=false]]) -> table {{{1
+	set application protocols in preference, like {'h2', 'http/1.1'}.
+	client offer them by ALPN, server choose first one of its list client
+	offered, in C without lua. strict server fail handshake with
+	no_application_protocol alert when nothing in common, else handshake
+	goes on without protocol. NPN of old peer use same list when OpenSSL
+	has NPN. alpn(false) stop negotiation.
+	return protocols set, or nil when none
+*/
+LUA_FUNCTION(openssl_ssl_ctx_alpn)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+#if !defined(OPENSSL_NO_TLSEXT) && OPENSSL_VERSION_NUMBER >= 0x10002000L
+	ALPN *a = alpn_get(ctx);
+
+	if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+		if (a) {
+			alpn_lock(a);
+			if (alpn_replace(a, NULL, 0) == 0) {
+				alpn_unlock(a);
+				luaL_error(L, "out of memory");
+			}
+			alpn_unlock(a);
+		}
+		SSL_CTX_set_alpn_protos(ctx, NULL, 0);
+#ifndef OPENSSL_NO_NEXTPROTONEG
+		/* select callback must not refuse, take it away */
+		SSL_CTX_set_next_protos_advertised_cb(ctx, NULL, NULL);
+		SSL_CTX_set_next_proto_select_cb(ctx, NULL, NULL);
+#endif
+		lua_pushnil(L);
+		return 1;
+	}
+	if (!lua_isnoneornil(L, 2)) {
+		unsigned int len;
+		unsigned char *wire;
+		luaL_checktype(L, 2, LUA_TTABLE);
+		wire = alpn_compile(L, 2, &len);
+		if (a == NULL)
+			a = alpn_attach(ctx);
+		/* SSL_CTX_set_alpn_protos return 0 on success */
+		if (a == NULL || SSL_CTX_set_alpn_protos(ctx, wire, len) != 0) {
+			free(wire);
+			luaL_error(L, "out of memory");
+		}
+		alpn_lock(a);
+		if (alpn_replace(a, wire, len) == 0) {
+			alpn_unlock(a);
+			free(wire);
+			luaL_error(L, "out of memory");
+		}
+		a->strict = lua_toboolean(L, 3);
+		alpn_unlock(a);
+		SSL_CTX_set_alpn_select_cb(ctx, alpn_select_cb, NULL);
+#ifndef OPENSSL_NO_NEXTPROTONEG
+		SSL_CTX_set_next_protos_advertised_cb(ctx, npn_advertise_cb, NULL);
+		SSL_CTX_set_next_proto_select_cb(ctx, npn_select_cb, NULL);
+#endif
+	}
+	if (a == NULL || a->wire == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	alpn_lock(a);
+	alpn_push_list(L, a->wire, a->len);
+	alpn_unlock(a);
+	return 1;
+#else
+	(void)ctx;
+	lua_pushnil(L);
+	lua_pushliteral(L, "not supported");
+	return 2;
+#endif
+}
+/* }}} */
+
+/*  ssl_ctx:alpn_stats() -> table {{{1
+	server side counters, {selected, mismatch}, mismatch is handshake that
+	client offered ALPN but nothing in common
+*/
+LUA_FUNCTION(openssl_ssl_ctx_alpn_stats)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	ALPN *a = alpn_get(ctx);
+	long selected = 0, mismatch = 0;
+	if (a) {
+		alpn_lock(a);
+		selected = a->selected;
+		mismatch = a->mismatch;
+		alpn_unlock(a);
+	}
+	lua_newtable(L);
+	lua_pushinteger(L, selected);
+	lua_setfield(L, -2, "selected");
+	lua_pushinteger(L, mismatch);
+	lua_setfield(L, -2, "mismatch");
+	return 1;
+}
+/* }}} */
+
+/*  ssl:alpn(table protocols) -> boolean {{{1
+	client offer protocols of this ssl instead of ones of ssl_ctx, before
+	handshake
+*/
+LUA_FUNCTION(openssl_ssl_alpn)
+{
+	SSL *s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+#if !defined(OPENSSL_NO_TLSEXT) && OPENSSL_VERSION_NUMBER >= 0x10002000L
+	unsigned int len;
+	unsigned char *wire;
+	int ret;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	wire = alpn_compile(L, 2, &len);
+	ret = SSL_set_alpn_protos(s, wire, len) == 0;
+	free(wire);
+	lua_pushboolean(L, ret);
+	return 1;
+#else
+	(void)s;
+	lua_pushnil(L);
+	lua_pushliteral(L, "not supported");
+	return 2;
+#endif
+}
+/* }}} */
+
+/*  ssl:alpn_selected() -> string, string {{{1
+	protocol negotiated in handshake and 'alpn' or 'npn' how it was, nil
+	when none
+*/
+LUA_FUNCTION(openssl_ssl_alpn_selected)
+{
+	SSL *s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	const unsigned char *data = NULL;
+	unsigned int len = 0;
+#if !defined(OPENSSL_NO_TLSEXT) && OPENSSL_VERSION_NUMBER >= 0x10002000L
+	SSL_get0_alpn_selected(s, &data, &len);
+	if (data && len) {
+		lua_pushlstring(L, (const char *)data, len);
+		lua_pushliteral(L, "alpn");
+		return 2;
+	}
+#endif
+#if !defined(OPENSSL_NO_TLSEXT) && !defined(OPENSSL_NO_NEXTPROTONEG)
+	SSL_get0_next_proto_negotiated(s, &data, &len);
+	if (data && len) {
+		lua_pushlstring(L, (const char *)data, len);
+		lua_pushliteral(L, "npn");
+		return 2;
+	}
+#endif
+	(void)s; (void)data; (void)len;
+	lua_pushnil(L);
+	return 1;
+}
+/* }}} */
@@ -0,0 +1,428 @@
+/*=========================================================================*\
+* async private key
+* lua-openssl toolkit
+*
+* private key of ssl_ctx is replaced by a copy whose RSA or EC method hands
+* sign and decrypt to native worker threads. handshake runs as an OpenSSL
+* async job, it pauses while worker computes and SSL_do_handshake returns
+* SSL_ERROR_WANT_ASYNC. worker signals a eventfd, the event loop polls it
+* and calls handshake again to resume the job with the result.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+#include <stdlib.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L && defined(PTHREADS) \
+	&& !defined(OPENSSL_NO_ASYNC) && !defined(_WIN32)
+#define AKEY_ASYNC
+#include <openssl/async.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
+#ifdef AKEY_ASYNC
+#define AKEY_THREADS_MAX	64
+
+enum {
+	AKEY_RSA_ENC,
+	AKEY_RSA_DEC,
+	AKEY_EC_SIGN
+};
+
+typedef struct akey_task_st {
+	struct akey_task_st *next;
+	int op;
+	int refs;			/* paused job and worker */
+	int done;
+	int ret;
+	RSA *rsa;
+	EC_KEY *ec;
+	int padding;			/* rsa */
+	int type;			/* ecdsa */
+	int flen;
+	unsigned char *from;
+	unsigned char *out;
+	unsigned int outlen;
+} AKEY_TASK;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t more;		/* task queued */
+	pthread_cond_t done;		/* task finished, for job can not pause */
+	AKEY_TASK *head;
+	AKEY_TASK *tail;
+	int threads;
+	int rfd;			/* polled by event loop */
+	int wfd;
+	unsigned long pending;
+	unsigned long finished;
+	RSA_METHOD *rsa_meth;
+	EC_KEY_METHOD *ec_meth;
+} akey_pool = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	NULL, NULL, 0, -1, -1, 0, 0, NULL, NULL
+};
+
+static void akey_task_release(AKEY_TASK *t)
+{
+	int refs;
+	pthread_mutex_lock(&akey_pool.lock);
+	refs = --t->refs;
+	pthread_mutex_unlock(&akey_pool.lock);
+	if (refs > 0)
+		return;
+	RSA_free(t->rsa);
+	EC_KEY_free(t->ec);
+	OPENSSL_clear_free(t->from, t->flen);
+	OPENSSL_clear_free(t->out, t->outlen);
+	free(t);
+}
+
+/* compute with default method, called by worker or inline */
+static void akey_task_exec(AKEY_TASK *t)
+{
+	if (t->op == AKEY_EC_SIGN) {
+		int (*sign)(int, const unsigned char *, int, unsigned char *, unsigned int *,
+		            const BIGNUM *, const BIGNUM *, EC_KEY *);
+		EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, NULL, NULL);
+		t->ret = sign(t->type, t->from, t->flen, t->out, &t->outlen, NULL, NULL, t->ec);
+	} else if (t->op == AKEY_RSA_ENC)
+		t->ret = RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(t->flen, t->from, t->out, t->rsa, t->padding);
+	else
+		t->ret = RSA_meth_get_priv_dec(RSA_PKCS1_OpenSSL())(t->flen, t->from, t->out, t->rsa, t->padding);
+}
+
+static void akey_notify(void)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+	ssize_t n = write(akey_pool.wfd, &one, sizeof(one));
+#else
+	char one = 1;
+	ssize_t n = write(akey_pool.wfd, &one, 1);
+#endif
+	(void)n;
+}
+
+static void *akey_worker(void *arg)
+{
+	(void)arg;
+	for (;;) {
+		AKEY_TASK *t;
+		pthread_mutex_lock(&akey_pool.lock);
+		while (akey_pool.head == NULL)
+			pthread_cond_wait(&akey_pool.more, &akey_pool.lock);
+		t = akey_pool.head;
+		akey_pool.head = t->next;
+		if (akey_pool.head == NULL)
+			akey_pool.tail = NULL;
+		pthread_mutex_unlock(&akey_pool.lock);
+
+		akey_task_exec(t);
+
+		pthread_mutex_lock(&akey_pool.lock);
+		t->done = 1;
+		akey_pool.pending--;
+		akey_pool.finished++;
+		pthread_cond_broadcast(&akey_pool.done);
+		pthread_mutex_unlock(&akey_pool.lock);
+		akey_notify();
+		akey_task_release(t);
+	}
+	return NULL;
+}
+
+/* run t on pool when in async job, else inline. result copied to out */
+static int akey_run(AKEY_TASK *t, unsigned char *out, unsigned int *outlen)
+{
+	ASYNC_JOB *job = ASYNC_get_current_job();
+	ASYNC_WAIT_CTX *w = job ? ASYNC_get_wait_ctx(job) : NULL;
+	int ret;
+
+	if (w == NULL || !ASYNC_WAIT_CTX_set_wait_fd(w, &akey_pool, akey_pool.rfd, NULL, NULL)) {
+		akey_task_exec(t);
+	} else {
+		int done;
+		t->refs = 2;
+		pthread_mutex_lock(&akey_pool.lock);
+		if (akey_pool.tail)
+			akey_pool.tail->next = t;
+		else
+			akey_pool.head = t;
+		akey_pool.tail = t;
+		akey_pool.pending++;
+		pthread_cond_signal(&akey_pool.more);
+		pthread_mutex_unlock(&akey_pool.lock);
+
+		do {
+			/* back to SSL_do_handshake even when worker is quick, so caller
+			   always sees want_async. or wait here when job can not pause */
+			if (!ASYNC_pause_job()) {
+				pthread_mutex_lock(&akey_pool.lock);
+				while (!t->done)
+					pthread_cond_wait(&akey_pool.done, &akey_pool.lock);
+				pthread_mutex_unlock(&akey_pool.lock);
+			}
+			pthread_mutex_lock(&akey_pool.lock);
+			done = t->done;
+			pthread_mutex_unlock(&akey_pool.lock);
+		} while (!done);
+		ASYNC_WAIT_CTX_clear_fd(w, &akey_pool);
+	}
+	ret = t->ret;
+	if (ret > 0) {
+		unsigned int n = t->op == AKEY_EC_SIGN ? t->outlen : (unsigned int)ret;
+		memcpy(out, t->out, n);
+		if (outlen)
+			*outlen = n;
+	}
+	akey_task_release(t);
+	return ret;
+}
+
+static AKEY_TASK *akey_task_new(int op, const unsigned char *from, int flen, unsigned int outlen)
+{
+	AKEY_TASK *t = (AKEY_TASK *)calloc(1, sizeof(AKEY_TASK));
+	if (t == NULL)
+		return NULL;
+	t->op = op;
+	t->refs = 1;
+	t->flen = flen;
+	t->outlen = outlen;
+	/* job stack and caller buffers may be gone before worker ends */
+	t->from = OPENSSL_malloc(flen > 0 ? flen : 1);
+	t->out = OPENSSL_malloc(outlen);
+	if (t->from == NULL || t->out == NULL) {
+		OPENSSL_free(t->from);
+		OPENSSL_free(t->out);
+		free(t);
+		return NULL;
+	}
+	memcpy(t->from, from, flen);
+	return t;
+}
+
+static int akey_rsa_op(int op, int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+	AKEY_TASK *t = akey_task_new(op, from, flen, RSA_size(rsa));
+	if (t == NULL)
+		return -1;
+	RSA_up_ref(rsa);
+	t->rsa = rsa;
+	t->padding = padding;
+	return akey_run(t, to, NULL);
+}
+
+static int akey_rsa_priv_enc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+	return akey_rsa_op(AKEY_RSA_ENC, flen, from, to, rsa, padding);
+}
+
+static int akey_rsa_priv_dec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+	return akey_rsa_op(AKEY_RSA_DEC, flen, from, to, rsa, padding);
+}
+
+static int akey_ec_sign(int type, const unsigned char *dgst, int dlen, unsigned char *sig,
+                        unsigned int *siglen, const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey)
+{
+	AKEY_TASK *t;
+	if (kinv || r) {
+		int (*sign)(int, const unsigned char *, int, unsigned char *, unsigned int *,
+		            const BIGNUM *, const BIGNUM *, EC_KEY *);
+		EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, NULL, NULL);
+		return sign(type, dgst, dlen, sig, siglen, kinv, r, eckey);
+	}
+	t = akey_task_new(AKEY_EC_SIGN, dgst, dlen, ECDSA_size(eckey));
+	if (t == NULL)
+		return 0;
+	EC_KEY_up_ref(eckey);
+	t->ec = eckey;
+	t->type = type;
+	return akey_run(t, sig, siglen);
+}
+
+/* start threads and methods once, later calls only add threads */
+static int akey_pool_start(int threads, const char **err)
+{
+	int fds[2];
+	int ret = 1;
+	pthread_mutex_lock(&akey_pool.lock);
+	if (akey_pool.rfd < 0) {
+#ifdef __linux__
+		fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fds[0] < 0) {
+#else
+		if (pipe(fds) != 0
+		    || fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0
+		    || fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0) {
+#endif
+			*err = strerror(errno);
+			ret = 0;
+			goto done;
+		}
+		akey_pool.rfd = fds[0];
+		akey_pool.wfd = fds[1];
+
+		akey_pool.rsa_meth = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+		akey_pool.ec_meth = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+		if (akey_pool.rsa_meth == NULL || akey_pool.ec_meth == NULL) {
+			*err = "out of memory";
+			ret = 0;
+			goto done;
+		}
+		RSA_meth_set1_name(akey_pool.rsa_meth, "lua-openssl async key");
+		RSA_meth_set_priv_enc(akey_pool.rsa_meth, akey_rsa_priv_enc);
+		RSA_meth_set_priv_dec(akey_pool.rsa_meth, akey_rsa_priv_dec);
+		{
+			int (*sign_setup)(EC_KEY *, BN_CTX *, BIGNUM **, BIGNUM **);
+			ECDSA_SIG *(*sign_sig)(const unsigned char *, int, const BIGNUM *, const BIGNUM *, EC_KEY *);
+			EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), NULL, &sign_setup, &sign_sig);
+			EC_KEY_METHOD_set_sign(akey_pool.ec_meth, akey_ec_sign, sign_setup, sign_sig);
+		}
+	}
+	/* workers are detached and outlive lua_close */
+	if (akey_pool.threads == 0 && !openssl_module_pin()) {
+		*err = "module can not be kept loaded";
+		ret = 0;
+		goto done;
+	}
+	while (akey_pool.threads < threads) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, akey_worker, NULL) != 0) {
+			*err = "pthread_create fail";
+			ret = akey_pool.threads > 0;
+			break;
+		}
+		pthread_detach(tid);
+		akey_pool.threads++;
+	}
+done:
+	pthread_mutex_unlock(&akey_pool.lock);
+	return ret;
+}
+
+/* copy of pkey using pool methods */
+static EVP_PKEY *akey_wrap(EVP_PKEY *pkey, const char **err)
+{
+	EVP_PKEY *akey = EVP_PKEY_new();
+	int ok = 0;
+	if (akey == NULL) {
+		*err = "out of memory";
+		return NULL;
+	}
+	switch (EVP_PKEY_base_id(pkey)) {
+	case EVP_PKEY_RSA: {
+		RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+		RSA *dup = rsa ? RSAPrivateKey_dup(rsa) : NULL;
+		RSA_free(rsa);
+		if (dup && RSA_set_method(dup, akey_pool.rsa_meth) && EVP_PKEY_assign_RSA(akey, dup))
+			ok = 1;
+		else
+			RSA_free(dup);
+		break;
+	}
+	case EVP_PKEY_EC: {
+		EC_KEY *ec = EVP_PKEY_get1_EC_KEY(pkey);
+		EC_KEY *dup = ec ? EC_KEY_dup(ec) : NULL;
+		EC_KEY_free(ec);
+		if (dup && EC_KEY_set_method(dup, akey_pool.ec_meth) && EVP_PKEY_assign_EC_KEY(akey, dup))
+			ok = 1;
+		else
+			EC_KEY_free(dup);
+		break;
+	}
+	default:
+		*err = "only RSA and EC key supported";
+		EVP_PKEY_free(akey);
+		return NULL;
+	}
+	if (!ok) {
+		*err = "copy private key fail";
+		EVP_PKEY_free(akey);
+		return NULL;
+	}
+	return akey;
+}
+#endif /* AKEY_ASYNC */
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:async_keys([number threads=2]) -> number {{{1
+	sign and decrypt with private key of ctx on worker threads, call after
+	use_PrivateKey. handshake returns nil,'want_async' while the worker runs,
+	poll returned fd for readable and call handshake again. fd and threads
+	are shared by all ctx in process, threads only grows
+*/
+LUA_FUNCTION(openssl_ssl_ctx_async_keys)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+#ifdef AKEY_ASYNC
+	int threads = luaL_optint(L, 2, 2);
+	EVP_PKEY *pkey = SSL_CTX_get0_privatekey(ctx);
+	EVP_PKEY *akey;
+	const char *err = NULL;
+
+	luaL_argcheck(L, threads > 0 && threads <= AKEY_THREADS_MAX, 2, "out of range");
+	if (pkey == NULL)
+		err = "no private key";
+	else if (akey_pool_start(threads, &err) && (akey = akey_wrap(pkey, &err)) != NULL) {
+		if (SSL_CTX_use_PrivateKey(ctx, akey)) {
+			EVP_PKEY_free(akey);
+			SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+			lua_pushinteger(L, akey_pool.rfd);
+			return 1;
+		}
+		EVP_PKEY_free(akey);
+		err = "SSL_CTX_use_PrivateKey fail";
+	}
+	lua_pushnil(L);
+	lua_pushstring(L, err);
+	return 2;
+#else
+	(void)ctx;
+	lua_pushnil(L);
+	lua_pushliteral(L, "not supported");
+	return 2;
+#endif
+}
+/* }}} */
+
+/*  ssl_ctx:async_ready() -> number, number {{{1
+	clear readable state of async fd, return count of operations finished
+	since last call and count still running
+*/
+LUA_FUNCTION(openssl_ssl_ctx_async_ready)
+{
+#ifdef AKEY_ASYNC
+	unsigned long finished, pending;
+	CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	if (akey_pool.rfd >= 0) {
+		char buf[64];
+		while (read(akey_pool.rfd, buf, sizeof(buf)) > 0)
+			continue;
+	}
+	pthread_mutex_lock(&akey_pool.lock);
+	finished = akey_pool.finished;
+	pending = akey_pool.pending;
+	akey_pool.finished = 0;
+	pthread_mutex_unlock(&akey_pool.lock);
+	lua_pushinteger(L, finished);
+	lua_pushinteger(L, pending);
+#else
+	CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	lua_pushinteger(L, 0);
+	lua_pushinteger(L, 0);
+#endif
+	return 2;
+}
+/* }}} */
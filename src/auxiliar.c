@@ -107,10 +107,9 @@ int auxiliar_isclass(lua_State *L, const char *classname, int objidx) {
     if (p != NULL) {  /* value is a userdata? */
         if (lua_getmetatable(L, objidx)) {  /* does it have a metatable? */
             lua_getfield(L, LUA_REGISTRYINDEX, classname);  /* get correct metatable */
-            if (lua_rawequal(L, -1, -2)) {  /* does it have the correct mt? */
-                lua_pop(L, 2);  /* remove both metatables */
-                return 1;
-            }
+            int ret = lua_rawequal(L, -1, -2);  /* does it have the correct mt? */
+            lua_pop(L, 2);  /* remove both metatables */
+            return ret;
         }
     }
     return 0;
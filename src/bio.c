@@ -21,6 +21,14 @@
 * Author:  george zhao <zhaozg(at)gmail.com>
 \*=========================================================================*/
 #include "openssl.h"
+#include <errno.h>
+#include <limits.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
 
 LUA_FUNCTION(openssl_bio_new_mem) {
     size_t l = 0;
@@ -30,6 +38,48 @@ LUA_FUNCTION(openssl_bio_new_mem) {
     return 1;
 }
 
+/* internal side of bio pair keep a reference of its network side */
+static int bio_pair_idx = -1;
+
+static void bio_pair_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (ptr)
+		BIO_free((BIO *)ptr);
+}
+
+/* side of bio where ciphertext from or to network, bio itself when not a pair */
+BIO *openssl_bio_network(BIO *bio)
+{
+	BIO *network = NULL;
+	if (bio && bio_pair_idx >= 0)
+		network = BIO_get_ex_data(bio, bio_pair_idx);
+	return network ? network : bio;
+}
+
+/*  openssl.bio_pair([number bufsize=17408]) -> bio internal, bio network {{{1
+	data written to one side is read from another, give internal to ssl,
+	move ciphertext between network and socket by event loop
+*/
+LUA_FUNCTION(openssl_bio_pair) {
+	int size = luaL_optint(L, 1, 0);
+	BIO *internal = NULL, *network = NULL;
+	luaL_argcheck(L, size >= 0, 1, "must not be negative");
+	if (bio_pair_idx < 0) {
+		bio_pair_idx = BIO_get_ex_new_index(0, NULL, NULL, NULL, bio_pair_free);
+		if (bio_pair_idx < 0)
+			luaL_error(L, "BIO_get_ex_new_index fail");
+	}
+	if (!BIO_new_bio_pair(&internal, size, &network, size))
+		luaL_error(L, "BIO_new_bio_pair fail");
+	BIO_up_ref(network);
+	BIO_set_ex_data(internal, bio_pair_idx, network);
+	PUSH_OBJECT(internal, "openssl.bio");
+	PUSH_OBJECT(network, "openssl.bio");
+	return 2;
+}
+/* }}} */
+
 LUA_FUNCTION(openssl_bio_new_accept) {
 	const char* port = lua_tostring(L,1);
 	BIO* b = BIO_new_accept((char*)port);
@@ -139,6 +189,78 @@ LUA_FUNCTION(openssl_bio_write) {
     return ret;
 }
 
+/*  bio:writev(table pieces) -> number {{{1
+	write array of string or buffer without concatenation, one writev()
+	on socket or fd bio, else BIO_write piece by piece. return bytes
+	written, maybe less than all, bytes written are removed from buffers
+*/
+LUA_FUNCTION(openssl_bio_writev) {
+	BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
+	size_t total = 0;
+	int n, i, ret = 1;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (int)lua_objlen(L, 2);
+#ifndef _WIN32
+	if ((BIO_method_type(bio) & BIO_TYPE_DESCRIPTOR) && BIO_get_fd(bio, NULL) >= 0) {
+		struct iovec iov[IOV_MAX];
+		int fd = BIO_get_fd(bio, NULL);
+		for (i = 1; i <= n; ) {
+			int cnt = 0;
+			size_t want = 0;
+			ssize_t w;
+			for (; i <= n && cnt < IOV_MAX; i++) {
+				BUF_MEM *b;
+				size_t len;
+				const char *p = openssl_buffer_piece(L, 2, i, &len, &b);
+				if (len == 0)
+					continue;
+				iov[cnt].iov_base = (void*)p;
+				iov[cnt].iov_len = len;
+				want += len;
+				cnt++;
+			}
+			if (cnt == 0)
+				break;
+			do {
+				w = writev(fd, iov, cnt);
+			} while (w < 0 && errno == EINTR);
+			if (w < 0) {
+				ret = -1;
+				break;
+			}
+			total += (size_t)w;
+			if ((size_t)w < want)
+				break;
+		}
+	} else
+#endif
+	{
+		for (i = 1; i <= n; i++) {
+			BUF_MEM *b;
+			size_t len;
+			const char *p = openssl_buffer_piece(L, 2, i, &len, &b);
+			if (len == 0)
+				continue;
+			ret = BIO_write(bio, p, len > INT_MAX ? INT_MAX : (int)len);
+			if (ret <= 0)
+				break;
+			total += ret;
+			if ((size_t)ret < len)
+				break;
+		}
+	}
+	if (total == 0 && ret <= 0) {
+		lua_pushnil(L);
+		lua_pushinteger(L, ret);
+		return 2;
+	}
+	openssl_buffer_consumev(L, 2, total);
+	lua_pushinteger(L, (lua_Integer)total);
+	return 1;
+}
+/* }}} */
+
 LUA_FUNCTION(openssl_bio_puts) {
     BIO* bio = CHECK_OBJECT(1,BIO,"openssl.bio");
     const char* s = luaL_checkstring(L,2);
@@ -251,6 +373,8 @@ static luaL_reg bio_funs[] = {
     {"write",	openssl_bio_write	},
     {"puts",	openssl_bio_puts	},
 	{"flush",	openssl_bio_flush	},
+	{"callback_error",	openssl_bio_callback_error	},
+	{"writev",	openssl_bio_writev	},
 
 	{"accept",	openssl_accept		},
     {"get_mem",	openssl_bio_get_mem	},
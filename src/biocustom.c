@@ -0,0 +1,422 @@
+/*=========================================================================*\
+* custom bio
+* lua-openssl toolkit
+*
+* BIO with read, write and ctrl in lua, to put ssl on a socket layer of
+* host program. data is passed in openssl.buffer of the bio, not in lua
+* string: read callback append to read buffer, data more than asked is
+* kept for next BIO_read without calling lua; write callback take from
+* write buffer. in batch mode writes are collected and write callback is
+* called once a flush, or when too much collected. callbacks must not
+* yield, return would block and let caller wait.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CUSTOM_LIMIT	65536	/* bytes collected before write callback is called */
+
+/* fields of table in registry */
+#define CUSTOM_READ	1
+#define CUSTOM_WRITE	2
+#define CUSTOM_CTRL	3
+#define CUSTOM_RBUF	4
+#define CUSTOM_WBUF	5
+#define CUSTOM_THREAD	6
+#define CUSTOM_ERROR	7
+
+typedef struct {
+	lua_State *L;			/* thread callbacks run on */
+	int ref;
+	BUF_MEM *rbuf;
+	BUF_MEM *wbuf;
+	int batch;
+	size_t limit;
+	int eof;
+} CUSTOM;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define BIO_get_data(b)		((b)->ptr)
+#define BIO_set_data(b, p)	((b)->ptr = (p))
+#define BIO_set_init(b, i)	((b)->init = (i))
+#define BIO_get_shutdown(b)	((b)->shutdown)
+#define BIO_set_shutdown(b, s)	((b)->shutdown = (s))
+#endif
+
+/* call field f of callback table with args on top of c->L, 0 when callback
+   raise error, message kept for bio:callback_error() */
+static int custom_call(CUSTOM *c, int f, int nargs, int nresults)
+{
+	lua_State *L = c->L;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, f);
+	lua_insert(L, -(nargs + 2));
+	lua_pop(L, 1);
+	if (lua_pcall(L, nargs, nresults, 0) != 0) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, CUSTOM_ERROR);
+		lua_pop(L, 1);
+		return 0;
+	}
+	return 1;
+}
+
+static void custom_push_field(CUSTOM *c, int f)
+{
+	lua_rawgeti(c->L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(c->L, -1, f);
+	lua_remove(c->L, -2);
+}
+
+/* give write buffer to write callback, -1 on error, else bytes left */
+static long custom_push(BIO *b, CUSTOM *c)
+{
+	lua_State *L = c->L;
+	int top = lua_gettop(L);
+	if (c->wbuf->length == 0)
+		return 0;
+	custom_push_field(c, CUSTOM_WBUF);
+	if (!custom_call(c, CUSTOM_WRITE, 1, 1)) {
+		lua_settop(L, top);
+		return -1;
+	}
+	/* callback consume buffer itself or return bytes taken */
+	if (lua_isnumber(L, -1)) {
+		lua_Integer n = lua_tointeger(L, -1);
+		if (n > 0)
+			openssl_buffer_consume(c->wbuf, (size_t)n);
+	} else if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+		lua_settop(L, top);
+		return -1;
+	}
+	lua_settop(L, top);
+	(void)b;
+	return (long)c->wbuf->length;
+}
+
+static int custom_write(BIO *b, const char *data, int len)
+{
+	CUSTOM *c = (CUSTOM *)BIO_get_data(b);
+	char *p;
+	long left;
+
+	BIO_clear_retry_flags(b);
+	if (len <= 0)
+		return 0;
+	if (c->wbuf->length >= c->limit) {
+		left = custom_push(b, c);
+		if (left < 0)
+			return -1;
+		if ((size_t)left >= c->limit) {
+			BIO_set_retry_write(b);
+			return -1;
+		}
+	}
+	if ((size_t)len > c->limit)
+		len = (int)c->limit;
+	p = openssl_buffer_reserve(c->wbuf, len);
+	if (p == NULL)
+		return -1;
+	memcpy(p, data, len);
+	c->wbuf->length += len;
+	if (!c->batch) {
+		/* buffer is empty between writes, what callback did not take is
+		   tail of data, give it back so caller write it again */
+		left = custom_push(b, c);
+		if (left < 0)
+			return -1;
+		c->wbuf->length -= left;
+		len -= (int)left;
+		if (len == 0) {
+			BIO_set_retry_write(b);
+			return -1;
+		}
+	} else if (c->wbuf->length >= c->limit) {
+		/* taken already, rest goes out with next write or flush */
+		if (custom_push(b, c) < 0)
+			return -1;
+	}
+	return len;
+}
+
+static int custom_read(BIO *b, char *data, int len)
+{
+	CUSTOM *c = (CUSTOM *)BIO_get_data(b);
+	lua_State *L = c->L;
+
+	BIO_clear_retry_flags(b);
+	if (len <= 0)
+		return 0;
+	if (c->rbuf->length == 0 && !c->eof) {
+		int top = lua_gettop(L);
+		custom_push_field(c, CUSTOM_RBUF);
+		lua_pushinteger(L, len);
+		if (!custom_call(c, CUSTOM_READ, 2, 1)) {
+			lua_settop(L, top);
+			return -1;
+		}
+		if (c->rbuf->length == 0 && lua_isboolean(L, -1) && !lua_toboolean(L, -1))
+			c->eof = 1;
+		lua_settop(L, top);
+	}
+	if (c->rbuf->length == 0) {
+		if (c->eof)
+			return 0;
+		BIO_set_retry_read(b);
+		return -1;
+	}
+	if ((size_t)len > c->rbuf->length)
+		len = (int)c->rbuf->length;
+	memcpy(data, c->rbuf->data, len);
+	openssl_buffer_consume(c->rbuf, len);
+	return len;
+}
+
+static int custom_puts(BIO *b, const char *str)
+{
+	return custom_write(b, str, (int)strlen(str));
+}
+
+static long custom_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+	CUSTOM *c = (CUSTOM *)BIO_get_data(b);
+	long ret = 0;
+	(void)ptr;
+
+	switch (cmd) {
+	case BIO_CTRL_FLUSH:
+		BIO_clear_retry_flags(b);
+		ret = custom_push(b, c);
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			BIO_set_retry_write(b);
+			return -1;
+		}
+		ret = 1;
+		break;
+	case BIO_CTRL_PENDING:
+		return (long)c->rbuf->length;
+	case BIO_CTRL_WPENDING:
+		return (long)c->wbuf->length;
+	case BIO_CTRL_EOF:
+		return c->eof && c->rbuf->length == 0;
+	case BIO_CTRL_RESET:
+		c->rbuf->length = c->wbuf->length = 0;
+		c->eof = 0;
+		ret = 1;
+		break;
+	case BIO_CTRL_GET_CLOSE:
+		return BIO_get_shutdown(b);
+	case BIO_CTRL_SET_CLOSE:
+		BIO_set_shutdown(b, (int)num);
+		return 1;
+	case BIO_CTRL_DUP:
+		return 1;
+	default:
+		break;
+	}
+	/* tell ctrl callback, it may answer other commands */
+	custom_push_field(c, CUSTOM_CTRL);
+	if (lua_isfunction(c->L, -1)) {
+		int top = lua_gettop(c->L) - 1;
+		lua_pop(c->L, 1);
+		lua_pushinteger(c->L, cmd);
+		lua_pushinteger(c->L, num);
+		lua_pushinteger(c->L, ret);
+		if (custom_call(c, CUSTOM_CTRL, 3, 1) && lua_isnumber(c->L, -1))
+			ret = (long)lua_tointeger(c->L, -1);
+		lua_settop(c->L, top);
+	} else
+		lua_pop(c->L, 1);
+	return ret;
+}
+
+static int custom_create(BIO *b)
+{
+	BIO_set_data(b, NULL);
+	BIO_set_init(b, 0);
+	return 1;
+}
+
+static int custom_destroy(BIO *b)
+{
+	CUSTOM *c;
+	if (b == NULL)
+		return 0;
+	c = (CUSTOM *)BIO_get_data(b);
+	if (c) {
+		/* buffers are owned by lua, go with callback table */
+		luaL_unref(c->L, LUA_REGISTRYINDEX, c->ref);
+		free(c);
+	}
+	BIO_set_data(b, NULL);
+	BIO_set_init(b, 0);
+	return 1;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static BIO_METHOD *custom_method = NULL;
+static int custom_type = 0;
+
+static BIO_METHOD *custom_get_method(void)
+{
+	if (custom_method == NULL) {
+		int type = BIO_get_new_index();
+		BIO_METHOD *m;
+		if (type == -1)
+			return NULL;
+		type |= BIO_TYPE_SOURCE_SINK;
+		m = BIO_meth_new(type, "lua custom");
+		if (m == NULL)
+			return NULL;
+		BIO_meth_set_write(m, custom_write);
+		BIO_meth_set_read(m, custom_read);
+		BIO_meth_set_puts(m, custom_puts);
+		BIO_meth_set_ctrl(m, custom_ctrl);
+		BIO_meth_set_create(m, custom_create);
+		BIO_meth_set_destroy(m, custom_destroy);
+		custom_method = m;
+		custom_type = type;
+	}
+	return custom_method;
+}
+#else
+#define custom_type	(BIO_TYPE_SOURCE_SINK | 0x70)
+
+static BIO_METHOD custom_method = {
+	custom_type,
+	"lua custom",
+	custom_write,
+	custom_read,
+	custom_puts,
+	NULL,
+	custom_ctrl,
+	custom_create,
+	custom_destroy,
+	NULL
+};
+
+static BIO_METHOD *custom_get_method(void)
+{
+	return &custom_method;
+}
+#endif
+
+/****************************** lua api ******************************/
+/*  openssl.bio_new_custom(table callbacks) -> bio {{{1
+	callbacks is
+	{
+	  read = function(buffer buf, number n) append up to n bytes or more
+	    to buf, return false at end of stream, nothing appended and not
+	    false means would block
+	  write = function(buffer buf) send data of buf, return bytes sent or
+	    consume buf itself, 0 or nothing means would block, false error
+	  ctrl = function(number cmd, number larg, number ret) -> number,
+	    optional, see BIO_ctrl, return replace ret
+	  batch = boolean, call write once a BIO_flush (bio:flush or
+	    ssl:flush), not every BIO_write
+	  limit = number of bytes kept in write buffer, default 65536
+	}
+	BIO_write take data while write buffer below limit, would block after.
+	error raised in callbacks fail the BIO call, see bio:callback_error()
+*/
+LUA_FUNCTION(openssl_bio_new_custom)
+{
+	CUSTOM *c;
+	BIO *bio;
+	BIO_METHOD *m;
+	BUF_MEM *rbuf, *wbuf;
+	int limit;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "read");
+	luaL_argcheck(L, lua_isfunction(L, -1), 1, "read must be function");
+	lua_getfield(L, 1, "write");
+	luaL_argcheck(L, lua_isfunction(L, -1), 1, "write must be function");
+	lua_getfield(L, 1, "ctrl");
+	luaL_argcheck(L, lua_isnil(L, -1) || lua_isfunction(L, -1), 1, "ctrl must be function");
+	lua_getfield(L, 1, "limit");
+	limit = luaL_optint(L, -1, CUSTOM_LIMIT);
+	luaL_argcheck(L, limit > 0, 1, "limit must be positive");
+	lua_pop(L, 1);
+
+	m = custom_get_method();
+	if (m == NULL)
+		luaL_error(L, "BIO_meth_new fail");
+	c = (CUSTOM *)calloc(1, sizeof(CUSTOM));
+	if (c == NULL)
+		luaL_error(L, "out of memory");
+	c->limit = (size_t)limit;
+	lua_getfield(L, 1, "batch");
+	c->batch = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	/* callback table {read, write, ctrl, rbuf, wbuf, thread} */
+	lua_createtable(L, 7, 0);
+	lua_insert(L, -4);
+	lua_rawseti(L, -4, CUSTOM_CTRL);
+	lua_rawseti(L, -3, CUSTOM_WRITE);
+	lua_rawseti(L, -2, CUSTOM_READ);
+	rbuf = BUF_MEM_new();
+	wbuf = BUF_MEM_new();
+	if (rbuf)
+		PUSH_OBJECT(rbuf, "openssl.buffer");
+	else
+		lua_pushnil(L);
+	lua_rawseti(L, -2, CUSTOM_RBUF);
+	if (wbuf)
+		PUSH_OBJECT(wbuf, "openssl.buffer");
+	else
+		lua_pushnil(L);
+	lua_rawseti(L, -2, CUSTOM_WBUF);
+	c->L = lua_newthread(L);
+	lua_rawseti(L, -2, CUSTOM_THREAD);
+	if (rbuf == NULL || wbuf == NULL) {
+		free(c);
+		luaL_error(L, "out of memory");
+	}
+	c->rbuf = rbuf;
+	c->wbuf = wbuf;
+
+	bio = BIO_new(m);
+	if (bio == NULL) {
+		free(c);
+		luaL_error(L, "BIO_new fail");
+	}
+	c->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	BIO_set_data(bio, c);
+	BIO_set_init(bio, 1);
+	BIO_set_shutdown(bio, 1);
+	PUSH_OBJECT(bio, "openssl.bio");
+	return 1;
+}
+/* }}} */
+
+/*  bio:callback_error() -> string {{{1
+	error raised by last failed callback of custom bio, nil when none,
+	cleared after read
+*/
+LUA_FUNCTION(openssl_bio_callback_error)
+{
+	BIO *bio = CHECK_OBJECT(1, BIO, "openssl.bio");
+	CUSTOM *c = NULL;
+	if (custom_type && BIO_method_type(bio) == custom_type)
+		c = (CUSTOM *)BIO_get_data(bio);
+	if (c == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, c->ref);
+	lua_rawgeti(L, -1, CUSTOM_ERROR);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, CUSTOM_ERROR);
+	return 1;
+}
+/* }}} */
@@ -0,0 +1,208 @@
+/*=========================================================================*\
+* buffer routines
+* lua-openssl toolkit
+*
+* openssl.buffer is a growable byte buffer in native memory, ssl and bio read
+* into its tail and write from its head without making Lua strings.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/buffer.h>
+
+/* make room for n bytes after data, length not changed */
+char *openssl_buffer_reserve(BUF_MEM *b, size_t n)
+{
+	size_t len = b->length;
+	if (n == 0)
+		n = 1;
+	if (len + n > b->max && BUF_MEM_grow(b, len + n) == 0)
+		return NULL;
+	b->length = len;
+	return b->data + len;
+}
+
+/* drop n bytes from head */
+void openssl_buffer_consume(BUF_MEM *b, size_t n)
+{
+	if (n >= b->length) {
+		b->length = 0;
+		return;
+	}
+	memmove(b->data, b->data + n, b->length - n);
+	b->length -= n;
+}
+
+/* piece i of array at idx, string or buffer, b is NULL for string */
+const char *openssl_buffer_piece(lua_State *L, int idx, int i, size_t *len, BUF_MEM **b)
+{
+	const char *p;
+	lua_rawgeti(L, idx, i);
+	if (auxiliar_isclass(L, "openssl.buffer", -1)) {
+		*b = CHECK_OBJECT(-1, BUF_MEM, "openssl.buffer");
+		*len = (*b)->length;
+		p = (*b)->data;
+	} else if (lua_type(L, -1) == LUA_TSTRING) {
+		*b = NULL;
+		p = lua_tolstring(L, -1, len);
+	} else {
+		luaL_error(L, "piece #%d must be string or buffer", i);
+		return NULL;
+	}
+	/* string still referenced by array */
+	lua_pop(L, 1);
+	return p;
+}
+
+/* n bytes of pieces in array at idx are written, drop them from buffers */
+void openssl_buffer_consumev(lua_State *L, int idx, size_t n)
+{
+	int i, count = (int)lua_objlen(L, idx);
+	for (i = 1; i <= count && n > 0; i++) {
+		BUF_MEM *b;
+		size_t len;
+		openssl_buffer_piece(L, idx, i, &len, &b);
+		if (b)
+			openssl_buffer_consume(b, n < len ? n : len);
+		n = n < len ? 0 : n - len;
+	}
+}
+
+/* offset from 1, negative from tail, like string.sub */
+static size_t buffer_offset(lua_State *L, BUF_MEM *b, int idx)
+{
+	lua_Integer i = luaL_optinteger(L, idx, 1);
+	if (i < 0)
+		i = (lua_Integer)b->length + i + 1;
+	if (i < 1)
+		i = 1;
+	if ((size_t)i > b->length + 1)
+		i = b->length + 1;
+	return (size_t)i - 1;
+}
+
+/*  openssl.buffer_new([number size|string data]) => buffer {{{1
+	size is initial capacity
+*/
+LUA_FUNCTION(openssl_buffer_new)
+{
+	BUF_MEM *b = BUF_MEM_new();
+	size_t l = 0;
+	const char *d = NULL;
+	char *p;
+
+	if (lua_type(L, 1) == LUA_TSTRING)
+		d = lua_tolstring(L, 1, &l);
+	else {
+		int n = luaL_optint(L, 1, 0);
+		luaL_argcheck(L, n >= 0, 1, "must not be negative");
+		l = n;
+	}
+	PUSH_OBJECT(b, "openssl.buffer");
+	p = openssl_buffer_reserve(b, l);
+	if (p == NULL)
+		luaL_error(L, "out of memory");
+	if (d) {
+		memcpy(p, d, l);
+		b->length += l;
+	}
+	return 1;
+}
+/* }}} */
+
+/* buffer:append(string data) => buffer */
+static int openssl_buffer_append(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	size_t l;
+	const char *d = luaL_checklstring(L, 2, &l);
+	char *p = openssl_buffer_reserve(b, l);
+	if (p == NULL)
+		luaL_error(L, "out of memory");
+	memcpy(p, d, l);
+	b->length += l;
+	lua_pushvalue(L, 1);
+	return 1;
+}
+
+/* buffer:tostring([number offset=1 [, number len]]) -> string */
+static int openssl_buffer_tostring(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	size_t off = buffer_offset(L, b, 2);
+	size_t len = b->length - off;
+	if (!lua_isnoneornil(L, 3)) {
+		lua_Integer n = luaL_checkinteger(L, 3);
+		if (n < 0)
+			n = 0;
+		if ((size_t)n < len)
+			len = (size_t)n;
+	}
+	lua_pushlstring(L, b->data + off, len);
+	return 1;
+}
+
+/* buffer:consume(number n) -> number, drop n bytes from head, return length left */
+static int openssl_buffer_consume_lua(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	lua_Integer n = luaL_checkinteger(L, 2);
+	if (n > 0)
+		openssl_buffer_consume(b, (size_t)n);
+	lua_pushinteger(L, b->length);
+	return 1;
+}
+
+/* buffer:clear() => buffer, memory is kept for next use */
+static int openssl_buffer_clear(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	b->length = 0;
+	lua_pushvalue(L, 1);
+	return 1;
+}
+
+/* buffer:capacity([number n]) -> number, reserve n bytes free space when given */
+static int openssl_buffer_capacity(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	if (!lua_isnoneornil(L, 2) && openssl_buffer_reserve(b, luaL_checkint(L, 2)) == NULL)
+		luaL_error(L, "out of memory");
+	lua_pushinteger(L, b->max);
+	return 1;
+}
+
+static int openssl_buffer_length(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	lua_pushinteger(L, b->length);
+	return 1;
+}
+
+static int openssl_buffer_gc(lua_State *L)
+{
+	BUF_MEM *b = CHECK_OBJECT(1, BUF_MEM, "openssl.buffer");
+	BUF_MEM_free(b);
+	return 0;
+}
+
+static luaL_Reg buffer_funcs[] = {
+	{"append",		openssl_buffer_append},
+	{"tostring",		openssl_buffer_tostring},
+	{"consume",		openssl_buffer_consume_lua},
+	{"clear",		openssl_buffer_clear},
+	{"capacity",		openssl_buffer_capacity},
+
+	{"__len",		openssl_buffer_length},
+	{"__gc",		openssl_buffer_gc},
+	{"__tostring",		auxiliar_tostring},
+
+	{NULL,			NULL},
+};
+
+int openssl_register_buffer(lua_State *L)
+{
+	auxiliar_newclass(L, "openssl.buffer", buffer_funcs);
+	return 0;
+}
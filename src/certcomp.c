@@ -0,0 +1,124 @@
+/*=========================================================================*\
+* certificate compression
+* lua-openssl toolkit
+*
+* TLSv1.3 certificate compression of RFC 8879, server send its chain
+* compressed when client ask for it. algorithms come from the linked
+* OpenSSL (zlib, brotli or zstd), configured chain is compressed once
+* when ssl_ctx:cert_compression is called, not in every handshake. need
+* OpenSSL 3.2 or later, else not supported.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <string.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L && !defined(OPENSSL_NO_COMP_ALG)
+#define CERT_COMP
+#endif
+
+#ifdef CERT_COMP
+static const struct {
+	const char *name;
+	int alg;
+} cert_comp_algs[] = {
+	{"zlib",	TLSEXT_comp_cert_zlib},
+	{"brotli",	TLSEXT_comp_cert_brotli},
+	{"zstd",	TLSEXT_comp_cert_zstd},
+	{NULL,		0}
+};
+
+static int cert_comp_alg(lua_State *L, int idx)
+{
+	const char *name = luaL_checkstring(L, idx);
+	int i;
+	for (i = 0; cert_comp_algs[i].name; i++)
+		if (strcmp(name, cert_comp_algs[i].name) == 0)
+			return cert_comp_algs[i].alg;
+	return luaL_argerror(L, idx, lua_pushfstring(L, "unknown algorithm '%s'", name));
+}
+
+static int cert_comp_fail(lua_State *L, const char *what)
+{
+	unsigned long e = ERR_get_error();
+	const char *reason = e ? ERR_reason_error_string(e) : NULL;
+	ERR_clear_error();
+	lua_pushnil(L);
+	lua_pushstring(L, reason ? reason : what);
+	return 2;
+}
+
+/* {[name] = {size, orig}} of compressed chain kept in ctx */
+static void cert_comp_push(lua_State *L, SSL_CTX *ctx)
+{
+	int i;
+	lua_newtable(L);
+	for (i = 0; cert_comp_algs[i].name; i++) {
+		unsigned char *data = NULL;
+		size_t orig = 0;
+		size_t size = SSL_CTX_get1_compressed_cert(ctx, cert_comp_algs[i].alg, &data, &orig);
+		OPENSSL_free(data);
+		if (size == 0)
+			continue;
+		lua_newtable(L);
+		lua_pushinteger(L, (lua_Integer)size);
+		lua_setfield(L, -2, "size");
+		lua_pushinteger(L, (lua_Integer)orig);
+		lua_setfield(L, -2, "orig");
+		lua_setfield(L, -2, cert_comp_algs[i].name);
+	}
+}
+#endif
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:cert_compression([table algs|boolean enable]) -> table {{{1
+	algs is list of zlib, brotli or zstd in preference, client ask for
+	them, server choose first one client ask. algorithms not in linked
+	OpenSSL are skipped. false disable compression in both direction.
+	call after certificate and chain are set, chain is compressed here
+	once, call again when certificate changed.
+	return {[name] = {size, orig}} of compressed chain, size and orig are
+	bytes of compressed and uncompressed Certificate message, empty on
+	client or when nothing compressed. nil, 'not supported' when OpenSSL
+	older than 3.2 or without compression
+*/
+LUA_FUNCTION(openssl_ssl_ctx_cert_compression)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+#ifdef CERT_COMP
+	if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TX_CERTIFICATE_COMPRESSION | SSL_OP_NO_RX_CERTIFICATE_COMPRESSION);
+		lua_newtable(L);
+		return 1;
+	}
+	if (lua_istable(L, 2)) {
+		int algs[TLSEXT_comp_cert_limit];
+		int n = (int)lua_objlen(L, 2);
+		int i;
+		luaL_argcheck(L, n > 0 && n < TLSEXT_comp_cert_limit, 2, "too many or no algorithm");
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(L, 2, i + 1);
+			algs[i] = cert_comp_alg(L, -1);
+			lua_pop(L, 1);
+		}
+		if (!SSL_CTX_set1_cert_comp_preference(ctx, algs, n))
+			return cert_comp_fail(L, "set preference fail");
+	} else if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TBOOLEAN);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TX_CERTIFICATE_COMPRESSION | SSL_OP_NO_RX_CERTIFICATE_COMPRESSION);
+	/* every certificate of ctx with every algorithm in preference */
+	if (SSL_CTX_get0_certificate(ctx) && !SSL_CTX_compress_certs(ctx, 0))
+		return cert_comp_fail(L, "compress fail");
+	cert_comp_push(L, ctx);
+	return 1;
+#else
+	(void)ctx;
+	lua_pushnil(L);
+	lua_pushliteral(L, "not supported");
+	return 2;
+#endif
+}
+/* }}} */
@@ -0,0 +1,651 @@
+/*=========================================================================*\
+* ssl client pool
+* lua-openssl toolkit
+*
+* sessions of client ssl kept by destination, host:port and servername,
+* next connection to same destination resume one of them. sessions come
+* from new session callback of ssl_ctx, so TLSv1.3 tickets sent after
+* handshake are kept too. a TLSv1.3 ticket is used once, older protocol
+* sessions are used until they expire. idle connections can be put back
+* and got by destination, they are kept in environment of pool object.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+#define POOL_SLOTS		256
+#define POOL_SESSIONS		4	/* sessions per destination */
+#define POOL_HOSTS		1024	/* destinations kept */
+#define POOL_IDLE_TIMEOUT	60
+
+typedef struct pool_dest_st {
+	struct pool_dest_st *next;
+	char *name;
+	SSL_SESSION **sess;		/* newest first */
+	int count;
+	time_t used;
+	long hits;
+	long misses;
+	long resumed;
+} POOL_DEST;
+
+typedef struct {
+#ifdef PTHREADS
+	pthread_mutex_t lock;
+#endif
+	int refs;			/* pool object and its ssl */
+	SSL_CTX *ctx;
+	int sessions;
+	int hosts;
+	int idle;
+	int idle_timeout;
+	int count;
+	long hits;
+	long misses;
+	long resumed;
+	long full;
+	POOL_DEST *slot[POOL_SLOTS];
+} POOL;
+
+/* ex_data of ssl made by pool */
+typedef struct {
+	POOL *pool;
+	char *name;
+	int counted;
+} POOL_SSL;
+
+static int pool_ssl_idx = -1;
+
+static void pool_lock(POOL *p)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&p->lock);
+#else
+	(void)p;
+#endif
+}
+
+static void pool_unlock(POOL *p)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&p->lock);
+#else
+	(void)p;
+#endif
+}
+
+static unsigned int pool_hash(const char *name)
+{
+	unsigned int h = 5381;
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h % POOL_SLOTS;
+}
+
+static void pool_dest_free(POOL_DEST *d)
+{
+	int i;
+	for (i = 0; i < d->count; i++)
+		SSL_SESSION_free(d->sess[i]);
+	free(d->sess);
+	free(d->name);
+	free(d);
+}
+
+static void pool_release(POOL *p)
+{
+	int i, refs;
+	pool_lock(p);
+	refs = --p->refs;
+	pool_unlock(p);
+	if (refs > 0)
+		return;
+	for (i = 0; i < POOL_SLOTS; i++) {
+		while (p->slot[i]) {
+			POOL_DEST *d = p->slot[i];
+			p->slot[i] = d->next;
+			pool_dest_free(d);
+		}
+	}
+	SSL_CTX_free(p->ctx);
+#ifdef PTHREADS
+	pthread_mutex_destroy(&p->lock);
+#endif
+	free(p);
+}
+
+/* with lock held */
+static POOL_DEST *pool_find(POOL *p, const char *name)
+{
+	POOL_DEST *d;
+	for (d = p->slot[pool_hash(name)]; d; d = d->next)
+		if (strcmp(d->name, name) == 0)
+			return d;
+	return NULL;
+}
+
+/* with lock held, drop least recently used destination when full */
+static POOL_DEST *pool_add(POOL *p, const char *name)
+{
+	POOL_DEST *d, **pp, **lru = NULL;
+	int i;
+
+	if (p->count >= p->hosts) {
+		for (i = 0; i < POOL_SLOTS; i++)
+			for (pp = &p->slot[i]; *pp; pp = &(*pp)->next)
+				if (lru == NULL || (*pp)->used < (*lru)->used)
+					lru = pp;
+		if (lru) {
+			d = *lru;
+			*lru = d->next;
+			pool_dest_free(d);
+			p->count--;
+		}
+	}
+	d = (POOL_DEST *)calloc(1, sizeof(POOL_DEST));
+	if (d == NULL)
+		return NULL;
+	d->name = strdup(name);
+	d->sess = (SSL_SESSION **)calloc(p->sessions, sizeof(SSL_SESSION *));
+	if (d->name == NULL || d->sess == NULL) {
+		pool_dest_free(d);
+		return NULL;
+	}
+	d->used = time(NULL);
+	i = pool_hash(name);
+	d->next = p->slot[i];
+	p->slot[i] = d;
+	p->count++;
+	return d;
+}
+
+static int pool_session_valid(SSL_SESSION *sess, time_t now)
+{
+	long t = SSL_SESSION_get_time(sess);
+	if (t + SSL_SESSION_get_timeout(sess) <= now)
+		return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if (!SSL_SESSION_is_resumable(sess))
+		return 0;
+	/* server tell how long ticket is good */
+	if (SSL_SESSION_has_ticket(sess)) {
+		unsigned long hint = SSL_SESSION_get_ticket_lifetime_hint(sess);
+		if (hint && t + (long)hint <= now)
+			return 0;
+	}
+#endif
+	return 1;
+}
+
+static int pool_session_once(SSL_SESSION *sess)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	return SSL_SESSION_get_protocol_version(sess) == TLS1_3_VERSION;
+#else
+	(void)sess;
+	return 0;
+#endif
+}
+
+/* session to resume for name with a reference, NULL when none */
+static SSL_SESSION *pool_take(POOL *p, const char *name)
+{
+	SSL_SESSION *sess = NULL;
+	POOL_DEST *d;
+	time_t now = time(NULL);
+
+	pool_lock(p);
+	d = pool_find(p, name);
+	if (d == NULL)
+		d = pool_add(p, name);
+	if (d) {
+		d->used = now;
+		while (d->count > 0 && sess == NULL) {
+			sess = d->sess[0];
+			if (!pool_session_valid(sess, now) || pool_session_once(sess)) {
+				/* single use or expired, remove it */
+				d->count--;
+				memmove(d->sess, d->sess + 1, d->count * sizeof(SSL_SESSION *));
+				if (!pool_session_valid(sess, now)) {
+					SSL_SESSION_free(sess);
+					sess = NULL;
+				}
+			} else
+				SSL_SESSION_up_ref(sess);
+		}
+	}
+	if (sess) {
+		d->hits++;
+		p->hits++;
+	} else {
+		if (d)
+			d->misses++;
+		p->misses++;
+	}
+	pool_unlock(p);
+	return sess;
+}
+
+/* count result of handshake once */
+static void pool_count(POOL_SSL *ps, SSL *s)
+{
+	POOL *p = ps->pool;
+	POOL_DEST *d;
+	int reused;
+	if (ps->counted || !SSL_is_init_finished(s))
+		return;
+	ps->counted = 1;
+	reused = SSL_session_reused(s);
+	pool_lock(p);
+	if (reused) {
+		p->resumed++;
+		d = pool_find(p, ps->name);
+		if (d)
+			d->resumed++;
+	} else
+		p->full++;
+	pool_unlock(p);
+}
+
+static void pool_ssl_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	POOL_SSL *ps = (POOL_SSL *)ptr;
+	(void)ad; (void)idx; (void)argl; (void)argp;
+	if (ps == NULL)
+		return;
+	if (parent)
+		pool_count(ps, (SSL *)parent);
+	pool_release(ps->pool);
+	free(ps->name);
+	free(ps);
+}
+
+/* keep new session for destination of ssl, own its reference */
+static int pool_new_session_cb(SSL *s, SSL_SESSION *sess)
+{
+	POOL_SSL *ps = pool_ssl_idx < 0 ? NULL : (POOL_SSL *)SSL_get_ex_data(s, pool_ssl_idx);
+	POOL *p;
+	POOL_DEST *d;
+	if (ps == NULL)
+		return 0;
+	p = ps->pool;
+	pool_lock(p);
+	d = pool_find(p, ps->name);
+	if (d == NULL)
+		d = pool_add(p, ps->name);
+	if (d) {
+		if (d->count == p->sessions)
+			SSL_SESSION_free(d->sess[--d->count]);
+		memmove(d->sess + 1, d->sess, d->count * sizeof(SSL_SESSION *));
+		d->sess[0] = sess;
+		d->count++;
+	}
+	pool_unlock(p);
+	return d != NULL;
+}
+
+/* destination name of key and servername at idx, pushed on stack */
+static const char *pool_push_name(lua_State *L, int key, int servername)
+{
+	if (servername)
+		lua_pushfstring(L, "%s/%s", lua_tostring(L, key), lua_tostring(L, servername));
+	else
+		lua_pushvalue(L, key);
+	return lua_tostring(L, -1);
+}
+
+/* host part of host:port or [v6]:port, pushed on stack, nil for ip address */
+static void pool_push_host(lua_State *L, int key)
+{
+	size_t len;
+	const char *k = lua_tolstring(L, key, &len);
+	const char *c = strrchr(k, ':');
+	ASN1_OCTET_STRING *ip;
+	if (c && k[0] != '[' && memchr(k, ':', c - k) == NULL)
+		len = c - k;
+	else if (k[0] == '[' && (c = strchr(k, ']')) != NULL) {
+		k++;
+		len = c - k;
+	}
+	lua_pushlstring(L, k, len);
+	ip = a2i_IPADDRESS(lua_tostring(L, -1));
+	if (ip) {
+		ASN1_OCTET_STRING_free(ip);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+}
+
+/****************************** lua api ******************************/
+/*  openssl.ssl_client_pool(ssl_ctx ctx [, table opts]) -> ssl_client_pool {{{1
+	opts.sessions: sessions kept per destination, default 4
+	opts.hosts: destinations kept, least recently used is dropped, default 1024
+	opts.idle: idle connections kept per destination, default 0
+	opts.idle_timeout: seconds idle connection is kept, default 60
+	pool use new session callback and client session cache mode of ctx
+*/
+LUA_FUNCTION(openssl_ssl_client_pool)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	POOL *p;
+
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TTABLE);
+	if (pool_ssl_idx < 0) {
+		pool_ssl_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, pool_ssl_free);
+		if (pool_ssl_idx < 0)
+			luaL_error(L, "SSL_get_ex_new_index fail");
+	}
+	p = (POOL *)calloc(1, sizeof(POOL));
+	if (p == NULL)
+		luaL_error(L, "out of memory");
+	p->sessions = POOL_SESSIONS;
+	p->hosts = POOL_HOSTS;
+	p->idle_timeout = POOL_IDLE_TIMEOUT;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "sessions");
+		p->sessions = luaL_optint(L, -1, p->sessions);
+		lua_getfield(L, 2, "hosts");
+		p->hosts = luaL_optint(L, -1, p->hosts);
+		lua_getfield(L, 2, "idle");
+		p->idle = luaL_optint(L, -1, p->idle);
+		lua_getfield(L, 2, "idle_timeout");
+		p->idle_timeout = luaL_optint(L, -1, p->idle_timeout);
+		lua_pop(L, 4);
+	}
+	if (p->sessions < 1 || p->hosts < 1 || p->idle < 0) {
+		free(p);
+		luaL_argerror(L, 2, "sessions and hosts must be positive");
+	}
+#ifdef PTHREADS
+	pthread_mutex_init(&p->lock, NULL);
+#endif
+	p->refs = 1;
+	SSL_CTX_up_ref(ctx);
+	p->ctx = ctx;
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, pool_new_session_cb);
+
+	PUSH_OBJECT(p, "openssl.ssl_client_pool");
+	/* idle connections by destination */
+	lua_newtable(L);
+	lua_setfenv(L, -2);
+	return 1;
+}
+/* }}} */
+
+/*  pool:ssl(string key, number fd | bio rbio [, bio wbio] [, string servername]) -> ssl {{{1
+	new client ssl to key, host:port. servername is host of key unless
+	given, not set for ip address. a kept session of same key and
+	servername is set to resume
+*/
+static int openssl_client_pool_ssl(lua_State *L)
+{
+	POOL *p = CHECK_OBJECT(1, POOL, "openssl.ssl_client_pool");
+	int io = lua_isnumber(L, 3) ? 1 : 1 + auxiliar_isclass(L, "openssl.bio", 4);
+	int sni = lua_type(L, 3 + io) == LUA_TSTRING ? 3 + io : 0;
+	const char *name;
+	SSL_SESSION *sess;
+	POOL_SSL *ps;
+	SSL *s;
+	int i;
+
+	luaL_checkstring(L, 2);
+	if (!lua_isnumber(L, 3))
+		luaL_checkudata(L, 3, "openssl.bio");
+	if (sni == 0) {
+		pool_push_host(L, 2);
+		sni = lua_gettop(L);
+		name = pool_push_name(L, 2, 0);
+	} else
+		name = pool_push_name(L, 2, sni);
+
+	lua_pushcfunction(L, openssl_ssl_ctx_new_ssl);
+	SSL_CTX_up_ref(p->ctx);
+	PUSH_OBJECT_REF(p->ctx, "openssl.ssl_ctx", SSL_CTX_free);
+	for (i = 0; i < io; i++)
+		lua_pushvalue(L, 3 + i);
+	lua_call(L, 1 + io, 1);
+	s = CHECK_OBJECT(-1, SSL, "openssl.ssl");
+
+	ps = (POOL_SSL *)calloc(1, sizeof(POOL_SSL));
+	if (ps)
+		ps->name = strdup(name);
+	if (ps == NULL || ps->name == NULL || !SSL_set_ex_data(s, pool_ssl_idx, ps)) {
+		if (ps)
+			free(ps->name);
+		free(ps);
+		luaL_error(L, "out of memory");
+	}
+	pool_lock(p);
+	p->refs++;
+	pool_unlock(p);
+	ps->pool = p;
+
+	if (!lua_isnil(L, sni))
+		SSL_set_tlsext_host_name(s, lua_tostring(L, sni));
+	sess = pool_take(p, name);
+	if (sess) {
+		SSL_set_session(s, sess);
+		SSL_SESSION_free(sess);
+	}
+	return 1;
+}
+/* }}} */
+
+/*  pool:put(ssl s) -> boolean {{{1
+	keep s idle for its destination, false when pool do not want it, then
+	caller close it. s must be made by pool:ssl and not shutdown
+*/
+static int openssl_client_pool_put(lua_State *L)
+{
+	POOL *p = CHECK_OBJECT(1, POOL, "openssl.ssl_client_pool");
+	SSL *s = CHECK_OBJECT(2, SSL, "openssl.ssl");
+	POOL_SSL *ps = (POOL_SSL *)SSL_get_ex_data(s, pool_ssl_idx);
+	int n;
+
+	if (ps == NULL || ps->pool != p)
+		luaL_argerror(L, 2, "ssl not made by this pool");
+	pool_count(ps, s);
+	if (p->idle == 0 || !SSL_is_init_finished(s) || SSL_get_shutdown(s)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, ps->name);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, ps->name);
+	}
+	/* pairs of ssl and time */
+	n = lua_objlen(L, -1);
+	if (n / 2 >= p->idle) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, n + 1);
+	lua_pushinteger(L, (lua_Integer)time(NULL));
+	lua_rawseti(L, -2, n + 2);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+/* }}} */
+
+/*  pool:get(string key [, string servername]) -> ssl {{{1
+	idle connection to key put last, nil when none. connection idle more
+	than idle_timeout or shutdown is dropped
+*/
+static int openssl_client_pool_get(lua_State *L)
+{
+	POOL *p = CHECK_OBJECT(1, POOL, "openssl.ssl_client_pool");
+	const char *name;
+	time_t now = time(NULL);
+	int n;
+
+	luaL_checkstring(L, 2);
+	name = pool_push_name(L, 2, lua_isnoneornil(L, 3) ? 0 : (luaL_checkstring(L, 3), 3));
+	lua_getfenv(L, 1);
+	lua_getfield(L, -1, name);
+	if (lua_isnil(L, -1))
+		return 1;
+	for (n = lua_objlen(L, -1); n >= 2; n -= 2) {
+		SSL *s;
+		time_t t;
+		lua_rawgeti(L, -1, n - 1);
+		lua_rawgeti(L, -2, n);
+		t = (time_t)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, n);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, n - 1);
+		s = CHECK_OBJECT(-1, SSL, "openssl.ssl");
+		if (now - t <= p->idle_timeout && SSL_get_shutdown(s) == 0)
+			return 1;
+		lua_pop(L, 1);
+	}
+	lua_pushnil(L);
+	return 1;
+}
+/* }}} */
+
+/*  pool:stats([string key [, string servername]]) -> table {{{1
+	hits (session set), misses, resumed and full handshakes counted when
+	connection is put back or freed, sessions and hosts kept. with key, only
+	hits, misses, resumed and sessions of that destination, nil when unknown
+*/
+static int openssl_client_pool_stats(lua_State *L)
+{
+	POOL *p = CHECK_OBJECT(1, POOL, "openssl.ssl_client_pool");
+	long v[6];
+	int i;
+
+	if (!lua_isnoneornil(L, 2)) {
+		const char *name;
+		POOL_DEST *d;
+		luaL_checkstring(L, 2);
+		name = pool_push_name(L, 2, lua_isnoneornil(L, 3) ? 0 : (luaL_checkstring(L, 3), 3));
+		pool_lock(p);
+		d = pool_find(p, name);
+		if (d) {
+			v[0] = d->hits;
+			v[1] = d->misses;
+			v[2] = d->resumed;
+			v[3] = d->count;
+		}
+		pool_unlock(p);
+		if (d == NULL)
+			return 0;
+		lua_newtable(L);
+		add_assoc_int(L, "hits", v[0]);
+		add_assoc_int(L, "misses", v[1]);
+		add_assoc_int(L, "resumed", v[2]);
+		add_assoc_int(L, "sessions", v[3]);
+		return 1;
+	}
+
+	pool_lock(p);
+	v[0] = p->hits;
+	v[1] = p->misses;
+	v[2] = p->resumed;
+	v[3] = p->full;
+	v[4] = p->count;
+	v[5] = 0;
+	for (i = 0; i < POOL_SLOTS; i++) {
+		POOL_DEST *d;
+		for (d = p->slot[i]; d; d = d->next)
+			v[5] += d->count;
+	}
+	pool_unlock(p);
+	lua_newtable(L);
+	add_assoc_int(L, "hits", v[0]);
+	add_assoc_int(L, "misses", v[1]);
+	add_assoc_int(L, "resumed", v[2]);
+	add_assoc_int(L, "full", v[3]);
+	add_assoc_int(L, "hosts", v[4]);
+	add_assoc_int(L, "sessions", v[5]);
+	return 1;
+}
+/* }}} */
+
+/*  pool:flush([string key [, string servername]]) {{{1
+	drop sessions and idle connections, of key only when given
+*/
+static int openssl_client_pool_flush(lua_State *L)
+{
+	POOL *p = CHECK_OBJECT(1, POOL, "openssl.ssl_client_pool");
+	int i;
+	if (!lua_isnoneornil(L, 2)) {
+		const char *name;
+		POOL_DEST **pp;
+		luaL_checkstring(L, 2);
+		name = pool_push_name(L, 2, lua_isnoneornil(L, 3) ? 0 : (luaL_checkstring(L, 3), 3));
+		pool_lock(p);
+		for (pp = &p->slot[pool_hash(name)]; *pp; pp = &(*pp)->next) {
+			if (strcmp((*pp)->name, name) == 0) {
+				POOL_DEST *d = *pp;
+				*pp = d->next;
+				pool_dest_free(d);
+				p->count--;
+				break;
+			}
+		}
+		pool_unlock(p);
+		lua_getfenv(L, 1);
+		lua_pushnil(L);
+		lua_setfield(L, -2, name);
+		return 0;
+	}
+	pool_lock(p);
+	for (i = 0; i < POOL_SLOTS; i++) {
+		while (p->slot[i]) {
+			POOL_DEST *d = p->slot[i];
+			p->slot[i] = d->next;
+			pool_dest_free(d);
+		}
+	}
+	p->count = 0;
+	pool_unlock(p);
+	lua_newtable(L);
+	lua_setfenv(L, 1);
+	return 0;
+}
+/* }}} */
+
+static int openssl_client_pool_gc(lua_State *L)
+{
+	POOL *p = CHECK_OBJECT(1, POOL, "openssl.ssl_client_pool");
+	pool_release(p);
+	return 0;
+}
+
+static luaL_Reg client_pool_funcs[] = {
+	{"ssl",			openssl_client_pool_ssl},
+	{"put",			openssl_client_pool_put},
+	{"get",			openssl_client_pool_get},
+	{"stats",		openssl_client_pool_stats},
+	{"flush",		openssl_client_pool_flush},
+
+	{"__gc",		openssl_client_pool_gc},
+	{"__tostring",		auxiliar_tostring},
+
+	{NULL,			NULL},
+};
+
+int openssl_register_client_pool(lua_State *L)
+{
+	auxiliar_newclass(L, "openssl.ssl_client_pool", client_pool_funcs);
+	return 0;
+}
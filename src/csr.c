@@ -430,7 +430,7 @@ LUA_FUNCTION(openssl_csr_parse)
         ASSOC_BIO("algorithm");
         */
 
-        PUSH_OBJECT(pubkey,"openssl.evp_pkey");
+        PUSH_OBJECT_REF(pubkey,"openssl.evp_pkey",EVP_PKEY_free);
         lua_insert(L,1);
         openssl_pkey_parse(L);
         lua_setfield(L,-2,"pubkey");
@@ -556,7 +556,12 @@ static LUA_FUNCTION(openssl_csr_free) {
 
 static LUA_FUNCTION(openssl_csr_get_public) {
     X509_REQ *csr = CHECK_OBJECT(1,X509_REQ,"openssl.x509_req");
-    PUSH_OBJECT(csr->req_info->pubkey,"openssl.evp_pkey");
+    EVP_PKEY *pubkey = X509_REQ_get_pubkey(csr);
+    if (pubkey == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    PUSH_OBJECT_REF(pubkey,"openssl.evp_pkey",EVP_PKEY_free);
     return 1;
 }
 
@@ -0,0 +1,217 @@
+/*=========================================================================*\
+* ssl_ctx slot
+* lua-openssl toolkit
+*
+* a slot holds the ssl_ctx given to new connections. a reloaded certificate
+* is loaded into a new ssl_ctx aside, then published by swap of the pointer.
+* ssl made before keep their ssl_ctx until they are freed, the old ssl_ctx
+* is released with its last connection. new ssl_ctx share session cache,
+* ticket keys and sni router of old one, so sessions resume across reload.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+typedef struct {
+#ifdef PTHREADS
+	pthread_mutex_t lock;
+#endif
+	SSL_CTX *ctx;
+	unsigned long generation;
+} CTX_SLOT;
+
+static void ctx_slot_lock(CTX_SLOT *slot)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&slot->lock);
+#else
+	(void)slot;
+#endif
+}
+
+static void ctx_slot_unlock(CTX_SLOT *slot)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&slot->lock);
+#else
+	(void)slot;
+#endif
+}
+
+/* current ctx with a reference, lock only cover pointer read and up_ref */
+static SSL_CTX *ctx_slot_get(CTX_SLOT *slot)
+{
+	SSL_CTX *ctx;
+	ctx_slot_lock(slot);
+	ctx = slot->ctx;
+	SSL_CTX_up_ref(ctx);
+	ctx_slot_unlock(slot);
+	return ctx;
+}
+
+/* publish ctx, return the old one, caller own its reference */
+static SSL_CTX *ctx_slot_swap(CTX_SLOT *slot, SSL_CTX *ctx)
+{
+	SSL_CTX *old;
+	SSL_CTX_up_ref(ctx);
+	ctx_slot_lock(slot);
+	old = slot->ctx;
+	slot->ctx = ctx;
+	slot->generation++;
+	ctx_slot_unlock(slot);
+	return old;
+}
+
+/* make to resume sessions of from: session cache, ticket keys, sni router */
+int openssl_ssl_ctx_share_state(SSL_CTX *to, SSL_CTX *from)
+{
+	TICKET_CTX *t;
+	SNI_ROUTER *r;
+
+	if (to == from)
+		return 1;
+	if (!openssl_session_cache_share(from, to))
+		return 0;
+	SSL_CTX_set_timeout(to, SSL_CTX_get_timeout(from));
+
+	t = openssl_ssl_ctx_ticket_ctx(from);
+	if (t) {
+		if (!openssl_ssl_ctx_set_ticket_ctx(to, t))
+			return 0;
+	} else if (openssl_ssl_ctx_ticket_ctx(to) == NULL) {
+		/* keys made by OpenSSL for from, 80 bytes since 1.1.0, 48 before */
+		unsigned char keys[80];
+		if (SSL_CTX_get_tlsext_ticket_keys(from, keys, sizeof(keys)) > 0)
+			SSL_CTX_set_tlsext_ticket_keys(to, keys, sizeof(keys));
+		else if (SSL_CTX_get_tlsext_ticket_keys(from, keys, 48) > 0)
+			SSL_CTX_set_tlsext_ticket_keys(to, keys, 48);
+		OPENSSL_cleanse(keys, sizeof(keys));
+	}
+
+	r = openssl_ssl_ctx_get_sni_router(from);
+	if (r && !openssl_ssl_ctx_set_sni_router(to, r))
+		return 0;
+	return 1;
+}
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:inherit(ssl_ctx from) -> boolean {{{1
+	share session cache, ticket keys and sni router of from, sessions made
+	by from resume on ctx. session id context is not copied, set the same
+	one on both ctx
+*/
+LUA_FUNCTION(openssl_ssl_ctx_inherit)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	SSL_CTX *from = CHECK_OBJECT(2, SSL_CTX, "openssl.ssl_ctx");
+	lua_pushboolean(L, openssl_ssl_ctx_share_state(ctx, from));
+	return 1;
+}
+/* }}} */
+
+/*  openssl.ssl_ctx_slot(ssl_ctx ctx) -> ssl_ctx_slot {{{1
+	slot:get() -> ssl_ctx
+	slot:publish(ssl_ctx ctx [, boolean inherit=true]) -> ssl_ctx old
+	slot:generation() -> number
+	slot:ssl(number fd | bio rbio [, bio wbio] [, boolean server=false]) -> ssl
+	ssl made by slot:ssl use ssl_ctx published at that time. publish inherit
+	session state from current ctx unless inherit is false
+*/
+LUA_FUNCTION(openssl_ssl_ctx_slot)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	CTX_SLOT *slot = (CTX_SLOT *)malloc(sizeof(CTX_SLOT));
+	if (slot == NULL)
+		luaL_error(L, "out of memory");
+#ifdef PTHREADS
+	pthread_mutex_init(&slot->lock, NULL);
+#endif
+	SSL_CTX_up_ref(ctx);
+	slot->ctx = ctx;
+	slot->generation = 0;
+	PUSH_OBJECT(slot, "openssl.ssl_ctx_slot");
+	return 1;
+}
+
+static int openssl_ctx_slot_get(lua_State *L)
+{
+	CTX_SLOT *slot = CHECK_OBJECT(1, CTX_SLOT, "openssl.ssl_ctx_slot");
+	SSL_CTX *ctx = ctx_slot_get(slot);
+	PUSH_OBJECT_REF(ctx, "openssl.ssl_ctx", SSL_CTX_free);
+	return 1;
+}
+
+static int openssl_ctx_slot_publish(lua_State *L)
+{
+	CTX_SLOT *slot = CHECK_OBJECT(1, CTX_SLOT, "openssl.ssl_ctx_slot");
+	SSL_CTX *ctx = CHECK_OBJECT(2, SSL_CTX, "openssl.ssl_ctx");
+	int inherit = lua_isnoneornil(L, 3) ? 1 : auxiliar_checkboolean(L, 3);
+	SSL_CTX *old;
+
+	if (inherit) {
+		SSL_CTX *cur = ctx_slot_get(slot);
+		int ret = openssl_ssl_ctx_share_state(ctx, cur);
+		SSL_CTX_free(cur);
+		if (!ret)
+			luaL_error(L, "inherit session state fail");
+	}
+	old = ctx_slot_swap(slot, ctx);
+	PUSH_OBJECT_REF(old, "openssl.ssl_ctx", SSL_CTX_free);
+	return 1;
+}
+
+static int openssl_ctx_slot_generation(lua_State *L)
+{
+	CTX_SLOT *slot = CHECK_OBJECT(1, CTX_SLOT, "openssl.ssl_ctx_slot");
+	unsigned long n;
+	ctx_slot_lock(slot);
+	n = slot->generation;
+	ctx_slot_unlock(slot);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static int openssl_ctx_slot_ssl(lua_State *L)
+{
+	CTX_SLOT *slot = CHECK_OBJECT(1, CTX_SLOT, "openssl.ssl_ctx_slot");
+	SSL_CTX *ctx = ctx_slot_get(slot);
+	/* as ctx:ssl(...), reference of ctx is released by gc */
+	PUSH_OBJECT_REF(ctx, "openssl.ssl_ctx", SSL_CTX_free);
+	lua_replace(L, 1);
+	return openssl_ssl_ctx_new_ssl(L);
+}
+
+static int openssl_ctx_slot_gc(lua_State *L)
+{
+	CTX_SLOT *slot = CHECK_OBJECT(1, CTX_SLOT, "openssl.ssl_ctx_slot");
+	SSL_CTX_free(slot->ctx);
+#ifdef PTHREADS
+	pthread_mutex_destroy(&slot->lock);
+#endif
+	free(slot);
+	return 0;
+}
+
+static luaL_Reg ctx_slot_funcs[] = {
+	{"get",			openssl_ctx_slot_get},
+	{"publish",		openssl_ctx_slot_publish},
+	{"generation",		openssl_ctx_slot_generation},
+	{"ssl",			openssl_ctx_slot_ssl},
+
+	{"__gc",		openssl_ctx_slot_gc},
+	{"__tostring",		auxiliar_tostring},
+
+	{NULL,			NULL},
+};
+
+int openssl_register_ctx_slot(lua_State *L)
+{
+	auxiliar_newclass(L, "openssl.ssl_ctx_slot", ctx_slot_funcs);
+	return 0;
+}
@@ -37,7 +37,7 @@ int openssl_engine(lua_State *L){
 			"\tnil or none will create a new engine\n"
 			"\tbut we get %s:%s",lua_typename(L,lua_type(L,  1)),lua_tostring(L,1));
 	if(eng){
-		PUSH_OBJECT((void*)eng,"openssl.engine");
+		PUSH_OBJECT_REF((ENGINE*)eng,"openssl.engine",ENGINE_free);
 	}else
 		lua_pushnil(L);
 	return 1;
@@ -46,9 +46,11 @@ int openssl_engine(lua_State *L){
 static int openssl_engine_next(lua_State*L)
 {
 	ENGINE* eng = CHECK_OBJECT(1,ENGINE,"openssl.engine");
+	/* get_next release reference it is given, keep the one of #1 */
+	ENGINE_up_ref(eng);
 	eng = ENGINE_get_next(eng);
 	if(eng){
-		PUSH_OBJECT(eng,"openssl.engine");
+		PUSH_OBJECT_REF(eng,"openssl.engine",ENGINE_free);
 	}else
 		lua_pushnil(L);
 	return 1;
@@ -57,9 +59,10 @@ static int openssl_engine_next(lua_State*L)
 static int openssl_engine_prev(lua_State*L)
 {
 	ENGINE* eng = CHECK_OBJECT(1,ENGINE,"openssl.engine");
+	ENGINE_up_ref(eng);
 	eng = ENGINE_get_prev(eng);
 	if(eng){
-		PUSH_OBJECT(eng,"openssl.engine");
+		PUSH_OBJECT_REF(eng,"openssl.engine",ENGINE_free);
 	}else
 		lua_pushnil(L);
 	return 1;
@@ -20,11 +20,22 @@
 * This product includes PHP software, freely available from <http://www.php.net/software/>
 * Author:  george zhao <zhaozg(at)gmail.com>
 \*=========================================================================*/
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* dladdr */
+#endif
 #include "openssl.h"
 #include <openssl/ssl.h>
 #include <openssl/asn1.h>
 #include <openssl/engine.h>
 #include <openssl/opensslconf.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#if defined(__GLIBC__)
+#include <link.h>
+#endif
+#endif
 
 #if LUA_VERSION_NUM>501
 int luaL_typerror (lua_State *L, int narg, const char *tname) {
@@ -128,6 +139,45 @@ int openssl_topointer(lua_State*L){
 	return 1;
 }
 
+/* registry key of weak valued table, native pointer -> userdata */
+static const char *objects_cache = "openssl.objects";
+
+/* push userdata of p with class tname, the userdata already made for p is
+   reused while still alive. return 1 if a new userdata is created, 0 if not,
+   caller hold a reference for new userdata must release it when 0 returned */
+int openssl_pushobject(lua_State *L, void *p, const char *tname)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, objects_cache);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushliteral(L, "v");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, objects_cache);
+	}
+	if (p != NULL) {
+		lua_pushlightuserdata(L, p);
+		lua_rawget(L, -2);
+		if (auxiliar_isclass(L, tname, -1)) {
+			lua_remove(L, -2);
+			return 0;
+		}
+		lua_pop(L, 1);
+	}
+	*(void **)lua_newuserdata(L, sizeof(void *)) = p;
+	auxiliar_setclass(L, tname, -1);
+	if (p != NULL) {
+		lua_pushlightuserdata(L, p);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+	return 1;
+}
+
 
 const BIT_STRING_BITNAME reason_flags[] = {
 	{0, "Unused", "unused"},
@@ -157,6 +207,11 @@ static const luaL_Reg eay_functions[] = {
     {"x509_read",			openssl_x509_read	},
     {"sk_x509_read",			openssl_sk_x509_read	},
     {"sk_x509_new",			openssl_sk_x509_new	},
+    {"x509_index",			openssl_x509_index_new	},
+    {"x509_store_new",			openssl_x509_store_new	},
+    {"x509_store_load_snapshot",	openssl_x509_store_load_snapshot	},
+    {"buffer_new",			openssl_buffer_new	},
+    {"x509_verify_many",		openssl_x509_verify_many	},
 
 
     /* CSR funcs */
@@ -178,6 +233,10 @@ static const luaL_Reg eay_functions[] = {
     {"bio_new_file",		openssl_bio_new_file	},
     {"bio_new_mem",			openssl_bio_new_mem	   },
 	{"bio_new_accept",		openssl_bio_new_accept },
+	{"bio_pair",			openssl_bio_pair },
+	{"bio_new_custom",	openssl_bio_new_custom },
+	{"ssl_ctx_slot",		openssl_ssl_ctx_slot },
+	{"ssl_client_pool",	openssl_ssl_client_pool },
 
     {"sign",				openssl_sign	},
     {"verify",				openssl_verify	},
@@ -806,12 +865,44 @@ LUA_FUNCTION(openssl_dh_compute_key)
 }
 /* }}} */
 
+/* keep this module mapped until process exit, lua_close unloads it but
+   OpenSSL allocator and worker threads still call into it. 1 when pinned */
+int openssl_module_pin(void)
+{
+    static int pinned = -1;
+    if (pinned < 0) {
+#if defined(_WIN32)
+        HMODULE h;
+        pinned = GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+                                    (LPCSTR)openssl_module_pin, &h) != 0;
+#elif defined(RTLD_NODELETE)
+        Dl_info info;
+#if defined(__GLIBC__)
+        struct link_map *map = NULL;
+        pinned = dladdr1((void *)openssl_module_pin, &info, (void **)&map, RTLD_DL_LINKMAP) != 0;
+        /* linked into the program itself, it is never unloaded */
+        if (pinned && map && map->l_name[0] == '\0')
+            return pinned;
+#else
+        pinned = dladdr((void *)openssl_module_pin, &info) != 0;
+#endif
+        pinned = pinned && info.dli_fname
+                 && dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE) != NULL;
+#else
+        pinned = 0;
+#endif
+    }
+    return pinned;
+}
+
 void CRYPTO_thread_setup(void);
 void CRYPTO_thread_cleanup(void);
 int luaopen_bn(lua_State *L);
 LUA_API int luaopen_openssl(lua_State*L)
 {
     char * config_filename;
+    /* before any allocation of OpenSSL */
+    openssl_mem_init();
     CRYPTO_thread_setup();
 
     OpenSSL_add_all_ciphers();
@@ -847,7 +938,13 @@ LUA_API int luaopen_openssl(lua_State*L)
     openssl_register_digest(L);
     openssl_register_cipher(L);
     openssl_register_sk_x509(L);
+    openssl_register_x509_index(L);
+    openssl_register_x509_store(L);
     openssl_register_bio(L);
+    openssl_register_buffer(L);
+    openssl_register_sni_router(L);
+    openssl_register_ctx_slot(L);
+    openssl_register_client_pool(L);
     openssl_register_crl(L);
 #ifdef OPENSSL_HAVE_TS
     openssl_register_ts(L);
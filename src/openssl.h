@@ -54,6 +54,14 @@ int luaL_typerror (lua_State *L, int narg, const char *tname);
 #endif
 typedef unsigned char byte;
 
+/* reference counting, OpenSSL 1.1.0 made the references field opaque */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_up_ref(x)	CRYPTO_add(&(x)->references,1,CRYPTO_LOCK_X509)
+#define X509_STORE_up_ref(x)	CRYPTO_add(&(x)->references,1,CRYPTO_LOCK_X509_STORE)
+#define SSL_CTX_up_ref(x)	CRYPTO_add(&(x)->references,1,CRYPTO_LOCK_SSL_CTX)
+#define BIO_up_ref(x)	CRYPTO_add(&(x)->references,1,CRYPTO_LOCK_BIO)
+#endif
+
 #define MULTI_LINE_MACRO_BEGIN do {  
 #ifdef _MSC_VER
 #define MULTI_LINE_MACRO_END	\
@@ -138,9 +146,13 @@ int openssl_get_revoke_reason(const char*s);
 LUA_FUNCTION(openssl_bio_new_mem);
 LUA_FUNCTION(openssl_bio_new_file);
 LUA_FUNCTION(openssl_bio_new_accept);
+LUA_FUNCTION(openssl_bio_pair);
+LUA_FUNCTION(openssl_bio_new_custom);
+LUA_FUNCTION(openssl_bio_callback_error);
 LUA_FUNCTION(openssl_bio_read);
 LUA_FUNCTION(openssl_bio_gets);
 LUA_FUNCTION(openssl_bio_write);
+LUA_FUNCTION(openssl_bio_writev);
 LUA_FUNCTION(openssl_bio_puts);
 LUA_FUNCTION(openssl_bio_get_mem);
 LUA_FUNCTION(openssl_bio_close);
@@ -268,6 +280,11 @@ LUA_FUNCTION(openssl_x509_tostring);
 LUA_FUNCTION(openssl_x509_public_key);
 LUA_FUNCTION(openssl_sk_x509_read);
 LUA_FUNCTION(openssl_sk_x509_new);
+LUA_FUNCTION(openssl_x509_index_new);
+LUA_FUNCTION(openssl_x509_store_new);
+LUA_FUNCTION(openssl_x509_store_load_snapshot);
+LUA_FUNCTION(openssl_buffer_new);
+LUA_FUNCTION(openssl_x509_verify_many);
 
 LUA_FUNCTION(openssl_ssl_ctx_new);
 LUA_FUNCTION(openssl_ssl_session_read);
@@ -284,10 +301,19 @@ void openssl_add_method(const OBJ_NAME *name, void *arg);
 
 #define CHECK_OBJECT(n,type,name) *(type**)luaL_checkudata(L,n,name)
 
+int openssl_pushobject(lua_State *L, void *p, const char *tname);
+
+/* same native object is always pushed as same userdata while it is alive */
 #define PUSH_OBJECT(o, tname)		\
 	MULTI_LINE_MACRO_BEGIN		\
-	*(void **)(lua_newuserdata(L, sizeof(void *))) = (o);	\
-	auxiliar_setclass(L,tname,-1);	\
+	openssl_pushobject(L, (void *)(o), tname);	\
+	MULTI_LINE_MACRO_END
+
+/* o carries a reference for new userdata, release it when userdata reused */
+#define PUSH_OBJECT_REF(o, tname, release)	\
+	MULTI_LINE_MACRO_BEGIN		\
+	if (!openssl_pushobject(L, (void *)(o), tname))	\
+		release(o);		\
 	MULTI_LINE_MACRO_END
 
 #define ADD_ASSOC_BIO(bio, key)	MULTI_LINE_MACRO_BEGIN	\
@@ -321,6 +347,75 @@ void openssl_add_method(const OBJ_NAME *name, void *arg);
 	MULTI_LINE_MACRO_END
 
 
+typedef struct x509_index_st X509_INDEX;
+void openssl_x509_index_free(X509_INDEX *idx);
+X509 *openssl_x509_index_issuer(X509_INDEX *idx, X509 *x);
+int openssl_x509_store_attach_index(X509_STORE *store, X509_INDEX *idx);
+int openssl_x509_store_get1_issuer(X509 **issuer, X509_STORE_CTX *ctx, X509 *x);
+
+char *openssl_buffer_reserve(BUF_MEM *b, size_t n);
+void openssl_buffer_consume(BUF_MEM *b, size_t n);
+const char *openssl_buffer_piece(lua_State *L, int idx, int i, size_t *len, BUF_MEM **b);
+void openssl_buffer_consumev(lua_State *L, int idx, size_t n);
+
+BIO *openssl_bio_network(BIO *bio);
+
+int openssl_session_cache_attach(SSL_CTX *ctx, const char *path, size_t size, const char **err);
+int openssl_session_cache_pushstats(lua_State *L, SSL_CTX *ctx);
+
+typedef struct ticket_ctx_st TICKET_CTX;
+void openssl_ticket_ctx_free(TICKET_CTX *t);
+TICKET_CTX *openssl_ssl_ctx_ticket_ctx(SSL_CTX *ctx);
+int openssl_ssl_ctx_set_ticket_ctx(SSL_CTX *ctx, TICKET_CTX *t);
+LUA_FUNCTION(openssl_ssl_ctx_ticket_keys);
+
+typedef struct sni_router_st SNI_ROUTER;
+SNI_ROUTER *openssl_sni_router_new(void);
+void openssl_sni_router_up_ref(SNI_ROUTER *r);
+void openssl_sni_router_free(SNI_ROUTER *r);
+int openssl_sni_router_add(SNI_ROUTER *r, const char *name, size_t len, SSL_CTX *ctx);
+int openssl_sni_router_remove(SNI_ROUTER *r, const char *name, size_t len);
+SSL_CTX *openssl_sni_router_lookup(SNI_ROUTER *r, const char *name, size_t len);
+SNI_ROUTER *openssl_ssl_ctx_get_sni_router(SSL_CTX *ctx);
+int openssl_ssl_ctx_set_sni_router(SSL_CTX *ctx, SNI_ROUTER *r);
+SSL_CTX *openssl_ssl_session_ctx(SSL *s);
+LUA_FUNCTION(openssl_ssl_ctx_sni_router);
+
+int openssl_session_cache_share(SSL_CTX *from, SSL_CTX *to);
+int openssl_ssl_ctx_share_state(SSL_CTX *to, SSL_CTX *from);
+LUA_FUNCTION(openssl_ssl_ctx_new_ssl);
+LUA_FUNCTION(openssl_ssl_ctx_inherit);
+LUA_FUNCTION(openssl_ssl_ctx_slot);
+LUA_FUNCTION(openssl_ssl_client_pool);
+
+LUA_FUNCTION(openssl_ssl_ctx_async_keys);
+LUA_FUNCTION(openssl_ssl_ctx_async_ready);
+
+int openssl_module_pin(void);
+int openssl_mem_init(void);
+long openssl_mem_mark(void);
+void openssl_mem_account(SSL *s, long mark);
+LUA_FUNCTION(openssl_ssl_ctx_low_memory);
+LUA_FUNCTION(openssl_ssl_ctx_memory_stats);
+LUA_FUNCTION(openssl_ssl_memory_usage);
+
+LUA_FUNCTION(openssl_ssl_ctx_telemetry);
+LUA_FUNCTION(openssl_ssl_ctx_handshake_stats);
+
+void openssl_ssl_ctx_staple_release(lua_State *L, SSL_CTX *ctx);
+LUA_FUNCTION(openssl_ssl_ctx_ocsp_staple);
+LUA_FUNCTION(openssl_ssl_ctx_ocsp_refresh);
+LUA_FUNCTION(openssl_ssl_ctx_ocsp_stats);
+LUA_FUNCTION(openssl_ssl_ocsp_request);
+LUA_FUNCTION(openssl_ssl_ocsp_staple);
+
+LUA_FUNCTION(openssl_ssl_ctx_cert_compression);
+
+LUA_FUNCTION(openssl_ssl_ctx_alpn);
+LUA_FUNCTION(openssl_ssl_ctx_alpn_stats);
+LUA_FUNCTION(openssl_ssl_alpn);
+LUA_FUNCTION(openssl_ssl_alpn_selected);
+
 void add_assoc_name_entry(lua_State*L, const  char *key, X509_NAME *name, int shortname);
 void add_assoc_x509_extension(lua_State*L, const char* key, STACK_OF(X509_EXTENSION)* ext, BIO* bio);
 
@@ -335,6 +430,13 @@ int openssl_register_digest(lua_State* L);
 int openssl_register_cipher(lua_State* L);
 int openssl_register_x509(lua_State* L);
 int openssl_register_sk_x509(lua_State* L);
+STACK_OF(X509)* openssl_sk_x509_dup(STACK_OF(X509) *sk);
+int openssl_register_x509_index(lua_State* L);
+int openssl_register_x509_store(lua_State* L);
+int openssl_register_buffer(lua_State* L);
+int openssl_register_sni_router(lua_State* L);
+int openssl_register_ctx_slot(lua_State* L);
+int openssl_register_client_pool(lua_State* L);
 int openssl_register_pkey(lua_State* L);
 int openssl_register_csr(lua_State* L);
 int openssl_register_bio(lua_State* L);
@@ -690,7 +690,7 @@ LUA_FUNCTION(openssl_ts_verify_ctx_new) {
 	    if(top>2)
 	    {
 		    if(auxiliar_isclass(L,"openssl.stack_of_x509",3)){
-			ctx->certs = sk_X509_dup(CHECK_OBJECT(3,STACK_OF(X509), "openssl.stack_of_x509"));
+			ctx->certs = openssl_sk_x509_dup(CHECK_OBJECT(3,STACK_OF(X509), "openssl.stack_of_x509"));
 		    }else if(auxiliar_isclass(L,"openssl.x509",3)){
 			X509* x = auxiliar_checkclass(L,"openssl.x509",3);
 			ctx->certs = sk_X509_new_null();
@@ -240,7 +240,7 @@ LUA_FUNCTION(openssl_pkcs7_parse)
 
     if (certs != NULL)
     {
-        PUSH_OBJECT(sk_X509_dup(certs), "openssl.stack_of_x509");
+        PUSH_OBJECT(openssl_sk_x509_dup(certs), "openssl.stack_of_x509");
         lua_setfield(L,-2, "certs");
     }
     if (crls != NULL)
@@ -123,8 +123,9 @@ int openssl_pkey_read(lua_State*L)
         }
     }
 
+    /* every branch took a reference, #1 itself may come back */
     if (key)
-        PUSH_OBJECT(key,"openssl.evp_pkey");
+        PUSH_OBJECT_REF(key,"openssl.evp_pkey",EVP_PKEY_free);
     else
         lua_pushnil(L);
     return 1;
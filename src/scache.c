@@ -0,0 +1,539 @@
+/*=========================================================================*\
+* ssl session cache in shared memory
+* lua-openssl toolkit
+*
+* prefork workers map one file, a session made by a worker can be resumed
+* by any other. table is split to stripes, each stripe has its own process
+* shared mutex, hash buckets, slots and LRU list, so workers seldom wait
+* each other and a full stripe evicts its least recently used session.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <time.h>
+
+#if !defined(_WIN32) && defined(PTHREADS)
+#define SCACHE_SHM
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef SCACHE_SHM
+/*
+ * file layout
+ *
+ *   SCACHE_HDR                      magic, geometry, stripes
+ *   buckets[stripes][nbuckets]      slot index of hash chain head
+ *   slots[stripes][nslots]          session id and DER
+ *
+ * slot index SCACHE_NIL is end of list
+ */
+#define SCACHE_MAGIC		"LOSCACH1"
+#define SCACHE_STRIPES		16
+#define SCACHE_DATA		2048	/* session DER larger is not cached */
+#define SCACHE_NIL		0xffffffffU
+
+typedef struct {
+	unsigned int next;		/* hash chain or free list */
+	unsigned int lru_prev;
+	unsigned int lru_next;
+	unsigned int hash;
+	time_t expire;
+	unsigned short idlen;
+	unsigned short len;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned char der[SCACHE_DATA];
+} SCACHE_SLOT;
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned int lru_head;		/* most recently used */
+	unsigned int lru_tail;
+	unsigned int free;
+	unsigned int used;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long stores;
+	unsigned long removes;
+} SCACHE_STRIPE;
+
+typedef struct {
+	char magic[8];
+	unsigned long size;
+	unsigned int nslots;		/* per stripe */
+	unsigned int nbuckets;		/* per stripe */
+	SCACHE_STRIPE stripes[SCACHE_STRIPES];
+} SCACHE_HDR;
+
+typedef struct {
+	SCACHE_HDR *hdr;
+	size_t size;
+	unsigned int *buckets;
+	SCACHE_SLOT *slots;
+	int refs;			/* SSL_CTX sharing this mapping */
+} SCACHE;
+
+static pthread_mutex_t scache_refs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SCACHE_BUCKET(c, s, h)	((c)->buckets[(s) * (c)->hdr->nbuckets + ((h) / SCACHE_STRIPES) % (c)->hdr->nbuckets])
+#define SCACHE_SLOT_AT(c, s, i)	(&(c)->slots[(size_t)(s) * (c)->hdr->nslots + (i)])
+
+static unsigned int scache_hash(const unsigned char *id, unsigned int len)
+{
+	unsigned int h = 2166136261U;
+	unsigned int i;
+	for (i = 0; i < len; i++) {
+		h ^= id[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void scache_geometry(SCACHE *c)
+{
+	c->buckets = (unsigned int *)(c->hdr + 1);
+	c->slots = (SCACHE_SLOT *)(c->buckets + (size_t)SCACHE_STRIPES * c->hdr->nbuckets);
+}
+
+/* all sessions of stripe s are dropped */
+static void scache_stripe_reset(SCACHE *c, unsigned int s)
+{
+	SCACHE_STRIPE *st = &c->hdr->stripes[s];
+	unsigned int i;
+	for (i = 0; i < c->hdr->nbuckets; i++)
+		c->buckets[s * c->hdr->nbuckets + i] = SCACHE_NIL;
+	for (i = 0; i < c->hdr->nslots; i++)
+		SCACHE_SLOT_AT(c, s, i)->next = i + 1 < c->hdr->nslots ? i + 1 : SCACHE_NIL;
+	st->free = 0;
+	st->lru_head = st->lru_tail = SCACHE_NIL;
+	st->used = 0;
+}
+
+static int scache_init(SCACHE *c, size_t size)
+{
+	size_t per = sizeof(SCACHE_SLOT) + sizeof(unsigned int);
+	size_t n = size > sizeof(SCACHE_HDR) ? (size - sizeof(SCACHE_HDR)) / per / SCACHE_STRIPES : 0;
+	pthread_mutexattr_t attr;
+	unsigned int s;
+
+	if (n == 0 || n >= SCACHE_NIL)
+		return 0;
+	memset(c->hdr, 0, sizeof(SCACHE_HDR));
+	c->hdr->size = size;
+	c->hdr->nslots = c->hdr->nbuckets = (unsigned int)n;
+	scache_geometry(c);
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	for (s = 0; s < SCACHE_STRIPES; s++) {
+		pthread_mutex_init(&c->hdr->stripes[s].lock, &attr);
+		scache_stripe_reset(c, s);
+	}
+	pthread_mutexattr_destroy(&attr);
+	memcpy(c->hdr->magic, SCACHE_MAGIC, sizeof(c->hdr->magic));
+	return 1;
+}
+
+static SCACHE_STRIPE *scache_lock(SCACHE *c, unsigned int s)
+{
+	SCACHE_STRIPE *st = &c->hdr->stripes[s];
+	int ret = pthread_mutex_lock(&st->lock);
+#ifdef __linux__
+	if (ret == EOWNERDEAD) {
+		/* a worker died in the middle of update, stripe may be broken */
+		scache_stripe_reset(c, s);
+		pthread_mutex_consistent(&st->lock);
+	}
+#else
+	(void)ret;
+#endif
+	return st;
+}
+
+static unsigned int scache_find(SCACHE *c, unsigned int s, unsigned int h,
+                                const unsigned char *id, unsigned int idlen)
+{
+	unsigned int i = SCACHE_BUCKET(c, s, h);
+	while (i != SCACHE_NIL) {
+		SCACHE_SLOT *slot = SCACHE_SLOT_AT(c, s, i);
+		if (slot->hash == h && slot->idlen == idlen && memcmp(slot->id, id, idlen) == 0)
+			return i;
+		i = slot->next;
+	}
+	return SCACHE_NIL;
+}
+
+static void scache_lru_unlink(SCACHE *c, unsigned int s, unsigned int i)
+{
+	SCACHE_STRIPE *st = &c->hdr->stripes[s];
+	SCACHE_SLOT *slot = SCACHE_SLOT_AT(c, s, i);
+	if (slot->lru_prev != SCACHE_NIL)
+		SCACHE_SLOT_AT(c, s, slot->lru_prev)->lru_next = slot->lru_next;
+	else
+		st->lru_head = slot->lru_next;
+	if (slot->lru_next != SCACHE_NIL)
+		SCACHE_SLOT_AT(c, s, slot->lru_next)->lru_prev = slot->lru_prev;
+	else
+		st->lru_tail = slot->lru_prev;
+}
+
+static void scache_lru_push(SCACHE *c, unsigned int s, unsigned int i)
+{
+	SCACHE_STRIPE *st = &c->hdr->stripes[s];
+	SCACHE_SLOT *slot = SCACHE_SLOT_AT(c, s, i);
+	slot->lru_prev = SCACHE_NIL;
+	slot->lru_next = st->lru_head;
+	if (st->lru_head != SCACHE_NIL)
+		SCACHE_SLOT_AT(c, s, st->lru_head)->lru_prev = i;
+	else
+		st->lru_tail = i;
+	st->lru_head = i;
+}
+
+/* unlink slot i from hash chain and LRU, give it back to free list */
+static void scache_release(SCACHE *c, unsigned int s, unsigned int i)
+{
+	SCACHE_STRIPE *st = &c->hdr->stripes[s];
+	SCACHE_SLOT *slot = SCACHE_SLOT_AT(c, s, i);
+	unsigned int *p = &SCACHE_BUCKET(c, s, slot->hash);
+	while (*p != i)
+		p = &SCACHE_SLOT_AT(c, s, *p)->next;
+	*p = slot->next;
+	scache_lru_unlink(c, s, i);
+	slot->next = st->free;
+	st->free = i;
+	st->used--;
+}
+
+static void scache_store(SCACHE *c, const unsigned char *id, unsigned int idlen,
+                         const unsigned char *der, int len, time_t expire)
+{
+	unsigned int h = scache_hash(id, idlen);
+	unsigned int s = h % SCACHE_STRIPES;
+	SCACHE_STRIPE *st = scache_lock(c, s);
+	SCACHE_SLOT *slot;
+	unsigned int i = scache_find(c, s, h, id, idlen);
+
+	if (i != SCACHE_NIL)
+		scache_release(c, s, i);
+	if (st->free == SCACHE_NIL) {
+		scache_release(c, s, st->lru_tail);
+		st->evictions++;
+	}
+	i = st->free;
+	slot = SCACHE_SLOT_AT(c, s, i);
+	st->free = slot->next;
+
+	slot->hash = h;
+	slot->expire = expire;
+	slot->idlen = (unsigned short)idlen;
+	slot->len = (unsigned short)len;
+	memcpy(slot->id, id, idlen);
+	memcpy(slot->der, der, len);
+	slot->next = SCACHE_BUCKET(c, s, h);
+	SCACHE_BUCKET(c, s, h) = i;
+	scache_lru_push(c, s, i);
+	st->used++;
+	st->stores++;
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* copy DER of session to der, return its length or 0 when miss */
+static int scache_lookup(SCACHE *c, const unsigned char *id, unsigned int idlen, unsigned char *der)
+{
+	unsigned int h = scache_hash(id, idlen);
+	unsigned int s = h % SCACHE_STRIPES;
+	SCACHE_STRIPE *st = scache_lock(c, s);
+	unsigned int i = scache_find(c, s, h, id, idlen);
+	int len = 0;
+
+	if (i != SCACHE_NIL) {
+		SCACHE_SLOT *slot = SCACHE_SLOT_AT(c, s, i);
+		if (slot->expire < time(NULL))
+			scache_release(c, s, i);
+		else {
+			len = slot->len;
+			memcpy(der, slot->der, len);
+			scache_lru_unlink(c, s, i);
+			scache_lru_push(c, s, i);
+		}
+	}
+	if (len)
+		st->hits++;
+	else
+		st->misses++;
+	pthread_mutex_unlock(&st->lock);
+	return len;
+}
+
+static void scache_remove(SCACHE *c, const unsigned char *id, unsigned int idlen)
+{
+	unsigned int h = scache_hash(id, idlen);
+	unsigned int s = h % SCACHE_STRIPES;
+	SCACHE_STRIPE *st = scache_lock(c, s);
+	unsigned int i = scache_find(c, s, h, id, idlen);
+	if (i != SCACHE_NIL) {
+		scache_release(c, s, i);
+		st->removes++;
+	}
+	pthread_mutex_unlock(&st->lock);
+}
+
+/* map path, file is created and formatted when not a cache, else size is ignored */
+static SCACHE *scache_open(const char *path, size_t size, const char **err)
+{
+	SCACHE *c = NULL;
+	struct stat st;
+	void *p;
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	int init = 0;
+
+	if (fd < 0) {
+		*err = strerror(errno);
+		return NULL;
+	}
+	/* only one process formats file */
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+		*err = strerror(errno);
+		goto done;
+	}
+	if ((size_t)st.st_size >= sizeof(SCACHE_HDR)) {
+		SCACHE_HDR hdr;
+		if (pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr)
+		        && memcmp(hdr.magic, SCACHE_MAGIC, sizeof(hdr.magic)) == 0
+		        && hdr.size == (unsigned long)st.st_size)
+			size = (size_t)st.st_size;
+		else
+			init = 1;
+	} else
+		init = 1;
+	if (init && ftruncate(fd, (off_t)size) != 0) {
+		*err = strerror(errno);
+		goto done;
+	}
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		*err = strerror(errno);
+		goto done;
+	}
+	c = (SCACHE *)malloc(sizeof(SCACHE));
+	if (c == NULL) {
+		*err = "out of memory";
+		munmap(p, size);
+		goto done;
+	}
+	c->hdr = (SCACHE_HDR *)p;
+	c->size = size;
+	c->refs = 1;
+	if (init) {
+		if (!scache_init(c, size)) {
+			*err = "size too small";
+			munmap(p, size);
+			free(c);
+			c = NULL;
+		}
+	} else
+		scache_geometry(c);
+done:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return c;
+}
+
+static void scache_close(SCACHE *c)
+{
+	int refs;
+	pthread_mutex_lock(&scache_refs_lock);
+	refs = --c->refs;
+	pthread_mutex_unlock(&scache_refs_lock);
+	if (refs > 0)
+		return;
+	munmap(c->hdr, c->size);
+	free(c);
+}
+
+/****************************** SSL_CTX callbacks ******************************/
+static int scache_ctx_idx = -1;
+
+static void scache_ctx_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (ptr)
+		scache_close((SCACHE *)ptr);
+}
+
+static SCACHE *scache_from_ctx(SSL_CTX *ctx)
+{
+	if (scache_ctx_idx < 0 || ctx == NULL)
+		return NULL;
+	return SSL_CTX_get_ex_data(ctx, scache_ctx_idx);
+}
+
+static int scache_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	SCACHE *c = scache_from_ctx(openssl_ssl_session_ctx(ssl));
+	unsigned char der[SCACHE_DATA];
+	unsigned char *p = der;
+	const unsigned char *id;
+	unsigned int idlen;
+	int len;
+
+	if (c == NULL)
+		return 0;
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (len <= 0 || len > SCACHE_DATA)
+		return 0;
+	i2d_SSL_SESSION(sess, &p);
+	id = SSL_SESSION_get_id(sess, &idlen);
+	scache_store(c, id, idlen, der, len,
+	             (time_t)SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess));
+	/* session not kept, OpenSSL release its reference */
+	return 0;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static SSL_SESSION *scache_get_cb(SSL *ssl, const unsigned char *id, int idlen, int *copy)
+#else
+static SSL_SESSION *scache_get_cb(SSL *ssl, unsigned char *id, int idlen, int *copy)
+#endif
+{
+	SCACHE *c = scache_from_ctx(openssl_ssl_session_ctx(ssl));
+	unsigned char der[SCACHE_DATA];
+	const unsigned char *p = der;
+	int len;
+
+	*copy = 0;
+	if (c == NULL || idlen <= 0 || idlen > SSL_MAX_SSL_SESSION_ID_LENGTH)
+		return NULL;
+	len = scache_lookup(c, id, idlen, der);
+	return len ? d2i_SSL_SESSION(NULL, &p, len) : NULL;
+}
+
+static void scache_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	SCACHE *c = scache_from_ctx(ctx);
+	const unsigned char *id;
+	unsigned int idlen;
+	if (c == NULL)
+		return;
+	id = SSL_SESSION_get_id(sess, &idlen);
+	scache_remove(c, id, idlen);
+}
+#endif /* SCACHE_SHM */
+
+#ifdef SCACHE_SHM
+static int scache_ctx_index(const char **err)
+{
+	if (scache_ctx_idx < 0) {
+		scache_ctx_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, scache_ctx_free);
+		if (scache_ctx_idx < 0) {
+			*err = "SSL_CTX_get_ex_new_index fail";
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* ctx take owner of a reference to c */
+static void scache_ctx_set(SSL_CTX *ctx, SCACHE *c)
+{
+	scache_ctx_free(NULL, scache_from_ctx(ctx), NULL, 0, 0, NULL);
+	SSL_CTX_set_ex_data(ctx, scache_ctx_idx, c);
+	SSL_CTX_sess_set_new_cb(ctx, scache_new_cb);
+	SSL_CTX_sess_set_get_cb(ctx, scache_get_cb);
+	SSL_CTX_sess_set_remove_cb(ctx, scache_remove_cb);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+}
+#endif
+
+/* map session cache at path to ctx, sessions only live in shared memory */
+int openssl_session_cache_attach(SSL_CTX *ctx, const char *path, size_t size, const char **err)
+{
+#ifdef SCACHE_SHM
+	SCACHE *c;
+	if (!scache_ctx_index(err))
+		return 0;
+	c = scache_open(path, size, err);
+	if (c == NULL)
+		return 0;
+	scache_ctx_set(ctx, c);
+	return 1;
+#else
+	(void)ctx; (void)path; (void)size;
+	*err = "not supported";
+	return 0;
+#endif
+}
+
+/* to use same mapping as from, nothing done when from has no cache */
+int openssl_session_cache_share(SSL_CTX *from, SSL_CTX *to)
+{
+#ifdef SCACHE_SHM
+	SCACHE *c = scache_from_ctx(from);
+	if (c == NULL || c == scache_from_ctx(to))
+		return 1;
+	pthread_mutex_lock(&scache_refs_lock);
+	c->refs++;
+	pthread_mutex_unlock(&scache_refs_lock);
+	scache_ctx_set(to, c);
+	return 1;
+#else
+	(void)from; (void)to;
+	return 1;
+#endif
+}
+
+/* push table of counters summed over all processes, nil when no cache */
+int openssl_session_cache_pushstats(lua_State *L, SSL_CTX *ctx)
+{
+#ifdef SCACHE_SHM
+	SCACHE *c = scache_from_ctx(ctx);
+	unsigned long hits = 0, misses = 0, evictions = 0, stores = 0, removes = 0, used = 0;
+	unsigned int s;
+	if (c == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	for (s = 0; s < SCACHE_STRIPES; s++) {
+		SCACHE_STRIPE *st = scache_lock(c, s);
+		hits += st->hits;
+		misses += st->misses;
+		evictions += st->evictions;
+		stores += st->stores;
+		removes += st->removes;
+		used += st->used;
+		pthread_mutex_unlock(&st->lock);
+	}
+	lua_newtable(L);
+	lua_pushinteger(L, hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, evictions);
+	lua_setfield(L, -2, "evictions");
+	lua_pushinteger(L, stores);
+	lua_setfield(L, -2, "stores");
+	lua_pushinteger(L, removes);
+	lua_setfield(L, -2, "removes");
+	lua_pushinteger(L, used);
+	lua_setfield(L, -2, "entries");
+	lua_pushinteger(L, (lua_Integer)c->hdr->nslots * SCACHE_STRIPES);
+	lua_setfield(L, -2, "capacity");
+#else
+	(void)ctx;
+	lua_pushnil(L);
+#endif
+	return 1;
+}
@@ -22,6 +22,12 @@
 \*=========================================================================*/
 #include "openssl.h"
 
+/*
+ * a stack_of_xxx object owns one reference of every element, elements are
+ * shared with Lua objects by reference count, never copied by TYPE_dup.
+ * TYPE##_up_ref is needed, see openssl.h for compat with OpenSSL before 1.1
+ */
+
 #define TAB2SK(TYPE, type) \
 STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 	if (lua_istable(L,idx)) { \
@@ -33,7 +39,7 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 			lua_rawgeti(L, idx, i+1);  \
 			x = CHECK_OBJECT(-1,TYPE,"openssl." #type);  \
 			SKM_sk_push(TYPE, sk, x); \
-			CRYPTO_add(&x->references,1,CRYPTO_LOCK_##TYPE);  \
+			TYPE##_up_ref(x);  \
 			lua_pop(L,1); \
 		} \
 		return sk;  \
@@ -48,12 +54,22 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 	n = SKM_sk_num(TYPE, sk); \
 	for(i=0;i<n;i++) { \
 		TYPE *x =  SKM_sk_value(TYPE, sk, i); \
-		PUSH_OBJECT(TYPE##_dup(x),"openssl."#type); \
+		TYPE##_up_ref(x); \
+		PUSH_OBJECT_REF(x,"openssl."#type, TYPE##_free); \
 		lua_rawseti(L,-2, i+1); \
 	}  \
 	return 1; \
 }
 
+/* shallow copy, every element get a reference for new stack */
+#define SK_DUP(TYPE,type) STACK_OF(TYPE)* openssl_sk_##type##_dup(STACK_OF(TYPE) *sk) { \
+	STACK_OF(TYPE) *ret = SKM_sk_dup(TYPE, sk); \
+	int i; \
+	for(i=0; ret && i<SKM_sk_num(TYPE, ret); i++) \
+		TYPE##_up_ref(SKM_sk_value(TYPE, ret, i)); \
+	return ret; \
+}
+
 #define SK_TOTABLE(TYPE, type) static int sk_##type##_totable(lua_State* L)  { \
 	STACK_OF(TYPE)* sk = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	return _sk_##type##_totable(L, sk);      \
@@ -61,7 +77,7 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 
 #define SK_FREE(TYPE,type) static int sk_##type##_free(lua_State* L) { \
 	STACK_OF(TYPE)* sk = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
-	SKM_sk_free(TYPE, sk); \
+	SKM_sk_pop_free(TYPE, sk, TYPE##_free); \
 	return 0; \
 }
 
@@ -74,15 +90,18 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 #define SK_PUSH(TYPE, type) static int sk_##type##_push(lua_State* L) { \
 	STACK_OF(TYPE) * sk = CHECK_OBJECT(1,STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	TYPE* val = CHECK_OBJECT(2,TYPE, "openssl."#type);  \
-	SKM_sk_push(TYPE, sk, val); \
+	if (SKM_sk_push(TYPE, sk, val)) \
+		TYPE##_up_ref(val); \
 	lua_pushvalue(L,1);  \
 	return 1;   \
 }
 
 #define SK_POP(TYPE, type) static int sk_##type##_pop(lua_State*L) { \
 	STACK_OF(TYPE) * certs = CHECK_OBJECT(1,STACK_OF(TYPE), "openssl.stack_of_"#type); \
-	TYPE* cert = sk_X509_pop(certs);    \
-	PUSH_OBJECT(cert,"openssl."#type); \
+	TYPE* cert = SKM_sk_pop(TYPE, certs);    \
+	if (cert == NULL) \
+		return 0; \
+	PUSH_OBJECT_REF(cert,"openssl."#type, TYPE##_free); \
 	return 1;   \
 }
 
@@ -90,7 +109,8 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 	STACK_OF(TYPE) * st = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	TYPE* val = CHECK_OBJECT(2,TYPE, "openssl."#type); \
 	int i = luaL_checkint(L,3); \
-	sk_X509_insert(st,val,i);  \
+	if (SKM_sk_insert(TYPE, st, val, i)) \
+		TYPE##_up_ref(val); \
 	lua_pushvalue(L,1);  \
 	return 1;  \
 }
@@ -99,8 +119,10 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 #define SK_DELETE(TYPE, type) static int sk_##type##_delete(lua_State*L) { \
 	STACK_OF(TYPE) * st = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	int i = luaL_checkint(L,2);	\
-	sk_X509_delete(st,i); \
-	PUSH_OBJECT(st,"openssl."#type); \
+	TYPE* val = SKM_sk_delete(TYPE, st, i); \
+	if (val == NULL) \
+		return 0; \
+	PUSH_OBJECT_REF(val,"openssl."#type, TYPE##_free); \
 	return 1;  \
 }
 
@@ -108,7 +130,12 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 	STACK_OF(TYPE) * st = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	TYPE* val = CHECK_OBJECT(2,TYPE, "openssl."#type);  \
 	int i = luaL_checkint(L,3);   \
-	SKM_sk_set(TYPE, st, i, val); \
+	TYPE* old = SKM_sk_value(TYPE, st, i); \
+	if (old != NULL) { \
+		TYPE##_up_ref(val); \
+		SKM_sk_set(TYPE, st, i, val); \
+		TYPE##_free(old); \
+	} \
 	lua_pushvalue(L,1);  \
 	return 1;   \
 }
@@ -117,10 +144,29 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 	STACK_OF(TYPE) * st = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	int i = luaL_checkint(L,2);  \
 	TYPE *x = SKM_sk_value(TYPE, st, i); \
-	PUSH_OBJECT(TYPE##_dup(x),"openssl."#type);  \
+	if (x == NULL) \
+		return 0; \
+	TYPE##_up_ref(x); \
+	PUSH_OBJECT_REF(x,"openssl."#type, TYPE##_free);  \
 	return 1;  \
 }
 
+/* stack[i] read element i from 1 like totable, other keys are methods */
+#define SK_INDEX(TYPE, type)  static int sk_##type##_index(lua_State*L) { \
+	if (lua_type(L, 2) == LUA_TNUMBER) { \
+		STACK_OF(TYPE) * st = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
+		TYPE *x = SKM_sk_value(TYPE, st, (int)lua_tointeger(L, 2) - 1); \
+		if (x == NULL) \
+			return 0; \
+		TYPE##_up_ref(x); \
+		PUSH_OBJECT_REF(x,"openssl."#type, TYPE##_free);  \
+		return 1;  \
+	} \
+	lua_pushvalue(L, 2); \
+	lua_gettable(L, lua_upvalueindex(1)); \
+	return 1; \
+}
+
 #define SK_LENGTH(TYPE, type)  static int sk_##type##_length(lua_State*L) { \
 	STACK_OF(TYPE) * st = CHECK_OBJECT(1, STACK_OF(TYPE), "openssl.stack_of_"#type); \
 	lua_pushinteger(L, SKM_sk_num(TYPE, st));  \
@@ -143,6 +189,7 @@ STACK_OF(TYPE)* sk_##type##_fromtable(lua_State*L, int idx) { \
 #define IMP_LUA_SK(TYPE,type) \
 TAB2SK(TYPE,type);	\
 SK2TAB(TYPE,type);	\
+SK_DUP(TYPE,type);	\
 			\
 SK_TOTABLE(TYPE,type);	\
 SK_FREE(TYPE,type);	\
@@ -153,6 +200,7 @@ SK_INSERT(TYPE,type);	\
 SK_DELETE(TYPE,type);	\
 SK_SET(TYPE,type);	\
 SK_GET(TYPE,type);	\
+SK_INDEX(TYPE,type);	\
 SK_LENGTH(TYPE,type);	\
 SK_SORT(TYPE,type); 	\
 SK_SORTED(TYPE,type); 	\
@@ -183,10 +231,16 @@ int openssl_sk_##type##_new(lua_State*L) { \
 \
 int openssl_register_sk_##type(lua_State*L) { \
 	auxiliar_newclass(L,"openssl.stack_of_"#type, sk_##type##_funcs); \
+	luaL_getmetatable(L,"openssl.stack_of_"#type); \
+	lua_getfield(L, -1, "__index"); \
+	lua_pushcclosure(L, sk_##type##_index, 1); \
+	lua_setfield(L, -2, "__index"); \
+	lua_pop(L, 1); \
 	return 0;  \
 }
 
 #define DEF_LUA_SK(TYPE,type) 			\
+STACK_OF(TYPE)* openssl_sk_##type##_dup(STACK_OF(TYPE) *sk);	\
 int openssl_sk_##type##_new(lua_State*L);	\
 int openssl_register_sk_##type(lua_State*L) 
 
@@ -0,0 +1,459 @@
+/*=========================================================================*\
+* sni router
+* lua-openssl toolkit
+*
+* hostnames are kept in a hash table, servername callback looks up the
+* exact name then the wildcard of its parent, and switches ssl to the
+* matched ssl_ctx without calling lua. add and remove change one entry,
+* table grows by rehash, lookups wait only for the change itself.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <ctype.h>
+#include <stdlib.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+#define SNI_NAME_MAX		255
+
+typedef struct sni_entry_st {
+	struct sni_entry_st *next;
+	unsigned long hash;
+	SSL_CTX *ctx;
+	char name[1];
+} SNI_ENTRY;
+
+struct sni_router_st {
+	int refs;
+#ifdef PTHREADS
+	pthread_rwlock_t lock;
+	pthread_mutex_t ref_lock;
+#endif
+	SNI_ENTRY **buckets;
+	size_t nbuckets;
+	size_t count;
+};
+
+static void sni_rdlock(SNI_ROUTER *r)
+{
+#ifdef PTHREADS
+	pthread_rwlock_rdlock(&r->lock);
+#else
+	(void)r;
+#endif
+}
+
+static void sni_wrlock(SNI_ROUTER *r)
+{
+#ifdef PTHREADS
+	pthread_rwlock_wrlock(&r->lock);
+#else
+	(void)r;
+#endif
+}
+
+static void sni_unlock(SNI_ROUTER *r)
+{
+#ifdef PTHREADS
+	pthread_rwlock_unlock(&r->lock);
+#else
+	(void)r;
+#endif
+}
+
+/* lower case copy of name to buf, 0 when name is too long or empty */
+static size_t sni_normalize(const char *name, size_t len, char *buf)
+{
+	size_t i;
+	/* trailing dot of absolute name */
+	if (len > 0 && name[len - 1] == '.')
+		len--;
+	if (len == 0 || len > SNI_NAME_MAX)
+		return 0;
+	for (i = 0; i < len; i++)
+		buf[i] = (char)tolower((unsigned char)name[i]);
+	buf[len] = '\0';
+	return len;
+}
+
+static unsigned long sni_hash(const char *name, size_t len)
+{
+	unsigned long h = 5381;
+	size_t i;
+	for (i = 0; i < len; i++)
+		h = h * 33 + (unsigned char)name[i];
+	return h;
+}
+
+static SNI_ENTRY **sni_find(SNI_ROUTER *r, const char *name, size_t len, unsigned long h)
+{
+	SNI_ENTRY **p = &r->buckets[h % r->nbuckets];
+	while (*p) {
+		if ((*p)->hash == h && strncmp((*p)->name, name, len) == 0 && (*p)->name[len] == '\0')
+			break;
+		p = &(*p)->next;
+	}
+	return p;
+}
+
+static int sni_grow(SNI_ROUTER *r)
+{
+	size_t n = r->nbuckets * 2;
+	SNI_ENTRY **buckets = (SNI_ENTRY **)calloc(n, sizeof(SNI_ENTRY *));
+	size_t i;
+	if (buckets == NULL)
+		return 0;
+	for (i = 0; i < r->nbuckets; i++) {
+		SNI_ENTRY *e = r->buckets[i];
+		while (e) {
+			SNI_ENTRY *next = e->next;
+			e->next = buckets[e->hash % n];
+			buckets[e->hash % n] = e;
+			e = next;
+		}
+	}
+	free(r->buckets);
+	r->buckets = buckets;
+	r->nbuckets = n;
+	return 1;
+}
+
+/* ctx of name, exact first then wildcard of parent, caller hold lock */
+static SSL_CTX *sni_match(SNI_ROUTER *r, const char *name, size_t len)
+{
+	/* one byte before name to make *.parent */
+	char buf[SNI_NAME_MAX + 2];
+	char *wild;
+	SNI_ENTRY *e;
+
+	if ((len = sni_normalize(name, len, buf + 1)) == 0)
+		return NULL;
+	e = *sni_find(r, buf + 1, len, sni_hash(buf + 1, len));
+	if (e)
+		return e->ctx;
+	/* *.example.com matches one label only */
+	wild = memchr(buf + 1, '.', len);
+	if (wild == NULL)
+		return NULL;
+	*--wild = '*';
+	len = buf + 1 + len - wild;
+	e = *sni_find(r, wild, len, sni_hash(wild, len));
+	return e ? e->ctx : NULL;
+}
+
+SNI_ROUTER *openssl_sni_router_new(void)
+{
+	SNI_ROUTER *r = (SNI_ROUTER *)malloc(sizeof(SNI_ROUTER));
+	if (r == NULL)
+		return NULL;
+	memset(r, 0, sizeof(SNI_ROUTER));
+	r->nbuckets = 64;
+	r->buckets = (SNI_ENTRY **)calloc(r->nbuckets, sizeof(SNI_ENTRY *));
+	if (r->buckets == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->refs = 1;
+#ifdef PTHREADS
+	pthread_rwlock_init(&r->lock, NULL);
+	pthread_mutex_init(&r->ref_lock, NULL);
+#endif
+	return r;
+}
+
+void openssl_sni_router_up_ref(SNI_ROUTER *r)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&r->ref_lock);
+#endif
+	r->refs++;
+#ifdef PTHREADS
+	pthread_mutex_unlock(&r->ref_lock);
+#endif
+}
+
+void openssl_sni_router_free(SNI_ROUTER *r)
+{
+	size_t i;
+	int refs;
+	if (r == NULL)
+		return;
+#ifdef PTHREADS
+	pthread_mutex_lock(&r->ref_lock);
+#endif
+	refs = --r->refs;
+#ifdef PTHREADS
+	pthread_mutex_unlock(&r->ref_lock);
+#endif
+	if (refs > 0)
+		return;
+	for (i = 0; i < r->nbuckets; i++) {
+		SNI_ENTRY *e = r->buckets[i];
+		while (e) {
+			SNI_ENTRY *next = e->next;
+			SSL_CTX_free(e->ctx);
+			free(e);
+			e = next;
+		}
+	}
+	free(r->buckets);
+#ifdef PTHREADS
+	pthread_rwlock_destroy(&r->lock);
+	pthread_mutex_destroy(&r->ref_lock);
+#endif
+	free(r);
+}
+
+/* map name to ctx, replace old one, router keep a reference of ctx */
+int openssl_sni_router_add(SNI_ROUTER *r, const char *name, size_t len, SSL_CTX *ctx)
+{
+	char buf[SNI_NAME_MAX + 1];
+	unsigned long h;
+	SNI_ENTRY **p;
+	SNI_ENTRY *e;
+
+	if ((len = sni_normalize(name, len, buf)) == 0)
+		return 0;
+	h = sni_hash(buf, len);
+	SSL_CTX_up_ref(ctx);
+	sni_wrlock(r);
+	p = sni_find(r, buf, len, h);
+	if (*p) {
+		SSL_CTX *old = (*p)->ctx;
+		(*p)->ctx = ctx;
+		sni_unlock(r);
+		SSL_CTX_free(old);
+		return 1;
+	}
+	e = (SNI_ENTRY *)malloc(sizeof(SNI_ENTRY) + len);
+	if (e == NULL) {
+		sni_unlock(r);
+		SSL_CTX_free(ctx);
+		return 0;
+	}
+	memcpy(e->name, buf, len + 1);
+	e->hash = h;
+	e->ctx = ctx;
+	e->next = NULL;
+	*p = e;
+	r->count++;
+	if (r->count > r->nbuckets)
+		sni_grow(r);
+	sni_unlock(r);
+	return 1;
+}
+
+int openssl_sni_router_remove(SNI_ROUTER *r, const char *name, size_t len)
+{
+	char buf[SNI_NAME_MAX + 1];
+	SNI_ENTRY **p;
+	SNI_ENTRY *e;
+
+	if ((len = sni_normalize(name, len, buf)) == 0)
+		return 0;
+	sni_wrlock(r);
+	p = sni_find(r, buf, len, sni_hash(buf, len));
+	e = *p;
+	if (e) {
+		*p = e->next;
+		r->count--;
+	}
+	sni_unlock(r);
+	if (e == NULL)
+		return 0;
+	SSL_CTX_free(e->ctx);
+	free(e);
+	return 1;
+}
+
+/* matched ctx with a reference, or NULL */
+SSL_CTX *openssl_sni_router_lookup(SNI_ROUTER *r, const char *name, size_t len)
+{
+	SSL_CTX *ctx;
+	sni_rdlock(r);
+	ctx = sni_match(r, name, len);
+	if (ctx)
+		SSL_CTX_up_ref(ctx);
+	sni_unlock(r);
+	return ctx;
+}
+
+/****************************** SSL_CTX callback ******************************/
+static int sni_ctx_idx = -1;
+static int sni_ssl_idx = -1;
+
+static void sni_ctx_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	openssl_sni_router_free((SNI_ROUTER *)ptr);
+}
+
+SNI_ROUTER *openssl_ssl_ctx_get_sni_router(SSL_CTX *ctx)
+{
+	if (sni_ctx_idx < 0 || ctx == NULL)
+		return NULL;
+	return SSL_CTX_get_ex_data(ctx, sni_ctx_idx);
+}
+
+/* ctx ssl made by, session cache and ticket keys live in it */
+SSL_CTX *openssl_ssl_session_ctx(SSL *s)
+{
+	SSL_CTX *ctx = sni_ssl_idx < 0 ? NULL : SSL_get_ex_data(s, sni_ssl_idx);
+	return ctx ? ctx : SSL_get_SSL_CTX(s);
+}
+
+static int sni_servername_cb(SSL *s, int *ad, void *arg)
+{
+	SNI_ROUTER *r = (SNI_ROUTER *)arg;
+	const char *name = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
+	SSL_CTX *ctx;
+	(void)ad;
+
+	if (name == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+	ctx = openssl_sni_router_lookup(r, name, strlen(name));
+	/* no match, stay in default ctx */
+	if (ctx == NULL)
+		return SSL_TLSEXT_ERR_OK;
+	if (ctx != SSL_get_SSL_CTX(s)) {
+		if (SSL_get_ex_data(s, sni_ssl_idx) == NULL)
+			SSL_set_ex_data(s, sni_ssl_idx, SSL_get_SSL_CTX(s));
+		SSL_set_SSL_CTX(s, ctx);
+	}
+	SSL_CTX_free(ctx);
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/* ctx route handshakes by r, ctx keep a reference of r */
+int openssl_ssl_ctx_set_sni_router(SSL_CTX *ctx, SNI_ROUTER *r)
+{
+	SNI_ROUTER *old;
+	if (sni_ctx_idx < 0) {
+		sni_ctx_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, sni_ctx_free);
+		sni_ssl_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+		if (sni_ctx_idx < 0 || sni_ssl_idx < 0)
+			return 0;
+	}
+	old = openssl_ssl_ctx_get_sni_router(ctx);
+	if (old == r)
+		return 1;
+	openssl_sni_router_up_ref(r);
+	SSL_CTX_set_ex_data(ctx, sni_ctx_idx, r);
+	SSL_CTX_set_tlsext_servername_callback(ctx, sni_servername_cb);
+	SSL_CTX_set_tlsext_servername_arg(ctx, r);
+	openssl_sni_router_free(old);
+	return 1;
+}
+
+/****************************** lua api ******************************/
+static int openssl_sni_router_add_lua(lua_State *L)
+{
+	SNI_ROUTER *r = CHECK_OBJECT(1, SNI_ROUTER, "openssl.sni_router");
+	size_t len;
+	const char *name = luaL_checklstring(L, 2, &len);
+	SSL_CTX *ctx = CHECK_OBJECT(3, SSL_CTX, "openssl.ssl_ctx");
+	lua_pushboolean(L, openssl_sni_router_add(r, name, len, ctx));
+	return 1;
+}
+
+static int openssl_sni_router_remove_lua(lua_State *L)
+{
+	SNI_ROUTER *r = CHECK_OBJECT(1, SNI_ROUTER, "openssl.sni_router");
+	size_t len;
+	const char *name = luaL_checklstring(L, 2, &len);
+	lua_pushboolean(L, openssl_sni_router_remove(r, name, len));
+	return 1;
+}
+
+static int openssl_sni_router_lookup_lua(lua_State *L)
+{
+	SNI_ROUTER *r = CHECK_OBJECT(1, SNI_ROUTER, "openssl.sni_router");
+	size_t len;
+	const char *name = luaL_checklstring(L, 2, &len);
+	SSL_CTX *ctx = openssl_sni_router_lookup(r, name, len);
+	if (ctx == NULL)
+		lua_pushnil(L);
+	else
+		PUSH_OBJECT_REF(ctx, "openssl.ssl_ctx", SSL_CTX_free);
+	return 1;
+}
+
+static int openssl_sni_router_len(lua_State *L)
+{
+	SNI_ROUTER *r = CHECK_OBJECT(1, SNI_ROUTER, "openssl.sni_router");
+	size_t n;
+	sni_rdlock(r);
+	n = r->count;
+	sni_unlock(r);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+static int openssl_sni_router_gc(lua_State *L)
+{
+	SNI_ROUTER *r = CHECK_OBJECT(1, SNI_ROUTER, "openssl.sni_router");
+	openssl_sni_router_free(r);
+	return 0;
+}
+
+/*  ssl_ctx:sni_router([table map|sni_router router]) -> sni_router {{{1
+	route handshakes of ctx to ssl_ctx of servername, map is {hostname=ssl_ctx},
+	hostname can be *.example.com, it matches one label. pass router of other
+	ctx to share it
+*/
+LUA_FUNCTION(openssl_ssl_ctx_sni_router)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	SNI_ROUTER *r;
+
+	if (auxiliar_isclass(L, "openssl.sni_router", 2)) {
+		r = CHECK_OBJECT(2, SNI_ROUTER, "openssl.sni_router");
+		openssl_sni_router_up_ref(r);
+	} else {
+		if (!lua_isnoneornil(L, 2))
+			luaL_checktype(L, 2, LUA_TTABLE);
+		r = openssl_sni_router_new();
+		if (r == NULL)
+			luaL_error(L, "out of memory");
+	}
+	PUSH_OBJECT_REF(r, "openssl.sni_router", openssl_sni_router_free);
+	if (lua_istable(L, 2)) {
+		lua_pushnil(L);
+		while (lua_next(L, 2)) {
+			size_t len;
+			const char *name;
+			SSL_CTX *sub = CHECK_OBJECT(lua_gettop(L), SSL_CTX, "openssl.ssl_ctx");
+			lua_pushvalue(L, -2);
+			name = lua_tolstring(L, -1, &len);
+			if (name == NULL || !openssl_sni_router_add(r, name, len, sub))
+				luaL_error(L, "#2 invalid hostname %s", name ? name : "?");
+			lua_pop(L, 2);
+		}
+	}
+	if (!openssl_ssl_ctx_set_sni_router(ctx, r))
+		luaL_error(L, "SSL_CTX_get_ex_new_index fail");
+	return 1;
+}
+/* }}} */
+
+static luaL_Reg sni_router_funcs[] = {
+	{"add",			openssl_sni_router_add_lua},
+	{"remove",		openssl_sni_router_remove_lua},
+	{"lookup",		openssl_sni_router_lookup_lua},
+
+	{"__len",		openssl_sni_router_len},
+	{"__gc",		openssl_sni_router_gc},
+	{"__tostring",		auxiliar_tostring},
+
+	{NULL,			NULL},
+};
+
+int openssl_register_sni_router(lua_State *L)
+{
+	auxiliar_newclass(L, "openssl.sni_router", sni_router_funcs);
+	return 0;
+}
@@ -1,5 +1,21 @@
 #include "openssl.h"
 #include <openssl/ssl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define TLS_method		SSLv23_method
+#define TLS_server_method	SSLv23_server_method
+#define TLS_client_method	SSLv23_client_method
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define SSL_KTLS
+#endif
 
 /****************************SSL CTX********************************/
 int openssl_ssl_ctx_new(lua_State*L)
@@ -25,6 +41,26 @@ int openssl_ssl_ctx_new(lua_State*L)
 		method = TLSv1_server_method();	/* TLSv1.0 */
 	else if(strcmp(meth,"TLSv1_client")==0)
 		method = TLSv1_client_method();	/* TLSv1.0 */
+#if OPENSSL_VERSION_NUMBER >= 0x10001000L
+	else if(strcmp(meth, "TLSv1_1")==0)
+		method = TLSv1_1_method();		/* TLSv1.1 */
+	else if(strcmp(meth, "TLSv1_1_server")==0)
+		method = TLSv1_1_server_method();	/* TLSv1.1 */
+	else if(strcmp(meth,"TLSv1_1_client")==0)
+		method = TLSv1_1_client_method();	/* TLSv1.1 */
+	else if(strcmp(meth, "TLSv1_2")==0)
+		method = TLSv1_2_method();		/* TLSv1.2 */
+	else if(strcmp(meth, "TLSv1_2_server")==0)
+		method = TLSv1_2_server_method();	/* TLSv1.2 */
+	else if(strcmp(meth,"TLSv1_2_client")==0)
+		method = TLSv1_2_client_method();	/* TLSv1.2 */
+#endif
+	else if(strcmp(meth, "TLS")==0)
+		method = TLS_method();			/* highest both support, limit by min/max_version */
+	else if(strcmp(meth, "TLS_server")==0)
+		method = TLS_server_method();
+	else if(strcmp(meth,"TLS_client")==0)
+		method = TLS_client_method();
 	else if(strcmp(meth,"DTLSv1")==0)
 		method = DTLSv1_method();		/* DTLSv1.0 */
 	else if(strcmp(meth,"DTLSv1_server")==0)
@@ -41,14 +77,14 @@ int openssl_ssl_ctx_new(lua_State*L)
 #endif
 	else
 		luaL_error(L,	"#1:%s not supported\n"
-						"Maybe SSLv3 SSLv23 TLSv1 DTLSv1 [SSLv2], option followed by -client or -server\n",
-						"default is SSLv3",
+						"Maybe TLS SSLv3 SSLv23 TLSv1 TLSv1_1 TLSv1_2 DTLSv1 [SSLv2], option followed by -client or -server\n"
+						"default is TLSv1",
 						meth);
 	ctx = SSL_CTX_new(method);
 	if(!ctx)
 		luaL_error(L,	"#1:%s not supported\n"
-			"Maybe SSLv3 SSLv23 TLSv1 DTLSv1 [SSLv2], option followed by -client or -server\n",
-			"default is SSLv3",
+			"Maybe TLS SSLv3 SSLv23 TLSv1 TLSv1_1 TLSv1_2 DTLSv1 [SSLv2], option followed by -client or -server\n"
+			"default is TLSv1",
 			meth);
 
 	PUSH_OBJECT(ctx,"openssl.ssl_ctx");
@@ -68,6 +104,7 @@ static int openssl_ssl_ctx_cipher_list(lua_State*L){
 static int openssl_ssl_ctx_gc(lua_State*L)
 {
 	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	openssl_ssl_ctx_staple_release(L, ctx);
 	SSL_CTX_free(ctx);
 	return 0;
 }
@@ -128,18 +165,209 @@ static int openssl_ssl_ctx_mode(lua_State*L)
 	return 1;
 }
 
+/* protocol version names, number is also accepted */
+static const char* const ssl_version_names[] = {"any", "SSLv3", "TLSv1", "TLSv1.1", "TLSv1.2", "TLSv1.3", NULL};
+static const int ssl_version_values[] = {0, 0x0300, 0x0301, 0x0302, 0x0303, 0x0304};
+
+static int openssl_ssl_checkversion(lua_State*L, int idx){
+	if(lua_type(L, idx)==LUA_TNUMBER)
+		return lua_tointeger(L, idx);
+	return ssl_version_values[luaL_checkoption(L, idx, NULL, ssl_version_names)];
+}
+
+static void openssl_ssl_pushversion(lua_State*L, int version){
+	int i;
+	for(i=0; ssl_version_names[i]; i++){
+		if(ssl_version_values[i]==version){
+			lua_pushstring(L, ssl_version_names[i]);
+			return;
+		}
+	}
+	lua_pushinteger(L, version);
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* before 1.1.0 version range is made by SSL_OP_NO_* options */
+static const long ssl_version_ops[] = {
+	0, SSL_OP_NO_SSLv3, SSL_OP_NO_TLSv1,
+#ifdef SSL_OP_NO_TLSv1_2
+	SSL_OP_NO_TLSv1_1, SSL_OP_NO_TLSv1_2,
+#endif
+};
+#define SSL_VERSION_OPS	((int)(sizeof(ssl_version_ops)/sizeof(ssl_version_ops[0])))
+
+static int SSL_CTX_get_proto_version(SSL_CTX *ctx, int max){
+	long op = SSL_CTX_get_options(ctx);
+	int i, first = 0, last = 0;
+	for(i=1; i<SSL_VERSION_OPS; i++){
+		if(!(op & ssl_version_ops[i])){
+			if(!first)
+				first = ssl_version_values[i];
+			last = ssl_version_values[i];
+		}
+	}
+	if(max)
+		return (op & ssl_version_ops[SSL_VERSION_OPS-1]) ? last : 0;
+	return (op & ssl_version_ops[1]) ? first : 0;
+}
+
+static int SSL_CTX_set_proto_version(SSL_CTX *ctx, int version, int max){
+	int min_v = max ? SSL_CTX_get_proto_version(ctx, 0) : version;
+	int max_v = max ? version : SSL_CTX_get_proto_version(ctx, 1);
+	int i;
+	for(i=1; i<SSL_VERSION_OPS; i++){
+		int v = ssl_version_values[i];
+		if((min_v && v<min_v) || (max_v && v>max_v))
+			SSL_CTX_set_options(ctx, ssl_version_ops[i]);
+		else
+			SSL_CTX_clear_options(ctx, ssl_version_ops[i]);
+	}
+	return 1;
+}
+#define SSL_CTX_set_min_proto_version(ctx, v)	SSL_CTX_set_proto_version(ctx, v, 0)
+#define SSL_CTX_set_max_proto_version(ctx, v)	SSL_CTX_set_proto_version(ctx, v, 1)
+#define SSL_CTX_get_min_proto_version(ctx)	SSL_CTX_get_proto_version(ctx, 0)
+#define SSL_CTX_get_max_proto_version(ctx)	SSL_CTX_get_proto_version(ctx, 1)
+#endif
+
+/*  ssl_ctx:min_version([string|number version]) -> boolean|string {{{1
+	ssl_ctx:max_version(...) same
+	version is any, SSLv3, TLSv1, TLSv1.1, TLSv1.2 or TLSv1.3, any is no limit,
+	work with TLS method, return current when no version given
+*/
+static int openssl_ssl_ctx_proto_version(lua_State*L, int max){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	if(!lua_isnoneornil(L, 2)){
+		int version = openssl_ssl_checkversion(L, 2);
+		int ret = max ? SSL_CTX_set_max_proto_version(ctx, version)
+			: SSL_CTX_set_min_proto_version(ctx, version);
+		lua_pushboolean(L, ret);
+		return 1;
+	}
+	openssl_ssl_pushversion(L, max ? SSL_CTX_get_max_proto_version(ctx)
+		: SSL_CTX_get_min_proto_version(ctx));
+	return 1;
+}
+
+static int openssl_ssl_ctx_min_version(lua_State*L){
+	return openssl_ssl_ctx_proto_version(L, 0);
+}
+
+static int openssl_ssl_ctx_max_version(lua_State*L){
+	return openssl_ssl_ctx_proto_version(L, 1);
+}
+/* }}} */
+
+/*  ssl_ctx:ciphersuites(string ciphersuites) -> boolean {{{1
+	TLSv1.3 ciphersuites, like TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256
+*/
+static int openssl_ssl_ctx_ciphersuites(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	const char* ciphersuites = luaL_checkstring(L, 2);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if(!SSL_CTX_set_ciphersuites(ctx, ciphersuites))
+		luaL_error(L, "#2 SSL_CTX_set_ciphersuites(%s) failed", ciphersuites);
+	lua_pushboolean(L, 1);
+	return 1;
+#else
+	(void)ctx; (void)ciphersuites;
+	return luaL_error(L, "TLSv1.3 not supported");
+#endif
+}
+/* }}} */
+
+/*  ssl_ctx:groups(string groups) -> boolean {{{1
+	key exchange groups in order of preference, like X25519:P-256
+*/
+static int openssl_ssl_ctx_groups(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	const char* groups = luaL_checkstring(L, 2);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if(!SSL_CTX_set1_groups_list(ctx, groups))
+#elif OPENSSL_VERSION_NUMBER >= 0x10002000L
+	if(!SSL_CTX_set1_curves_list(ctx, groups))
+#else
+	(void)ctx;
+	if(1)
+#endif
+		luaL_error(L, "#2 set groups(%s) failed", groups);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+/* }}} */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/*  ssl_ctx:max_early_data([number size]) -> number {{{1
+	bytes of TLSv1.3 0-RTT data server accepts, 0 disables early data
+*/
+static int openssl_ssl_ctx_max_early_data(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	if(!lua_isnoneornil(L, 2))
+		SSL_CTX_set_max_early_data(ctx, (uint32_t)luaL_checkinteger(L, 2));
+	lua_pushinteger(L, SSL_CTX_get_max_early_data(ctx));
+	return 1;
+}
+/* }}} */
+
+/*  ssl_ctx:anti_replay([boolean enable]) -> boolean {{{1
+	replay protection of early data, on by default, a session is single use
+	when early data enabled, with session_cache_shm it holds over workers,
+	tickets without session cache are not protected
+*/
+static int openssl_ssl_ctx_anti_replay(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	if(!lua_isnoneornil(L, 2)){
+		if(auxiliar_checkboolean(L, 2))
+			SSL_CTX_clear_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+		else
+			SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+	}
+	lua_pushboolean(L, (SSL_CTX_get_options(ctx) & SSL_OP_NO_ANTI_REPLAY)==0);
+	return 1;
+}
+/* }}} */
+#endif
+
+/*  ssl_ctx:ktls([boolean enable]) -> boolean {{{1
+	kernel TLS for ssl on socket, after handshake OpenSSL gives keys to
+	kernel when kernel and cipher support it, else ssl works as before.
+	set before ssl made, return nil, "not supported" when OpenSSL lacks it
+*/
+static int openssl_ssl_ctx_ktls(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+#ifdef SSL_KTLS
+	if(!lua_isnoneornil(L, 2)){
+		if(auxiliar_checkboolean(L, 2))
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		else
+			SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+	lua_pushboolean(L, (SSL_CTX_get_options(ctx) & SSL_OP_ENABLE_KTLS)!=0);
+	return 1;
+#else
+	(void)ctx;
+	lua_pushnil(L);
+	lua_pushliteral(L, "not supported");
+	return 2;
+#endif
+}
+/* }}} */
+
 static int openssl_ssl_ctx_cert_store(lua_State*L)
 {
 	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
 	X509_STORE* store;
 	if(!lua_isnoneornil(L, 2)){
 		store = CHECK_OBJECT(2, X509_STORE, "openssl.x509_store");
+		/* ctx takes ownership, userdata keeps its own reference */
+		X509_STORE_up_ref(store);
 		SSL_CTX_set_cert_store(ctx, store);
 		return 0;
 	}
 
 	store = SSL_CTX_get_cert_store(ctx);
-	PUSH_OBJECT(store,"openssl.x509_store");
+	X509_STORE_up_ref(store);
+	PUSH_OBJECT_REF(store,"openssl.x509_store",X509_STORE_free);
 	return 1;
 }
 
@@ -296,7 +524,8 @@ static int openssl_ssl_ctx_set_default_verify_paths(lua_State*L){
 static int openssl_ssl_ctx_set_client_CA_list(lua_State*L){
 	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
 	STACK_OF(X509_NAME) *name_list = CHECK_OBJECT(2,STACK_OF(X509_NAME),"openssl.stack_of_x509_name");
-	SSL_CTX_set_client_CA_list(ctx, name_list);
+	/* ctx takes ownership, give it a copy */
+	SSL_CTX_set_client_CA_list(ctx, SSL_dup_CA_list(name_list));
 	return 0;
 }
 
@@ -327,13 +556,115 @@ void SSL_CTX_set_verify(SSL_CTX *ctx,int mode,
 	void SSL_CTX_set_default_passwd_cb_userdata(SSL_CTX *ctx, void *u);
 */
 
+/*  ssl_ctx:session_cache_shm(string path [, number size_mb=1]) -> boolean {{{1
+	server sessions are kept in file mapped shared memory, all processes
+	use the same path share sessions, size_mb only used when file created,
+	set session id context with ssl_ctx:session before accept
+*/
+static int openssl_ssl_ctx_session_cache_shm(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	const char* path = luaL_checkstring(L, 2);
+	int size = luaL_optint(L, 3, 1);
+	const char* err = NULL;
+	luaL_argcheck(L, size>0, 3, "must be positive");
+	if(!openssl_session_cache_attach(ctx, path, (size_t)size<<20, &err)){
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+/* }}} */
+
+/*  ssl_ctx:session_cache_stats() -> table {{{1
+	hits, misses, evictions, stores, removes, entries and capacity of
+	shared session cache, counted over all processes, nil when not used
+*/
+static int openssl_ssl_ctx_session_cache_stats(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	return openssl_session_cache_pushstats(L, ctx);
+}
+/* }}} */
+
+/* SSL takes ownership of bio, userdata keep its own reference */
+static void openssl_ssl_set_bio(SSL *s, BIO *rbio, BIO *wbio)
+{
+	BIO_up_ref(rbio);
+	if (wbio != rbio)
+		BIO_up_ref(wbio);
+	SSL_set_bio(s, rbio, wbio);
+}
+
+/*  ssl_ctx:ssl(number fd|bio rbio [,bio wbio] [,boolean server=false]) => ssl {{{1
+	make a connection object, write may return partial and retry with other
+	string, in client state unless server is true
+*/
+int openssl_ssl_ctx_new_ssl(lua_State*L){
+	SSL_CTX* ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	int server = 0;
+	SSL *s;
+	long mark;
+	if(lua_isboolean(L, lua_gettop(L)))
+		server = lua_toboolean(L, lua_gettop(L));
+
+	mark = openssl_mem_mark();
+	s = SSL_new(ctx);
+	if(s==NULL)
+		luaL_error(L, "SSL_new fail");
+	openssl_mem_account(s, mark);
+	PUSH_OBJECT(s, "openssl.ssl");
+	if(lua_isnumber(L, 2)){
+		if(!SSL_set_fd(s, lua_tointeger(L, 2)))
+			luaL_error(L, "#2 set fd fail");
+	}else{
+		BIO *rbio = CHECK_OBJECT(2, BIO, "openssl.bio");
+		BIO *wbio = auxiliar_isclass(L, "openssl.bio", 3) ? CHECK_OBJECT(3, BIO, "openssl.bio") : rbio;
+		openssl_ssl_set_bio(s, rbio, wbio);
+	}
+	SSL_set_mode(s, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	if(server)
+		SSL_set_accept_state(s);
+	else
+		SSL_set_connect_state(s);
+	return 1;
+}
+/* }}} */
+
 static luaL_Reg ssl_ctx_funcs[] = {
+	{"ssl",				openssl_ssl_ctx_new_ssl},
 	{"cert_store",		openssl_ssl_ctx_cert_store},
 	{"cipher_list",		openssl_ssl_ctx_cipher_list},
+	{"ciphersuites",		openssl_ssl_ctx_ciphersuites},
+	{"groups",			openssl_ssl_ctx_groups},
+	{"min_version",		openssl_ssl_ctx_min_version},
+	{"max_version",		openssl_ssl_ctx_max_version},
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	{"max_early_data",	openssl_ssl_ctx_max_early_data},
+	{"anti_replay",		openssl_ssl_ctx_anti_replay},
+#endif
 	{"flush_sessions",	openssl_ssl_ctx_flush_sessions},
 	{"timeout",			openssl_ssl_ctx_timeout},
 	{"options",			openssl_ssl_ctx_options},
 	{"session",			openssl_ssl_ctx_sessions},
+	{"session_cache_shm",	openssl_ssl_ctx_session_cache_shm},
+	{"session_cache_stats",	openssl_ssl_ctx_session_cache_stats},
+	{"ticket_keys",		openssl_ssl_ctx_ticket_keys},
+	{"sni_router",		openssl_ssl_ctx_sni_router},
+	{"inherit",			openssl_ssl_ctx_inherit},
+	{"low_memory",		openssl_ssl_ctx_low_memory},
+	{"memory_stats",	openssl_ssl_ctx_memory_stats},
+	{"telemetry",		openssl_ssl_ctx_telemetry},
+	{"handshake_stats",	openssl_ssl_ctx_handshake_stats},
+	{"ocsp_staple",		openssl_ssl_ctx_ocsp_staple},
+	{"ocsp_refresh",		openssl_ssl_ctx_ocsp_refresh},
+	{"ocsp_stats",		openssl_ssl_ctx_ocsp_stats},
+	{"cert_compression",	openssl_ssl_ctx_cert_compression},
+	{"alpn",			openssl_ssl_ctx_alpn},
+	{"alpn_stats",		openssl_ssl_ctx_alpn_stats},
+	{"ktls",			openssl_ssl_ctx_ktls},
+	{"async_keys",		openssl_ssl_ctx_async_keys},
+	{"async_ready",		openssl_ssl_ctx_async_ready},
 	{"mode",			openssl_ssl_ctx_mode},
 	
 	{"add_client_CA",	openssl_ssl_ctx_add_client_CA},
@@ -439,7 +770,9 @@ static int openssl_ssl_session_gc(lua_State*L){
 static int openssl_ssl_session_peer(lua_State*L){
 	SSL_SESSION* session = CHECK_OBJECT(1, SSL_SESSION, "openssl.ssl_session");
 	X509 *x = SSL_SESSION_get0_peer(session);
-	PUSH_OBJECT(x,"openssl.x509");
+	if(x)
+		X509_up_ref(x);
+	PUSH_OBJECT_REF(x,"openssl.x509",X509_free);
 	return 1;
 }
 #endif
@@ -605,14 +938,23 @@ static int openssl_ssl_bio(lua_State*L){
 	if(lua_gettop(L)>1){
 		rbio = CHECK_OBJECT(2, BIO, "openssl.bio");
 		wbio = CHECK_OBJECT(3, BIO, "openssl.bio");
-		SSL_set_bio(s, rbio, wbio);
+		openssl_ssl_set_bio(s, rbio, wbio);
 		return 0;
 	}
 	rbio = SSL_get_rbio(s);
 	wbio = SSL_get_wbio(s);
 
-	PUSH_OBJECT(rbio, "openssl.bio");
-	PUSH_OBJECT(wbio, "openssl.bio");
+	/* bio stays owned by s, userdata take its own reference */
+	if (rbio) {
+		BIO_up_ref(rbio);
+		PUSH_OBJECT_REF(rbio, "openssl.bio", BIO_free);
+	} else
+		lua_pushnil(L);
+	if (wbio) {
+		BIO_up_ref(wbio);
+		PUSH_OBJECT_REF(wbio, "openssl.bio", BIO_free);
+	} else
+		lua_pushnil(L);
 	return 2;
 }
 
@@ -752,14 +1094,17 @@ static int openssl_ssl_rstate_string(lua_State*L){
 static int openssl_ssl_peer_certificate(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
 	X509* x = SSL_get_peer_certificate(s);
-	PUSH_OBJECT(x,"openssl.x509");
+	PUSH_OBJECT_REF(x,"openssl.x509",X509_free);
 	return 1;
 }
 
 static int openssl_ssl_peer_cert_chain(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
 	STACK_OF(X509) *x = SSL_get_peer_cert_chain(s);
-	PUSH_OBJECT(x,"openssl.stack_of_x509");
+	if(x==NULL)
+		return 0;
+	/* chain is owned by s, share certs by reference */
+	PUSH_OBJECT(openssl_sk_x509_dup(x),"openssl.stack_of_x509");
 	return 1;
 }
 
@@ -779,46 +1124,859 @@ static int openssl_ssl_set_trust(lua_State*L){
 	return 1;
 }
 
+/* push nil and reason when SSL I/O not complete, ret is return of SSL call
+   reason is want_read, want_write, want_x509_lookup, closed, syscall or ssl,
+   and error message for syscall and ssl */
+int openssl_ssl_pushresult(lua_State*L, SSL* s, int ret){
+	int err = SSL_get_error(s, ret);
+	lua_pushnil(L);
+	switch(err){
+	case SSL_ERROR_WANT_READ:
+		lua_pushliteral(L, "want_read");
+		return 2;
+	case SSL_ERROR_WANT_WRITE:
+		lua_pushliteral(L, "want_write");
+		return 2;
+	case SSL_ERROR_WANT_X509_LOOKUP:
+		lua_pushliteral(L, "want_x509_lookup");
+		return 2;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	case SSL_ERROR_WANT_ASYNC:
+		lua_pushliteral(L, "want_async");
+		return 2;
+	case SSL_ERROR_WANT_ASYNC_JOB:
+		lua_pushliteral(L, "want_async_job");
+		return 2;
+#endif
+	case SSL_ERROR_ZERO_RETURN:
+		lua_pushliteral(L, "closed");
+		return 2;
+	case SSL_ERROR_SYSCALL:
+	{
+		unsigned long e = ERR_get_error();
+		lua_pushliteral(L, "syscall");
+		if(e)
+			lua_pushstring(L, ERR_reason_error_string(e));
+		else if(ret==0)
+			lua_pushliteral(L, "unexpected eof");
+		else
+			lua_pushstring(L, strerror(errno));
+		ERR_clear_error();
+		return 3;
+	}
+	default:
+	{
+		char buf[256];
+		ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+		ERR_clear_error();
+		lua_pushliteral(L, "ssl");
+		lua_pushstring(L, buf);
+		return 3;
+	}
+	}
+}
+
+/* ssl:accept() -> true or nil, reason */
 static int openssl_ssl_accept(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	long mark = openssl_mem_mark();
 	int ret = SSL_accept(s);
-	lua_pushboolean(L, ret);
+	openssl_mem_account(s, mark);
+	if(ret!=1)
+		return openssl_ssl_pushresult(L, s, ret);
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
+/* ssl:connect() -> true or nil, reason */
 static int openssl_ssl_connect(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	long mark = openssl_mem_mark();
 	int ret = SSL_connect(s);
-	lua_pushboolean(L, ret);
+	openssl_mem_account(s, mark);
+	if(ret!=1)
+		return openssl_ssl_pushresult(L, s, ret);
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int openssl_ssl_read(lua_State*L){
+#define SSL_READ_MAX	16384
+
+#define SSL_IO_READ	0
+#define SSL_IO_PEEK	1
+#define SSL_IO_EARLY	2
+
+/* read, peek or read early data into openssl.buffer or a string, max is plaintext of a record */
+static int openssl_ssl_read_peek(lua_State*L, int mode){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
-	int num = luaL_optint(L, 2, 4096);
-	void* buf = malloc(num);
-	int ret = SSL_read(s, buf, num);
-	lua_pushinteger(L, ret);
+	BUF_MEM *b = NULL;
+	int num, ret;
+	char *p;
+	char tmp[SSL_READ_MAX];
+
+	if(auxiliar_isclass(L, "openssl.buffer", 2)){
+		b = CHECK_OBJECT(2, BUF_MEM, "openssl.buffer");
+		num = luaL_optint(L, 3, SSL_READ_MAX);
+		luaL_argcheck(L, num>0, 3, "must be positive");
+		p = openssl_buffer_reserve(b, num);
+		if(p==NULL)
+			luaL_error(L, "out of memory");
+	}else{
+		num = luaL_optint(L, 2, SSL_READ_MAX);
+		luaL_argcheck(L, num>0, 2, "must be positive");
+		if(num>SSL_READ_MAX)
+			num = SSL_READ_MAX;
+		p = tmp;
+	}
+	if(mode==SSL_IO_EARLY){
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		size_t n = 0;
+		long mark = openssl_mem_mark();
+		ret = SSL_read_early_data(s, p, num, &n);
+		openssl_mem_account(s, mark);
+		if(ret==SSL_READ_EARLY_DATA_ERROR)
+			return openssl_ssl_pushresult(L, s, -1);
+		if(ret==SSL_READ_EARLY_DATA_FINISH && n==0){
+			lua_pushnil(L);
+			lua_pushliteral(L, "finish");
+			return 2;
+		}
+		ret = (int)n;
+#else
+		return luaL_error(L, "early data not supported");
+#endif
+	}else{
+		long mark = openssl_mem_mark();
+		ret = mode==SSL_IO_PEEK ? SSL_peek(s, p, num) : SSL_read(s, p, num);
+		openssl_mem_account(s, mark);
+		if(ret<=0)
+			return openssl_ssl_pushresult(L, s, ret);
+	}
+	if(b){
+		b->length += ret;
+		lua_pushinteger(L, ret);
+	}else
+		lua_pushlstring(L, p, ret);
 	return 1;
 }
 
+/*  ssl:read([number max=16384]) -> string {{{1
+	ssl:read(buffer buf [,number max=16384]) -> number
+	append to buf when it given and return bytes read,
+	return nil, reason when no data, see openssl_ssl_pushresult
+*/
+static int openssl_ssl_read(lua_State*L){
+	return openssl_ssl_read_peek(L, SSL_IO_READ);
+}
+/* }}} */
+
+/* ssl:peek(...) same as ssl:read, but data keep in ssl */
 static int openssl_ssl_peek(lua_State*L){
+	return openssl_ssl_read_peek(L, SSL_IO_PEEK);
+}
+
+/*  ssl:read_all([number max]) -> string {{{1
+	ssl:read_all(buffer buf [,number max]) -> number
+	read all decrypted records available now, until want_read or max bytes,
+	one call for many records come in one socket read with read_ahead.
+	append to buf when it given and return bytes read. return nil, reason
+	only when nothing read, error after data is returned by next call
+*/
+static int openssl_ssl_read_all(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
-	int num = luaL_optint(L, 2, 4096);
-	void* buf = malloc(num);
-	int ret = SSL_peek(s, buf, num);
+	BUF_MEM *b = auxiliar_isclass(L, "openssl.buffer", 2) ? CHECK_OBJECT(2, BUF_MEM, "openssl.buffer") : NULL;
+	lua_Integer max = b ? luaL_optinteger(L, 3, 0) : luaL_optinteger(L, 2, 0);
+	size_t total = 0;
+	int ret = 0;
+	long mark;
+	luaL_Buffer B;
+
+	luaL_argcheck(L, max>=0, b ? 3 : 2, "must be positive");
+	if(b==NULL)
+		luaL_buffinit(L, &B);
+	mark = openssl_mem_mark();
+	while(max==0 || total<(size_t)max){
+		size_t num;
+		char *p;
+		if(b){
+			num = SSL_pending(s);
+			if(num<SSL_READ_MAX)
+				num = SSL_READ_MAX;
+			if(max && num>(size_t)max-total)
+				num = (size_t)max-total;
+			p = openssl_buffer_reserve(b, num);
+			if(p==NULL){
+				openssl_mem_account(s, mark);
+				luaL_error(L, "out of memory");
+			}
+		}else{
+			p = luaL_prepbuffer(&B);
+			num = LUAL_BUFFERSIZE;
+			if(max && num>(size_t)max-total)
+				num = (size_t)max-total;
+		}
+		ret = SSL_read(s, p, (int)num);
+		if(ret<=0)
+			break;
+		if(b)
+			b->length += ret;
+		else
+			luaL_addsize(&B, ret);
+		total += ret;
+	}
+	openssl_mem_account(s, mark);
+	if(total==0 && ret<=0)
+		return openssl_ssl_pushresult(L, s, ret);
+	if(b)
+		lua_pushinteger(L, total);
+	else
+		luaL_pushresult(&B);
+	return 1;
+}
+/* }}} */
+
+/* write control of ssl, made by ssl:cork or ssl:record_size */
+#define SSL_RECORD_MAX		16384
+#define SSL_RECORD_SMALL	1369	/* one TCP segment of 1460 bytes MSS with TLS overhead */
+#define SSL_RECORD_BOOST	(1024*1024)
+#define SSL_RECORD_IDLE		1000	/* ms */
+
+typedef struct {
+	size_t cork;		/* flush threshold, 0 when not corked */
+	BUF_MEM *pending;
+	int small;		/* record size in slow start, 0 when not dynamic */
+	size_t boost;		/* bytes sent before full records */
+	long idle;		/* ms without write to slow start again */
+	size_t sent;
+	double last;
+	int fragment;
+	int retry;		/* last SSL_write not complete, same write must be retried */
+} SSL_WCTL;
+
+static int ssl_wctl_idx = -1;
+
+static void ssl_wctl_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp){
+	SSL_WCTL *w = (SSL_WCTL*)ptr;
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if(w){
+		BUF_MEM_free(w->pending);
+		free(w);
+	}
+}
+
+static SSL_WCTL *ssl_wctl(lua_State*L, SSL *s, int create){
+	SSL_WCTL *w;
+	if(ssl_wctl_idx<0){
+		if(!create)
+			return NULL;
+		ssl_wctl_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, ssl_wctl_free);
+		if(ssl_wctl_idx<0)
+			luaL_error(L, "SSL_get_ex_new_index fail");
+	}
+	w = (SSL_WCTL*)SSL_get_ex_data(s, ssl_wctl_idx);
+	if(w==NULL && create){
+		w = (SSL_WCTL*)calloc(1, sizeof(SSL_WCTL));
+		if(w==NULL || (w->pending = BUF_MEM_new())==NULL || !SSL_set_ex_data(s, ssl_wctl_idx, w)){
+			if(w)
+				BUF_MEM_free(w->pending);
+			free(w);
+			luaL_error(L, "out of memory");
+		}
+		w->fragment = SSL_RECORD_MAX;
+	}
+	return w;
+}
+
+/* monotonic ms */
+static double ssl_now_ms(void){
+#ifdef _WIN32
+	return (double)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+#endif
+}
+
+/* split_send_fragment is lowered with max_send_fragment, not raised back */
+static int ssl_send_fragment(SSL *s, int fragment){
+	if(!SSL_set_max_send_fragment(s, fragment))
+		return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_set_split_send_fragment(s, fragment);
+#endif
+	return 1;
+}
+
+/* SSL_write with record size of slow start, small records first, then
+   full records after boost bytes, slow start again after idle */
+static int ssl_write_record(SSL *s, SSL_WCTL *w, const void *buf, int size){
+	long mark;
+	int ret;
+	if(w && w->small && !w->retry){
+		double now = ssl_now_ms();
+		int fragment;
+		if(now - w->last > w->idle)
+			w->sent = 0;
+		w->last = now;
+		fragment = w->sent < w->boost ? w->small : SSL_RECORD_MAX;
+		if(fragment!=w->fragment && ssl_send_fragment(s, fragment))
+			w->fragment = fragment;
+	}
+	mark = openssl_mem_mark();
+	ret = SSL_write(s, buf, size);
+	openssl_mem_account(s, mark);
+	if(w){
+		w->retry = ret<=0;
+		if(ret>0)
+			w->sent += ret;
+	}
+	return ret;
+}
+
+/* write corked data, 1 when all written or return of SSL_write */
+static int ssl_wctl_flush(SSL *s, SSL_WCTL *w){
+	while(w->pending->length>0){
+		size_t n = w->pending->length;
+		int ret = ssl_write_record(s, w, w->pending->data, n>INT_MAX ? INT_MAX : (int)n);
+		if(ret<=0)
+			return ret;
+		openssl_buffer_consume(w->pending, ret);
+	}
+	return 1;
+}
+
+/* flush corked data before other output, 0 and push result when not done */
+static int ssl_flush_pending(lua_State*L, SSL *s, int *nret){
+	SSL_WCTL *w = ssl_wctl(L, s, 0);
+	int ret;
+	if(w==NULL || w->pending->length==0)
+		return 1;
+	ret = ssl_wctl_flush(s, w);
+	if(ret<=0){
+		*nret = openssl_ssl_pushresult(L, s, ret);
+		return 0;
+	}
+	return 1;
+}
+
+/* corked write, data is taken unless too much pending, return bytes taken,
+   or -1 and push result to nret */
+static int ssl_write_corked(lua_State*L, SSL *s, SSL_WCTL *w, const char *buf, size_t size, int *nret){
+	size_t limit = (w->cork>SSL_RECORD_MAX ? w->cork : SSL_RECORD_MAX)*4;
+	char *p;
+	int ret;
+	if(w->pending->length>=limit){
+		ret = ssl_wctl_flush(s, w);
+		if(ret<=0 && w->pending->length>=limit){
+			*nret = openssl_ssl_pushresult(L, s, ret);
+			return -1;
+		}
+	}
+	if(size>limit)
+		size = limit;
+	p = openssl_buffer_reserve(w->pending, size);
+	if(p==NULL)
+		return luaL_error(L, "out of memory");
+	memcpy(p, buf, size);
+	w->pending->length += size;
+	if(w->pending->length>=w->cork){
+		ret = ssl_wctl_flush(s, w);
+		if(ret<=0){
+			int err = SSL_get_error(s, ret);
+			/* kept, written by next write or flush */
+			if(err!=SSL_ERROR_WANT_WRITE && err!=SSL_ERROR_WANT_READ){
+				*nret = openssl_ssl_pushresult(L, s, ret);
+				return -1;
+			}
+		}
+	}
+	return (int)size;
+}
+
+/*  ssl:write(string data [,number offset=1 [, number len]]) -> number {{{1
+	ssl:write(buffer buf) -> number
+	return bytes written, maybe less than data, write rest of data later,
+	bytes written are removed from buf
+*/
+static int openssl_ssl_write_early(lua_State*L, int early){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	BUF_MEM *b = NULL;
+	const char* buf;
+	size_t size;
+	int ret;
+
+	if(auxiliar_isclass(L, "openssl.buffer", 2)){
+		b = CHECK_OBJECT(2, BUF_MEM, "openssl.buffer");
+		buf = b->data;
+		size = b->length;
+	}else{
+		lua_Integer off = luaL_optinteger(L, 3, 1);
+		buf = luaL_checklstring(L, 2, &size);
+		luaL_argcheck(L, off>=1 && (size_t)off<=size+1, 3, "out of range");
+		buf += off-1;
+		size -= off-1;
+		if(!lua_isnoneornil(L, 4)){
+			lua_Integer len = luaL_checkinteger(L, 4);
+			luaL_argcheck(L, len>=0 && (size_t)len<=size, 4, "out of range");
+			size = (size_t)len;
+		}
+	}
+	if(size==0){
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	if(size>INT_MAX)
+		size = INT_MAX;
+	if(early){
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		size_t n = 0;
+		long mark = openssl_mem_mark();
+		ret = SSL_write_early_data(s, buf, size, &n);
+		openssl_mem_account(s, mark);
+		if(!ret)
+			return openssl_ssl_pushresult(L, s, -1);
+		ret = (int)n;
+#else
+		return luaL_error(L, "early data not supported");
+#endif
+	}else{
+		SSL_WCTL *w = ssl_wctl(L, s, 0);
+		int nret;
+		if(w && w->cork){
+			ret = ssl_write_corked(L, s, w, buf, size, &nret);
+			if(ret<0)
+				return nret;
+		}else{
+			if(w && !ssl_flush_pending(L, s, &nret))
+				return nret;
+			ret = ssl_write_record(s, w, buf, (int)size);
+			if(ret<=0)
+				return openssl_ssl_pushresult(L, s, ret);
+		}
+	}
+	if(b)
+		openssl_buffer_consume(b, ret);
 	lua_pushinteger(L, ret);
 	return 1;
 }
 
 static int openssl_ssl_write(lua_State*L){
+	return openssl_ssl_write_early(L, 0);
+}
+/* }}} */
+
+/*  ssl:writev(table pieces) -> number {{{1
+	write array of string or buffer as one stream without concatenation,
+	small pieces are packed into full records, big piece is written in
+	place. return bytes written, maybe less than all, bytes written are
+	removed from buffers, call again with rest of strings. corked ssl take
+	pieces as ssl:write does
+*/
+static int openssl_ssl_writev(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	SSL_WCTL *w = ssl_wctl(L, s, 0);
+	char tmp[SSL_RECORD_MAX];
+	size_t total = 0, fill = 0;
+	int n, i, ret = 1, nret = 0;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = (int)lua_objlen(L, 2);
+	if(w && w->cork){
+		for(i=1; i<=n; i++){
+			BUF_MEM *b;
+			size_t len;
+			const char *p = openssl_buffer_piece(L, 2, i, &len, &b);
+			if(len==0)
+				continue;
+			ret = ssl_write_corked(L, s, w, p, len, &nret);
+			if(ret<0)
+				break;
+			total += ret;
+			if((size_t)ret<len)
+				break;
+		}
+	}else if(w && !ssl_flush_pending(L, s, &nret)){
+		return nret;
+	}else{
+		for(i=1; i<=n && ret>0; i++){
+			BUF_MEM *b;
+			size_t len, off = 0;
+			const char *p = openssl_buffer_piece(L, 2, i, &len, &b);
+			while(off<len){
+				size_t c = len-off;
+				if(fill==0 && c>=SSL_RECORD_MAX){
+					/* full record from piece itself */
+					ret = ssl_write_record(s, w, p+off, c>INT_MAX ? INT_MAX : (int)c);
+					if(ret<=0)
+						break;
+					off += ret;
+					total += ret;
+					continue;
+				}
+				if(c>SSL_RECORD_MAX-fill)
+					c = SSL_RECORD_MAX-fill;
+				memcpy(tmp+fill, p+off, c);
+				fill += c;
+				off += c;
+				if(fill==SSL_RECORD_MAX){
+					ret = ssl_write_record(s, w, tmp, (int)fill);
+					if(ret<=0)
+						break;
+					total += ret;
+					/* partial write of small record, keep rest in tmp */
+					fill -= ret;
+					memmove(tmp, tmp+ret, fill);
+				}
+			}
+		}
+		while(ret>0 && fill>0){
+			ret = ssl_write_record(s, w, tmp, (int)fill);
+			if(ret>0){
+				total += ret;
+				fill -= ret;
+				memmove(tmp, tmp+ret, fill);
+			}
+		}
+		if(ret<0 || (ret==0 && total==0))
+			nret = openssl_ssl_pushresult(L, s, ret);
+	}
+	if(total==0 && nret)
+		return nret;
+	lua_settop(L, 2);
+	openssl_buffer_consumev(L, 2, total);
+	lua_pushinteger(L, (lua_Integer)total);
+	return 1;
+}
+/* }}} */
+
+/*  ssl:write_early_data(...) -> number {{{1
+	same as ssl:write, client send TLSv1.3 0-RTT data with resumed session
+	before connect or do_handshake, data maybe replayed by attacker, only
+	send idempotent request
+*/
+static int openssl_ssl_write_early_data(lua_State*L){
+	return openssl_ssl_write_early(L, 1);
+}
+/* }}} */
+
+/*  ssl:cork([number threshold|boolean off]) -> number {{{1
+	cork small writes, ssl:write copy data and return, records are written
+	when threshold bytes pending, by ssl:flush or ssl:shutdown. when corked
+	data not written by want_write, ssl:write take data until 4 times of
+	max(threshold, 16384) pending, and return nil, 'want_write' after.
+	true use threshold 16384, false or 0 uncork and flush.
+	return current threshold
+*/
+static int openssl_ssl_cork(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	SSL_WCTL *w;
+	if(lua_isnoneornil(L, 2)){
+		w = ssl_wctl(L, s, 0);
+		lua_pushinteger(L, w ? (lua_Integer)w->cork : 0);
+		return 1;
+	}
+	w = ssl_wctl(L, s, 1);
+	if(lua_isboolean(L, 2))
+		w->cork = lua_toboolean(L, 2) ? SSL_RECORD_MAX : 0;
+	else{
+		lua_Integer n = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, n>=0 && n<=INT_MAX/4, 2, "out of range");
+		w->cork = (size_t)n;
+	}
+	if(w->cork==0 && w->pending->length>0){
+		int ret = ssl_wctl_flush(s, w);
+		if(ret<=0)
+			return openssl_ssl_pushresult(L, s, ret);
+	}
+	lua_pushinteger(L, (lua_Integer)w->cork);
+	return 1;
+}
+/* }}} */
+
+/*  ssl:flush() -> number {{{1
+	write corked data and flush write bio, return bytes still pending, 0
+	when all written, or nil and reason as ssl:write. pending bytes of
+	bio counted when bio can not flush now, like batched custom bio
+*/
+static int openssl_ssl_flush(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	SSL_WCTL *w = ssl_wctl(L, s, 0);
+	BIO *wbio = SSL_get_wbio(s);
+	lua_Integer pending;
+	if(w && w->pending->length>0){
+		int ret = ssl_wctl_flush(s, w);
+		if(ret<=0)
+			return openssl_ssl_pushresult(L, s, ret);
+	}
+	pending = w ? (lua_Integer)w->pending->length : 0;
+	if(wbio && BIO_flush(wbio)<=0){
+		if(!BIO_should_retry(wbio)){
+			lua_pushnil(L);
+			lua_pushliteral(L, "flush fail");
+			return 2;
+		}
+		pending += (lua_Integer)BIO_wpending(wbio);
+	}
+	lua_pushinteger(L, pending);
+	return 1;
+}
+/* }}} */
+
+/*  ssl:record_size([number small=1369 [, number boost=1048576 [, number idle=1000]]]|boolean) -> number, number, number {{{1
+	dynamic record size, send small records fit one TCP segment, peer can
+	decrypt first bytes without wait a whole 16k record, after boost bytes
+	sent use full records for throughput, fall back to small records after
+	idle ms without write. true use default, false use full records always.
+	return small, boost, idle, small is 0 when not dynamic
+*/
+static int openssl_ssl_record_size(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	SSL_WCTL *w;
+	if(lua_gettop(L)>1){
+		w = ssl_wctl(L, s, 1);
+		if(lua_isboolean(L, 2) && !lua_toboolean(L, 2)){
+			w->small = 0;
+			if(w->fragment!=SSL_RECORD_MAX && ssl_send_fragment(s, SSL_RECORD_MAX))
+				w->fragment = SSL_RECORD_MAX;
+		}else{
+			lua_Integer small = lua_isboolean(L, 2) ? SSL_RECORD_SMALL : luaL_optinteger(L, 2, SSL_RECORD_SMALL);
+			lua_Integer boost = luaL_optinteger(L, 3, SSL_RECORD_BOOST);
+			lua_Integer idle = luaL_optinteger(L, 4, SSL_RECORD_IDLE);
+			luaL_argcheck(L, small>=512 && small<=SSL_RECORD_MAX, 2, "out of range");
+			luaL_argcheck(L, boost>=0, 3, "out of range");
+			luaL_argcheck(L, idle>=0, 4, "out of range");
+			w->small = (int)small;
+			w->boost = (size_t)boost;
+			w->idle = (long)idle;
+			w->sent = 0;
+			w->last = ssl_now_ms();
+		}
+	}else
+		w = ssl_wctl(L, s, 0);
+	lua_pushinteger(L, w ? w->small : 0);
+	lua_pushinteger(L, w ? (lua_Integer)w->boost : 0);
+	lua_pushinteger(L, w ? w->idle : 0);
+	return 3;
+}
+/* }}} */
+
+/*  ssl:read_early_data(...) -> string|number {{{1
+	same as ssl:read, server read 0-RTT data before accept or do_handshake,
+	return nil, "finish" when no more early data
+*/
+static int openssl_ssl_read_early_data(lua_State*L){
+	return openssl_ssl_read_peek(L, SSL_IO_EARLY);
+}
+/* }}} */
+
+/*  ssl:ktls([boolean enable]) -> boolean send, boolean recv {{{1
+	enable kernel TLS before handshake, return if kernel encrypts sending
+	and decrypts receiving now
+*/
+static int openssl_ssl_ktls(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+#ifdef SSL_KTLS
+	if(!lua_isnoneornil(L, 2)){
+		if(auxiliar_checkboolean(L, 2))
+			SSL_set_options(s, SSL_OP_ENABLE_KTLS);
+		else
+			SSL_clear_options(s, SSL_OP_ENABLE_KTLS);
+	}
+	lua_pushboolean(L, SSL_get_wbio(s) && BIO_get_ktls_send(SSL_get_wbio(s)));
+	lua_pushboolean(L, SSL_get_rbio(s) && BIO_get_ktls_recv(SSL_get_rbio(s)));
+#else
+	(void)s;
+	lua_pushboolean(L, 0);
+	lua_pushboolean(L, 0);
+#endif
+	return 2;
+}
+/* }}} */
+
+/*  ssl:sendfile(number fd|file f, number offset, number len) -> number {{{1
+	send len bytes of file from offset, with ktls send kernel encrypts from
+	page cache without copy, else one record is read and written as
+	ssl:write does. return bytes sent, maybe less than len, call again with
+	same arguments after want_write
+*/
+static int openssl_ssl_sendfile(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	lua_Integer off = luaL_checkinteger(L, 3);
+	lua_Integer len = luaL_checkinteger(L, 4);
+	int fd;
+
+	if(lua_isnumber(L, 2))
+		fd = lua_tointeger(L, 2);
+	else{
+		FILE* f = *(FILE**)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+		luaL_argcheck(L, f!=NULL, 2, "closed file");
+		fd = fileno(f);
+	}
+	luaL_argcheck(L, off>=0, 3, "out of range");
+	luaL_argcheck(L, len>=0, 4, "out of range");
+	if(len==0){
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	{
+		int nret;
+		if(!ssl_flush_pending(L, s, &nret))
+			return nret;
+	}
+#ifdef SSL_KTLS
+	if(SSL_get_wbio(s) && BIO_get_ktls_send(SSL_get_wbio(s))){
+		long mark = openssl_mem_mark();
+		ossl_ssize_t n = SSL_sendfile(s, fd, (off_t)off, (size_t)len, 0);
+		openssl_mem_account(s, mark);
+		if(n<0)
+			return openssl_ssl_pushresult(L, s, -1);
+		lua_pushinteger(L, (lua_Integer)n);
+		return 1;
+	}
+#endif
+#ifndef _WIN32
+	{
+		char buf[SSL3_RT_MAX_PLAIN_LENGTH];
+		ssize_t n;
+		int ret;
+		if(len>(lua_Integer)sizeof(buf))
+			len = sizeof(buf);
+		n = pread(fd, buf, (size_t)len, (off_t)off);
+		if(n<0){
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(errno));
+			return 2;
+		}
+		if(n==0){
+			lua_pushinteger(L, 0);
+			return 1;
+		}
+		ret = ssl_write_record(s, ssl_wctl(L, s, 0), buf, (int)n);
+		if(ret<=0)
+			return openssl_ssl_pushresult(L, s, ret);
+		lua_pushinteger(L, ret);
+		return 1;
+	}
+#else
+	lua_pushnil(L);
+	lua_pushliteral(L, "not supported");
+	return 2;
+#endif
+}
+/* }}} */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/*  ssl:early_data_status() -> string {{{1
+	not_sent, rejected or accepted
+*/
+static int openssl_ssl_early_data_status(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	switch(SSL_get_early_data_status(s)){
+	case SSL_EARLY_DATA_ACCEPTED:
+		lua_pushliteral(L, "accepted");
+		break;
+	case SSL_EARLY_DATA_REJECTED:
+		lua_pushliteral(L, "rejected");
+		break;
+	default:
+		lua_pushliteral(L, "not_sent");
+	}
+	return 1;
+}
+/* }}} */
+#endif
+
+/* bio ciphertext move in or out, only bio_pair or memory bio */
+static BIO *openssl_ssl_network(lua_State*L, BIO *bio){
+	BIO *network = openssl_bio_network(bio);
+	if(bio==NULL || (network==bio && BIO_method_type(bio)!=BIO_TYPE_MEM))
+		luaL_error(L, "ssl not use bio_pair or memory bio");
+	return network;
+}
+
+/*  ssl:feed(string data|buffer buf) -> number {{{1
+	put ciphertext received from network into ssl, return bytes accepted,
+	maybe less than data when bio_pair is full, read from ssl and feed again,
+	bytes accepted are removed from buf
+*/
+static int openssl_ssl_feed(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	BIO *network = openssl_ssl_network(L, SSL_get_rbio(s));
+	BUF_MEM *b = NULL;
+	const char* data;
 	size_t size;
-	const char* buf = luaL_checklstring(L, 2, &size);
-	int ret = SSL_write(s, buf, size);
+	int ret;
+
+	if(auxiliar_isclass(L, "openssl.buffer", 2)){
+		b = CHECK_OBJECT(2, BUF_MEM, "openssl.buffer");
+		data = b->data;
+		size = b->length;
+	}else
+		data = luaL_checklstring(L, 2, &size);
+	if(size>INT_MAX)
+		size = INT_MAX;
+	ret = size ? BIO_write(network, data, (int)size) : 0;
+	if(ret<0){
+		if(!BIO_should_retry(network)){
+			lua_pushnil(L);
+			lua_pushliteral(L, "bio write fail");
+			return 2;
+		}
+		ret = 0;
+	}
+	if(b)
+		openssl_buffer_consume(b, ret);
 	lua_pushinteger(L, ret);
 	return 1;
 }
+/* }}} */
+
+/*  ssl:pending_output() -> string {{{1
+	ssl:pending_output(buffer buf) -> number
+	take all ciphertext should send to network, empty when nothing,
+	append to buf when given and return bytes taken
+*/
+static int openssl_ssl_pending_output(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	BIO *network = openssl_ssl_network(L, SSL_get_wbio(s));
+	BUF_MEM *b = auxiliar_isclass(L, "openssl.buffer", 2) ? CHECK_OBJECT(2, BUF_MEM, "openssl.buffer") : NULL;
+	size_t total = 0;
+	size_t pending;
+	int ret;
+	luaL_Buffer B;
+
+	if(b==NULL)
+		luaL_buffinit(L, &B);
+	while((pending = BIO_ctrl_pending(network))>0){
+		char *p;
+		if(b){
+			p = openssl_buffer_reserve(b, pending);
+			if(p==NULL)
+				luaL_error(L, "out of memory");
+		}else{
+			p = luaL_prepbuffer(&B);
+			if(pending>LUAL_BUFFERSIZE)
+				pending = LUAL_BUFFERSIZE;
+		}
+		if(pending>INT_MAX)
+			pending = INT_MAX;
+		ret = BIO_read(network, p, (int)pending);
+		if(ret<=0)
+			break;
+		if(b)
+			b->length += ret;
+		else
+			luaL_addsize(&B, ret);
+		total += ret;
+	}
+	if(b)
+		lua_pushinteger(L, total);
+	else
+		luaL_pushresult(&B);
+	return 1;
+}
+/* }}} */
 
 static int openssl_ssl_ctrl(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
@@ -846,13 +2004,18 @@ static int openssl_ssl_version(lua_State*L){
 	const char* v = SSL_get_version(s);
 	lua_pushinteger(L, iv);
 	lua_pushstring(L, v);
-	return 1;
+	return 2;
 }
 
+/* ssl:do_handshake() -> true or nil, reason */
 static int openssl_ssl_do_handshake(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	long mark = openssl_mem_mark();
 	int ret = SSL_do_handshake(s);
-	lua_pushboolean(L, ret);
+	openssl_mem_account(s, mark);
+	if(ret!=1)
+		return openssl_ssl_pushresult(L, s, ret);
+	lua_pushboolean(L, 1);
 	return 1;
 }
 
@@ -877,9 +2040,20 @@ static int openssl_ssl_renegotiate_pending(lua_State*L){
 	return 1;
 }
 
+/* ssl:shutdown() -> boolean or nil, reason
+	false when close_notify sent but peer's not received yet, corked data
+	is flushed before */
 static int openssl_ssl_shutdown(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
-	int ret = SSL_shutdown(s);
+	long mark;
+	int ret;
+	if(!ssl_flush_pending(L, s, &ret))
+		return ret;
+	mark = openssl_mem_mark();
+	ret = SSL_shutdown(s);
+	openssl_mem_account(s, mark);
+	if(ret<0)
+		return openssl_ssl_pushresult(L, s, ret);
 	lua_pushboolean(L, ret);
 	return 1;
 }
@@ -913,14 +2087,16 @@ static int openssl_ssl_dup(lua_State*L){
 static int openssl_ssl_get_certificate(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
 	X509 *x = SSL_get_certificate(s);
-	PUSH_OBJECT(x,"openssl.x509");
+	if(x)
+		X509_up_ref(x);
+	PUSH_OBJECT_REF(x,"openssl.x509",X509_free);
 	return 1;
 }
 #if OPENSSL_VERSION_NUMBER > 0x10000000L
 static int openssl_ssl_cache_hit(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
 	int ret = SSL_cache_hit(s);
-	lua_pushboolean(L, ret==0);
+	lua_pushboolean(L, ret!=0);
 	return 1;
 }
 static int openssl_ssl_set_debug(lua_State*L){
@@ -931,15 +2107,37 @@ static int openssl_ssl_set_debug(lua_State*L){
 }
 #endif
 #if OPENSSL_VERSION_NUMBER >= 0x0090819fL
+/*  ssl:servername([string hostname]) -> string {{{1
+	client set SNI hostname before connect, server get hostname client sent
+*/
+static int openssl_ssl_servername(lua_State*L){
+	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	const char* name;
+	if(!lua_isnoneornil(L, 2)){
+		name = luaL_checkstring(L, 2);
+		lua_pushboolean(L, SSL_set_tlsext_host_name(s, name));
+		return 1;
+	}
+	name = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
+	if(name)
+		lua_pushstring(L, name);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+/* }}} */
+
 static int openssl_ssl_ctx(lua_State*L){
 	SSL* s = CHECK_OBJECT(1, SSL, "openssl.ssl");
 	if(lua_isnoneornil(L, 2)){
 		SSL_CTX *ctx = SSL_get_SSL_CTX(s);
-		PUSH_OBJECT(ctx,"openssl.ssl_ctx");
+		SSL_CTX_up_ref(ctx);
+		PUSH_OBJECT_REF(ctx,"openssl.ssl_ctx",SSL_CTX_free);
 	}else{
 		SSL_CTX *ctx = CHECK_OBJECT(2, SSL_CTX, "openssl.ssl_ctx");
 		ctx = SSL_set_SSL_CTX(s, ctx);
-		PUSH_OBJECT(ctx,"openssl.ssl_ctx");
+		SSL_CTX_up_ref(ctx);
+		PUSH_OBJECT_REF(ctx,"openssl.ssl_ctx",SSL_CTX_free);
 	}
 	return 1;
 }
@@ -1010,10 +2208,33 @@ static int openssl_ssl_add_client_CA(lua_State*L){
 static int openssl_ssl_get_client_CA_list(lua_State*L){
 	SSL* s =  CHECK_OBJECT(1, SSL,  "openssl.ssl");
 	STACK_OF(X509_NAME)* ns = SSL_get_client_CA_list(s);
-	PUSH_OBJECT(ns,"openssl.stack_of_x509_name");
+	if(ns==NULL)
+		return 0;
+	/* list is owned by s, userdata owns a copy */
+	PUSH_OBJECT(SSL_dup_CA_list(ns),"openssl.stack_of_x509_name");
 	return 1;
 };
 
+static int openssl_sk_x509_name_gc(lua_State*L){
+	STACK_OF(X509_NAME) *ns = CHECK_OBJECT(1,STACK_OF(X509_NAME),"openssl.stack_of_x509_name");
+	sk_X509_NAME_pop_free(ns, X509_NAME_free);
+	return 0;
+}
+
+static int openssl_sk_x509_name_length(lua_State*L){
+	STACK_OF(X509_NAME) *ns = CHECK_OBJECT(1,STACK_OF(X509_NAME),"openssl.stack_of_x509_name");
+	lua_pushinteger(L, sk_X509_NAME_num(ns));
+	return 1;
+}
+
+static luaL_Reg sk_x509_name_funcs[] = {
+	{"__len",		openssl_sk_x509_name_length},
+	{"__gc",		openssl_sk_x509_name_gc},
+	{"__tostring",	auxiliar_tostring},
+
+	{NULL,			NULL}
+};
+
 static int openssl_ssl_alert_type_string(lua_State*L)
 {
 	SSL* s =  CHECK_OBJECT(1, SSL,  "openssl.ssl");
@@ -1050,7 +2271,7 @@ static int openssl_ssl_session(lua_State*L){
 
 	if(lua_isnoneornil(L,2)){
 		ss = SSL_get1_session(s);
-		PUSH_OBJECT(ss,"openssl.ssl_session");
+		PUSH_OBJECT_REF(ss,"openssl.ssl_session",SSL_SESSION_free);
 	}else{
 		if(lua_isstring(L, 3))
 		{
@@ -1110,6 +2331,7 @@ static luaL_Reg ssl_funcs[] = {
 	{"dup",				openssl_ssl_dup},
 #if OPENSSL_VERSION_NUMBER >= 0x0090819fL
 	{"ctx",				openssl_ssl_ctx},
+	{"servername",		openssl_ssl_servername},
 #endif
 	
 	{"clear",			openssl_ssl_clear},
@@ -1119,7 +2341,26 @@ static luaL_Reg ssl_funcs[] = {
 	{"connect",			openssl_ssl_connect},
 	{"read",			openssl_ssl_read},
 	{"peek",			openssl_ssl_peek},
+	{"read_all",		openssl_ssl_read_all},
 	{"write",			openssl_ssl_write},
+	{"feed",			openssl_ssl_feed},
+	{"pending_output",	openssl_ssl_pending_output},
+	{"sendfile",		openssl_ssl_sendfile},
+	{"memory_usage",	openssl_ssl_memory_usage},
+	{"ktls",			openssl_ssl_ktls},
+	{"ocsp_request",	openssl_ssl_ocsp_request},
+	{"ocsp_staple",		openssl_ssl_ocsp_staple},
+	{"alpn",			openssl_ssl_alpn},
+	{"alpn_selected",	openssl_ssl_alpn_selected},
+	{"read_early_data",	openssl_ssl_read_early_data},
+	{"write_early_data",	openssl_ssl_write_early_data},
+	{"writev",		openssl_ssl_writev},
+	{"cork",		openssl_ssl_cork},
+	{"flush",		openssl_ssl_flush},
+	{"record_size",		openssl_ssl_record_size},
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	{"early_data_status",	openssl_ssl_early_data_status},
+#endif
 	{"ctrl",			openssl_ssl_ctrl},
 	{"error",			openssl_ssl_error},
 	{"version",			openssl_ssl_version},
@@ -1185,5 +2426,6 @@ int openssl_register_ssl(lua_State* L){
 	auxiliar_newclass(L,"openssl.ssl_ctx",		ssl_ctx_funcs);
 	auxiliar_newclass(L,"openssl.ssl_session",	ssl_session_funcs);
 	auxiliar_newclass(L,"openssl.ssl",			ssl_funcs);
+	auxiliar_newclass(L,"openssl.stack_of_x509_name",	sk_x509_name_funcs);
 	return 0;
 }
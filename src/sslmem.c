@@ -0,0 +1,400 @@
+/*=========================================================================*\
+* ssl memory
+* lua-openssl toolkit
+*
+* OpenSSL allocations go through functions here when they are installed
+* before OpenSSL allocates anything. every block has a small header with
+* its size, blocks of record buffer size are kept in a process wide free
+* list by size class, so buffers released by idle connections are reused
+* without malloc. bytes a ssl holds are the net allocation of its thread
+* while OpenSSL works on that ssl, summed per ssl_ctx. counters are atomic,
+* only free list push and pop take the lock.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#define MEM_TLS	__declspec(thread)
+#define mem_add(p, d)		(InterlockedExchangeAdd((volatile LONG *)(p), (d)) + (d))
+#define mem_cas(p, o, n)	(InterlockedCompareExchange((volatile LONG *)(p), (n), (o)) == (o))
+#elif defined(__GNUC__)
+#define MEM_TLS	__thread
+#define mem_add(p, d)		__sync_add_and_fetch((p), (d))
+#define mem_cas(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#endif
+
+#ifdef MEM_TLS
+#define MEM_CLASSES		5
+#define MEM_CLASS_CACHE		64	/* free blocks kept per class */
+#define MEM_NOCLASS		((size_t)-1)
+
+typedef union {
+	struct {
+		size_t size;
+		size_t cls;
+	} h;
+	/* keep user block aligned as malloc does */
+	long double ld;
+	void *p;
+} MEM_HDR;
+
+typedef struct mem_free_st {
+	struct mem_free_st *next;
+} MEM_FREE;
+
+/* record buffers are 16k plaintext plus overhead, handshake messages less */
+static const size_t mem_class_size[MEM_CLASSES] = {2048, 4096, 8192, 18432, 34816};
+
+static struct {
+#ifdef PTHREADS
+	pthread_mutex_t lock;		/* of free lists */
+#endif
+	int installed;
+	long bytes;			/* held by OpenSSL in process, atomic */
+	long cached;			/* bytes in free lists, atomic */
+	MEM_FREE *free[MEM_CLASSES];
+	int count[MEM_CLASSES];
+} mem = {
+#ifdef PTHREADS
+	PTHREAD_MUTEX_INITIALIZER,
+#endif
+	0, 0, 0, {NULL}, {0}
+};
+
+/* net bytes allocated by this thread */
+static MEM_TLS long mem_thread;
+
+static void mem_lock(void)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&mem.lock);
+#endif
+}
+
+static void mem_unlock(void)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&mem.lock);
+#endif
+}
+
+/* raise peak to v, other thread may raise it too */
+static void mem_peak(long *peak, long v)
+{
+	long p;
+	while ((p = *(volatile long *)peak) < v && !mem_cas(peak, p, v))
+		;
+}
+
+static size_t mem_class(size_t size)
+{
+	size_t i;
+	for (i = 0; i < MEM_CLASSES; i++)
+		if (size <= mem_class_size[i])
+			return size > mem_class_size[i] / 2 ? i : MEM_NOCLASS;
+	return MEM_NOCLASS;
+}
+
+static void *mem_alloc(size_t size)
+{
+	size_t cls = mem_class(size);
+	MEM_HDR *hdr = NULL;
+
+	if (cls != MEM_NOCLASS) {
+		mem_lock();
+		if (mem.free[cls]) {
+			hdr = (MEM_HDR *)mem.free[cls];
+			mem.free[cls] = ((MEM_FREE *)hdr)->next;
+			mem.count[cls]--;
+		}
+		mem_unlock();
+		if (hdr)
+			mem_add(&mem.cached, -(long)mem_class_size[cls]);
+		else
+			hdr = (MEM_HDR *)malloc(sizeof(MEM_HDR) + mem_class_size[cls]);
+	} else
+		hdr = (MEM_HDR *)malloc(sizeof(MEM_HDR) + size);
+	if (hdr == NULL)
+		return NULL;
+	hdr->h.size = size;
+	hdr->h.cls = cls;
+	mem_thread += (long)size;
+	mem_add(&mem.bytes, (long)size);
+	return hdr + 1;
+}
+
+static void mem_release(void *ptr)
+{
+	MEM_HDR *hdr;
+	size_t cls;
+	if (ptr == NULL)
+		return;
+	hdr = (MEM_HDR *)ptr - 1;
+	cls = hdr->h.cls;
+	mem_thread -= (long)hdr->h.size;
+	mem_add(&mem.bytes, -(long)hdr->h.size);
+	if (cls != MEM_NOCLASS) {
+		mem_lock();
+		if (mem.count[cls] < MEM_CLASS_CACHE) {
+			((MEM_FREE *)hdr)->next = mem.free[cls];
+			mem.free[cls] = (MEM_FREE *)hdr;
+			mem.count[cls]++;
+			hdr = NULL;
+		}
+		mem_unlock();
+		if (hdr == NULL) {
+			mem_add(&mem.cached, (long)mem_class_size[cls]);
+			return;
+		}
+	}
+	free(hdr);
+}
+
+static void *mem_resize(void *ptr, size_t size)
+{
+	MEM_HDR *hdr;
+	void *p;
+	if (ptr == NULL)
+		return mem_alloc(size);
+	hdr = (MEM_HDR *)ptr - 1;
+	if (hdr->h.cls != MEM_NOCLASS && size <= mem_class_size[hdr->h.cls]
+	    && size > mem_class_size[hdr->h.cls] / 2) {
+		long d = (long)size - (long)hdr->h.size;
+		hdr->h.size = size;
+		mem_thread += d;
+		mem_add(&mem.bytes, d);
+		return ptr;
+	}
+	p = mem_alloc(size);
+	if (p == NULL)
+		return NULL;
+	memcpy(p, ptr, hdr->h.size < size ? hdr->h.size : size);
+	mem_release(ptr);
+	return p;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void *mem_malloc_cb(size_t size, const char *file, int line)
+{
+	(void)file; (void)line;
+	return mem_alloc(size);
+}
+
+static void *mem_realloc_cb(void *ptr, size_t size, const char *file, int line)
+{
+	(void)file; (void)line;
+	return mem_resize(ptr, size);
+}
+
+static void mem_free_cb(void *ptr, const char *file, int line)
+{
+	(void)file; (void)line;
+	mem_release(ptr);
+}
+#else
+#define mem_malloc_cb	mem_alloc
+#define mem_realloc_cb	mem_resize
+#define mem_free_cb	mem_release
+#endif
+
+/****************************** per ssl ******************************/
+/* of ssl_ctx, shared by threads, changed by mem_add */
+typedef struct {
+	long bytes;
+	long peak;
+	long connections;
+} MEM_STATS;
+
+typedef struct {
+	long bytes;
+	long peak;
+	MEM_STATS *ctx;			/* of session ctx, it outlives ssl */
+} MEM_SSL;
+
+static int mem_ctx_idx = -1;
+static int mem_ssl_idx = -1;
+
+static void mem_ctx_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	free(ptr);
+}
+
+/* connection gone, its bytes are freed right after */
+static void mem_ssl_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	MEM_SSL *m = (MEM_SSL *)ptr;
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (m == NULL)
+		return;
+	mem_add(&m->ctx->bytes, -m->bytes);
+	mem_add(&m->ctx->connections, -1);
+	free(m);
+}
+
+static MEM_STATS *mem_ctx_stats(SSL_CTX *ctx)
+{
+	MEM_STATS *st = (MEM_STATS *)SSL_CTX_get_ex_data(ctx, mem_ctx_idx);
+	if (st == NULL) {
+		st = (MEM_STATS *)calloc(1, sizeof(MEM_STATS));
+		if (st && !SSL_CTX_set_ex_data(ctx, mem_ctx_idx, st)) {
+			free(st);
+			st = NULL;
+		}
+	}
+	return st;
+}
+
+static MEM_SSL *mem_ssl_get(SSL *s)
+{
+	MEM_SSL *m = (MEM_SSL *)SSL_get_ex_data(s, mem_ssl_idx);
+	if (m == NULL) {
+		MEM_STATS *st = mem_ctx_stats(openssl_ssl_session_ctx(s));
+		if (st == NULL)
+			return NULL;
+		m = (MEM_SSL *)calloc(1, sizeof(MEM_SSL));
+		if (m == NULL)
+			return NULL;
+		if (!SSL_set_ex_data(s, mem_ssl_idx, m)) {
+			free(m);
+			return NULL;
+		}
+		m->ctx = st;
+		mem_add(&st->connections, 1);
+	}
+	return m;
+}
+#endif /* MEM_TLS */
+
+/* install allocator, must be before OpenSSL allocates. OpenSSL frees with
+   it at exit, after lua_close unloaded a module not pinned */
+int openssl_mem_init(void)
+{
+#ifdef MEM_TLS
+	if (!mem.installed && openssl_module_pin()
+	    && CRYPTO_set_mem_functions(mem_malloc_cb, mem_realloc_cb, mem_free_cb)) {
+		mem_ctx_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, mem_ctx_free);
+		mem_ssl_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, mem_ssl_free);
+		mem.installed = mem_ctx_idx >= 0 && mem_ssl_idx >= 0;
+	}
+	return mem.installed;
+#else
+	return 0;
+#endif
+}
+
+/* mark before OpenSSL works on a ssl */
+long openssl_mem_mark(void)
+{
+#ifdef MEM_TLS
+	return mem_thread;
+#else
+	return 0;
+#endif
+}
+
+/* add bytes allocated since mark to s */
+void openssl_mem_account(SSL *s, long mark)
+{
+#ifdef MEM_TLS
+	MEM_SSL *m;
+	long d;
+	if (!mem.installed)
+		return;
+	d = mem_thread - mark;
+	m = mem_ssl_get(s);
+	if (m == NULL || d == 0)
+		return;
+	m->bytes += d;
+	if (m->bytes > m->peak)
+		m->peak = m->bytes;
+	mem_peak(&m->ctx->peak, mem_add(&m->ctx->bytes, d));
+#else
+	(void)s; (void)mark;
+#endif
+}
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:low_memory([boolean enable]) -> boolean {{{1
+	idle ssl release read and write buffers, buffers come back from a
+	process wide free list when traffic comes. read_ahead is turned off,
+	it keeps read buffer
+*/
+LUA_FUNCTION(openssl_ssl_ctx_low_memory)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	if (!lua_isnoneornil(L, 2)) {
+		if (auxiliar_checkboolean(L, 2)) {
+			SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+			SSL_CTX_set_read_ahead(ctx, 0);
+		} else
+			SSL_CTX_clear_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+	}
+	lua_pushboolean(L, (SSL_CTX_get_mode(ctx) & SSL_MODE_RELEASE_BUFFERS) != 0);
+	return 1;
+}
+/* }}} */
+
+/*  ssl:memory_usage() -> number bytes, number peak {{{1
+	bytes OpenSSL holds for ssl, nil, "not tracked" when allocator is not
+	installed because OpenSSL was used before openssl module loaded, or
+	module can not be kept loaded
+*/
+LUA_FUNCTION(openssl_ssl_memory_usage)
+{
+	SSL *s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+#ifdef MEM_TLS
+	MEM_SSL *m = mem.installed ? mem_ssl_get(s) : NULL;
+	if (m) {
+		lua_pushinteger(L, m->bytes);
+		lua_pushinteger(L, m->peak);
+		return 2;
+	}
+#else
+	(void)s;
+#endif
+	lua_pushnil(L);
+	lua_pushliteral(L, "not tracked");
+	return 2;
+}
+/* }}} */
+
+/*  ssl_ctx:memory_stats() -> table {{{1
+	bytes, peak and connections of ssl made by ctx, process is bytes
+	OpenSSL holds in process, cached is bytes in free list
+*/
+LUA_FUNCTION(openssl_ssl_ctx_memory_stats)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+#ifdef MEM_TLS
+	MEM_STATS *st = mem.installed ? mem_ctx_stats(ctx) : NULL;
+	if (st) {
+		lua_newtable(L);
+		lua_pushinteger(L, mem_add(&st->bytes, 0));
+		lua_setfield(L, -2, "bytes");
+		lua_pushinteger(L, mem_add(&st->peak, 0));
+		lua_setfield(L, -2, "peak");
+		lua_pushinteger(L, mem_add(&st->connections, 0));
+		lua_setfield(L, -2, "connections");
+		lua_pushinteger(L, mem_add(&mem.bytes, 0));
+		lua_setfield(L, -2, "process");
+		lua_pushinteger(L, mem_add(&mem.cached, 0));
+		lua_setfield(L, -2, "cached");
+		return 1;
+	}
+#else
+	(void)ctx;
+#endif
+	lua_pushnil(L);
+	lua_pushliteral(L, "not tracked");
+	return 2;
+}
+/* }}} */
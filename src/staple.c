@@ -0,0 +1,471 @@
+/*=========================================================================*\
+* ocsp stapling
+* lua-openssl toolkit
+*
+* ssl_ctx keep a OCSP response of its certificate, checked once when it is
+* set. status callback copy it to connection that ask for status without
+* entering lua, a response past its nextUpdate is not sent. a provider
+* function gives new response, ssl_ctx:ocsp_refresh call it half way
+* between thisUpdate and nextUpdate and swap response in.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <openssl/ocsp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+#define STAPLE_SKEW		300	/* seconds of clock skew allowed */
+#define STAPLE_RETRY		3600	/* refresh interval of response without nextUpdate */
+
+typedef struct {
+#ifdef PTHREADS
+	pthread_mutex_t lock;
+#endif
+	unsigned char *der;
+	int len;
+	time_t next_update;		/* 0 when response has no nextUpdate */
+	time_t refresh_at;
+	X509 *issuer;
+	int provider;			/* provider kept in registry */
+	long served;
+} STAPLE;
+
+typedef struct {
+	int status;
+	time_t this_update;
+	time_t next_update;
+} STAPLE_INFO;
+
+static int staple_idx = -1;
+
+static void staple_lock(STAPLE *st)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&st->lock);
+#else
+	(void)st;
+#endif
+}
+
+static void staple_unlock(STAPLE *st)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&st->lock);
+#else
+	(void)st;
+#endif
+}
+
+static void staple_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	STAPLE *st = (STAPLE *)ptr;
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (st == NULL)
+		return;
+	OPENSSL_free(st->der);
+	X509_free(st->issuer);
+#ifdef PTHREADS
+	pthread_mutex_destroy(&st->lock);
+#endif
+	free(st);
+}
+
+static STAPLE *staple_get(const SSL_CTX *ctx)
+{
+	if (staple_idx < 0 || ctx == NULL)
+		return NULL;
+	return (STAPLE *)SSL_CTX_get_ex_data(ctx, staple_idx);
+}
+
+static STAPLE *staple_attach(SSL_CTX *ctx)
+{
+	STAPLE *st;
+	if (staple_idx < 0) {
+		staple_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, staple_free);
+		if (staple_idx < 0)
+			return NULL;
+	}
+	st = staple_get(ctx);
+	if (st == NULL) {
+		st = (STAPLE *)calloc(1, sizeof(STAPLE));
+		if (st == NULL)
+			return NULL;
+#ifdef PTHREADS
+		pthread_mutex_init(&st->lock, NULL);
+#endif
+		if (!SSL_CTX_set_ex_data(ctx, staple_idx, st)) {
+			staple_free(NULL, st, NULL, 0, 0, NULL);
+			return NULL;
+		}
+	}
+	return st;
+}
+
+/* status request of client, server only */
+static int staple_status_cb(SSL *s, void *arg)
+{
+	STAPLE *st = staple_get(SSL_get_SSL_CTX(s));
+	unsigned char *p = NULL;
+	int len = 0;
+	(void)arg;
+
+	if (!SSL_is_server(s))
+		return 1;
+	if (st == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+	staple_lock(st);
+	if (st->der && (st->next_update == 0 || time(NULL) < st->next_update)) {
+		p = (unsigned char *)OPENSSL_malloc(st->len);
+		if (p) {
+			memcpy(p, st->der, st->len);
+			len = st->len;
+			st->served++;
+		}
+	}
+	staple_unlock(st);
+	if (p == NULL)
+		return SSL_TLSEXT_ERR_NOACK;
+	/* OpenSSL own p now */
+	if (!SSL_set_tlsext_status_ocsp_resp(s, p, len)) {
+		OPENSSL_free(p);
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+	return SSL_TLSEXT_ERR_OK;
+}
+
+static time_t staple_time(const ASN1_GENERALIZEDTIME *t)
+{
+	int day, sec;
+	if (!ASN1_TIME_diff(&day, &sec, NULL, t))
+		return 0;
+	return time(NULL) + (time_t)day * 86400 + sec;
+}
+
+/* issuer of cert in chain of ctx or its cert store */
+static X509 *staple_find_issuer(SSL_CTX *ctx, X509 *cert)
+{
+	STACK_OF(X509) *chain = NULL;
+	X509_STORE_CTX *sctx;
+	X509 *issuer = NULL;
+	int i;
+
+	SSL_CTX_get_extra_chain_certs(ctx, &chain);
+	for (i = 0; i < sk_X509_num(chain); i++) {
+		X509 *c = sk_X509_value(chain, i);
+		if (X509_check_issued(c, cert) == X509_V_OK) {
+			X509_up_ref(c);
+			return c;
+		}
+	}
+	sctx = X509_STORE_CTX_new();
+	if (sctx && X509_STORE_CTX_init(sctx, SSL_CTX_get_cert_store(ctx), cert, NULL)) {
+		if (X509_STORE_CTX_get1_issuer(&issuer, sctx, cert) <= 0)
+			issuer = NULL;
+	}
+	X509_STORE_CTX_free(sctx);
+	return issuer;
+}
+
+/* check resp is a good answer for certificate of ctx signed for issuer */
+static const char *staple_check(SSL_CTX *ctx, OCSP_RESPONSE *resp, X509 *issuer, STAPLE_INFO *info)
+{
+	X509 *cert = SSL_CTX_get0_certificate(ctx);
+	OCSP_BASICRESP *bs;
+	OCSP_CERTID *id;
+	STACK_OF(X509) *certs;
+	ASN1_GENERALIZEDTIME *thisupd = NULL, *nextupd = NULL;
+	int reason;
+	const char *err = NULL;
+
+	if (cert == NULL)
+		return "no certificate in ssl_ctx";
+	if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+		return OCSP_response_status_str(OCSP_response_status(resp));
+	bs = OCSP_response_get1_basic(resp);
+	if (bs == NULL)
+		return "no basic response";
+
+	id = OCSP_cert_to_id(NULL, cert, issuer);
+	certs = sk_X509_new_null();
+	if (id == NULL || certs == NULL || !sk_X509_push(certs, issuer))
+		err = "out of memory";
+	else if (!OCSP_resp_find_status(bs, id, &info->status, &reason, NULL, &thisupd, &nextupd))
+		err = "no status of certificate";
+	else if (!OCSP_check_validity(thisupd, nextupd, STAPLE_SKEW, -1))
+		err = "response out of date";
+	else if (OCSP_basic_verify(bs, certs, SSL_CTX_get_cert_store(ctx), OCSP_TRUSTOTHER) <= 0)
+		err = "response signature verify fail";
+	else {
+		info->this_update = staple_time(thisupd);
+		info->next_update = nextupd ? staple_time(nextupd) : 0;
+	}
+	sk_X509_free(certs);
+	OCSP_CERTID_free(id);
+	OCSP_BASICRESP_free(bs);
+	ERR_clear_error();
+	return err;
+}
+
+/* response from der or ocsp_response object at idx */
+static OCSP_RESPONSE *staple_response(lua_State *L, int idx)
+{
+	if (auxiliar_isclass(L, "openssl.ocsp_response", idx)) {
+		OCSP_RESPONSE *resp = CHECK_OBJECT(idx, OCSP_RESPONSE, "openssl.ocsp_response");
+		return (OCSP_RESPONSE *)ASN1_item_dup(ASN1_ITEM_rptr(OCSP_RESPONSE), resp);
+	}
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		size_t len;
+		const unsigned char *dat = (const unsigned char *)lua_tolstring(L, idx, &len);
+		return d2i_OCSP_RESPONSE(NULL, &dat, (long)len);
+	}
+	return NULL;
+}
+
+/* check response at idx and swap it in, push status, next_update or nil, reason */
+static int staple_install(lua_State *L, SSL_CTX *ctx, STAPLE *st, int idx)
+{
+	OCSP_RESPONSE *resp = staple_response(L, idx);
+	STAPLE_INFO info;
+	const char *err;
+	unsigned char *der = NULL, *old;
+	int len;
+	time_t now = time(NULL);
+
+	if (resp == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "not a ocsp response");
+		return 2;
+	}
+	err = staple_check(ctx, resp, st->issuer, &info);
+	len = err ? 0 : i2d_OCSP_RESPONSE(resp, &der);
+	OCSP_RESPONSE_free(resp);
+	if (err || len <= 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, err ? err : "encode response fail");
+		return 2;
+	}
+
+	staple_lock(st);
+	old = st->der;
+	st->der = der;
+	st->len = len;
+	st->next_update = info.next_update;
+	if (info.next_update > info.this_update)
+		st->refresh_at = info.this_update + (info.next_update - info.this_update) / 2;
+	else
+		st->refresh_at = now + STAPLE_RETRY;
+	staple_unlock(st);
+	OPENSSL_free(old);
+	SSL_CTX_set_tlsext_status_cb(ctx, staple_status_cb);
+
+	lua_pushstring(L, OCSP_cert_status_str(info.status));
+	if (info.next_update)
+		lua_pushinteger(L, (lua_Integer)info.next_update);
+	else
+		lua_pushnil(L);
+	return 2;
+}
+
+/* call provider of st with ctx at 1, then install what it returns */
+static int staple_call_provider(lua_State *L, SSL_CTX *ctx, STAPLE *st)
+{
+	int top = lua_gettop(L);
+	lua_pushlightuserdata(L, st);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 1);
+	if (lua_pcall(L, 1, 2, 0) != 0) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	if (lua_isnil(L, -2)) {
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushliteral(L, "provider give no response");
+		}
+		return 2;
+	}
+	return staple_install(L, ctx, st, top + 1);
+}
+
+/* drop provider kept for ctx, called when ssl_ctx object is collected */
+void openssl_ssl_ctx_staple_release(lua_State *L, SSL_CTX *ctx)
+{
+	STAPLE *st = staple_get(ctx);
+	if (st && st->provider) {
+		lua_pushlightuserdata(L, st);
+		lua_pushnil(L);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		st->provider = 0;
+	}
+}
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:ocsp_staple(string der|ocsp_response resp|function provider [, x509 issuer]) -> string status, number next_update {{{1
+	staple resp to handshake of client asked for certificate status. resp
+	is checked once here: successful, has status of ctx certificate, in
+	valid time and signed for issuer. issuer is found in chain or cert
+	store of ctx when not given. provider(ctx) return new response, it is
+	called now and by ssl_ctx:ocsp_refresh. status is good, revoked or
+	unknown, return nil, reason when resp is not acceptable, old response
+	stay in use. ocsp_staple(false) stop stapling
+*/
+LUA_FUNCTION(openssl_ssl_ctx_ocsp_staple)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	X509 *issuer = lua_isnoneornil(L, 3) ? NULL : CHECK_OBJECT(3, X509, "openssl.x509");
+	STAPLE *st;
+
+	if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+		st = staple_get(ctx);
+		if (st) {
+			openssl_ssl_ctx_staple_release(L, ctx);
+			staple_lock(st);
+			OPENSSL_free(st->der);
+			st->der = NULL;
+			st->len = 0;
+			staple_unlock(st);
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	luaL_argcheck(L, lua_isfunction(L, 2) || lua_isstring(L, 2)
+	              || auxiliar_isclass(L, "openssl.ocsp_response", 2), 2,
+	              "need ocsp response or function");
+	if (SSL_CTX_get0_certificate(ctx) == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no certificate in ssl_ctx");
+		return 2;
+	}
+	if (issuer)
+		X509_up_ref(issuer);
+	else
+		issuer = staple_find_issuer(ctx, SSL_CTX_get0_certificate(ctx));
+	if (issuer == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "issuer of certificate not found");
+		return 2;
+	}
+
+	st = staple_attach(ctx);
+	if (st == NULL) {
+		X509_free(issuer);
+		luaL_error(L, "out of memory");
+	}
+	staple_lock(st);
+	X509_free(st->issuer);
+	st->issuer = issuer;
+	staple_unlock(st);
+
+	if (lua_isfunction(L, 2)) {
+		lua_pushlightuserdata(L, st);
+		lua_pushvalue(L, 2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		st->provider = 1;
+		return staple_call_provider(L, ctx, st);
+	}
+	openssl_ssl_ctx_staple_release(L, ctx);
+	return staple_install(L, ctx, st, 2);
+}
+/* }}} */
+
+/*  ssl_ctx:ocsp_refresh([boolean force=false]) -> number seconds {{{1
+	call provider when response is half way to its nextUpdate or force,
+	return seconds to next refresh. return nil, reason when no provider or
+	new response is not acceptable, old response stay in use, retry later
+*/
+LUA_FUNCTION(openssl_ssl_ctx_ocsp_refresh)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	int force = lua_isnoneornil(L, 2) ? 0 : auxiliar_checkboolean(L, 2);
+	STAPLE *st = staple_get(ctx);
+	time_t now = time(NULL);
+	time_t at;
+
+	if (st == NULL || !st->provider) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no provider");
+		return 2;
+	}
+	staple_lock(st);
+	at = st->refresh_at;
+	staple_unlock(st);
+	if (force || st->der == NULL || now >= at) {
+		lua_settop(L, 1);
+		if (staple_call_provider(L, ctx, st) == 2 && lua_isnil(L, -2))
+			return 2;
+		staple_lock(st);
+		at = st->refresh_at;
+		staple_unlock(st);
+	}
+	lua_pushinteger(L, at > now ? (lua_Integer)(at - now) : 0);
+	return 1;
+}
+/* }}} */
+
+/*  ssl_ctx:ocsp_stats() -> table {{{1
+	status of staple: next_update, refresh_at and served count
+*/
+LUA_FUNCTION(openssl_ssl_ctx_ocsp_stats)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	STAPLE *st = staple_get(ctx);
+	STAPLE copy;
+	if (st == NULL || st->der == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no staple");
+		return 2;
+	}
+	staple_lock(st);
+	copy = *st;
+	staple_unlock(st);
+	lua_newtable(L);
+	if (copy.next_update) {
+		lua_pushinteger(L, (lua_Integer)copy.next_update);
+		lua_setfield(L, -2, "next_update");
+	}
+	lua_pushinteger(L, (lua_Integer)copy.refresh_at);
+	lua_setfield(L, -2, "refresh_at");
+	lua_pushinteger(L, copy.served);
+	lua_setfield(L, -2, "served");
+	lua_pushinteger(L, copy.len);
+	lua_setfield(L, -2, "length");
+	lua_pushboolean(L, copy.provider);
+	lua_setfield(L, -2, "provider");
+	return 1;
+}
+/* }}} */
+
+/*  ssl:ocsp_request() -> boolean {{{1
+	client ask server for certificate status, before handshake
+*/
+LUA_FUNCTION(openssl_ssl_ocsp_request)
+{
+	SSL *s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	lua_pushboolean(L, SSL_set_tlsext_status_type(s, TLSEXT_STATUSTYPE_ocsp) > 0);
+	return 1;
+}
+/* }}} */
+
+/*  ssl:ocsp_staple() -> string {{{1
+	der of OCSP response stapled by server, nil when none
+*/
+LUA_FUNCTION(openssl_ssl_ocsp_staple)
+{
+	SSL *s = CHECK_OBJECT(1, SSL, "openssl.ssl");
+	const unsigned char *p = NULL;
+	long len = SSL_get_tlsext_status_ocsp_resp(s, &p);
+	if (p == NULL || len <= 0)
+		lua_pushnil(L);
+	else
+		lua_pushlstring(L, (const char *)p, len);
+	return 1;
+}
+/* }}} */
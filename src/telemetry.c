@@ -0,0 +1,550 @@
+/*=========================================================================*\
+* ssl_ctx telemetry
+* lua-openssl toolkit
+*
+* counters and handshake phase timings of a ssl_ctx, collected by the info
+* callback of ssl_ctx. nothing is installed until telemetry is enabled, a
+* ssl_ctx without telemetry pays nothing. phases are hello (ClientHello to
+* ServerHelloDone, to ServerHello in TLSv1.3), key exchange (to
+* ChangeCipherSpec, to server Finished in TLSv1.3) and finished (to end
+* of handshake), every phase has a histogram with fixed buckets. sizes
+* of Certificate and CompressedCertificate messages are counted by the
+* message callback.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+#define HS_PHASES		4	/* hello, key exchange, finished, total */
+#define HS_BUCKETS		13
+#define HS_NAMES		16	/* distinct versions or ciphers counted */
+
+#ifndef SSL3_MT_COMPRESSED_CERTIFICATE
+#define SSL3_MT_COMPRESSED_CERTIFICATE	25
+#endif
+
+static const char *hs_phase_name[HS_PHASES] = {"hello", "key_exchange", "finished", "total"};
+
+/* upper bound of buckets in microseconds, last bucket is unbounded */
+static const double hs_bucket_bound[HS_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+typedef struct {
+	long count;
+	double sum;
+	long bucket[HS_BUCKETS];
+} HS_HIST;
+
+typedef struct {
+	const char *name;		/* static string of OpenSSL */
+	long count;
+} HS_NAMED;
+
+typedef struct {
+	long count;
+	long bytes;
+} HS_BYTES;
+
+typedef struct {
+#ifdef PTHREADS
+	pthread_mutex_t lock;
+#endif
+	int enabled;
+	long handshakes;
+	long resumed_cache;
+	long resumed_ticket;
+	long alerts[2][256];		/* received, sent */
+	HS_NAMED version[HS_NAMES];
+	HS_NAMED cipher[HS_NAMES];
+	long other_version;
+	long other_cipher;
+	HS_HIST phase[HS_PHASES];
+	HS_BYTES cert[2][2];		/* received, sent; plain, compressed */
+} HS_STATS;
+
+/* handshake in progress */
+typedef struct {
+	double start;
+	double mark[2];			/* end of hello, end of key exchange */
+	int done;
+	int ticket;
+} HS_SSL;
+
+static int hs_ctx_idx = -1;
+static int hs_ssl_idx = -1;
+
+static void hs_lock(HS_STATS *st)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&st->lock);
+#else
+	(void)st;
+#endif
+}
+
+static void hs_unlock(HS_STATS *st)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&st->lock);
+#else
+	(void)st;
+#endif
+}
+
+/* monotonic microseconds */
+static double hs_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER f, c;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (double)c.QuadPart * 1e6 / (double)f.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#endif
+}
+
+static void hs_ctx_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	HS_STATS *st = (HS_STATS *)ptr;
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (st == NULL)
+		return;
+#ifdef PTHREADS
+	pthread_mutex_destroy(&st->lock);
+#endif
+	free(st);
+}
+
+static void hs_ssl_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	free(ptr);
+}
+
+static HS_STATS *hs_stats(const SSL_CTX *ctx)
+{
+	if (hs_ctx_idx < 0 || ctx == NULL)
+		return NULL;
+	return (HS_STATS *)SSL_CTX_get_ex_data(ctx, hs_ctx_idx);
+}
+
+static void hs_hist_add(HS_HIST *h, double us)
+{
+	int i;
+	if (us < 0)
+		us = 0;
+	for (i = 0; i < HS_BUCKETS - 1 && us > hs_bucket_bound[i]; i++)
+		;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += us;
+}
+
+static void hs_named_add(HS_NAMED *n, long *other, const char *name)
+{
+	int i;
+	if (name == NULL)
+		return;
+	for (i = 0; i < HS_NAMES && n[i].name; i++) {
+		if (n[i].name == name || strcmp(n[i].name, name) == 0) {
+			n[i].count++;
+			return;
+		}
+	}
+	if (i < HS_NAMES) {
+		n[i].name = name;
+		n[i].count = 1;
+	} else
+		(*other)++;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/* phase ended when state is left, 1 for hello, 2 for key exchange */
+static int hs_phase_end(const SSL *s)
+{
+	OSSL_HANDSHAKE_STATE st = SSL_get_state(s);
+#ifdef TLS1_3_VERSION
+	if (SSL_version(s) == TLS1_3_VERSION) {
+		if (st == TLS_ST_SW_SRVR_HELLO || st == TLS_ST_CR_SRVR_HELLO)
+			return 1;
+		if (st == TLS_ST_SW_FINISHED || st == TLS_ST_CR_FINISHED)
+			return 2;
+		return 0;
+	}
+#endif
+	switch (st) {
+	case TLS_ST_SW_SRVR_DONE:
+	case TLS_ST_CR_SRVR_DONE:
+		return 1;
+	/* resumed handshake has no ServerHelloDone, server send CCS first */
+	case TLS_ST_SR_CHANGE:
+	case TLS_ST_CW_CHANGE:
+	case TLS_ST_SW_CHANGE:
+	case TLS_ST_CR_CHANGE:
+		return 2;
+	default:
+		return 0;
+	}
+}
+#endif
+
+/* end phases before p not seen yet at same time */
+static void hs_mark(HS_SSL *h, int p, double now)
+{
+	int i;
+	for (i = 0; i < p; i++)
+		if (h->mark[i] == 0)
+			h->mark[i] = now;
+}
+
+static void hs_done(const SSL *s, HS_STATS *st, HS_SSL *h)
+{
+	double now = hs_now();
+	double us[HS_PHASES];
+	const SSL_CIPHER *c = SSL_get_current_cipher(s);
+	int reused = SSL_session_reused((SSL *)s);
+	int i;
+
+	hs_mark(h, 2, now);
+	us[0] = h->mark[0] - h->start;
+	us[1] = h->mark[1] - h->mark[0];
+	us[2] = now - h->mark[1];
+	us[3] = now - h->start;
+	if (reused && !SSL_is_server((SSL *)s)) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		h->ticket = SSL_SESSION_has_ticket(SSL_get0_session(s));
+#else
+		h->ticket = SSL_get_session(s)->tlsext_tick != NULL;
+#endif
+	}
+
+	hs_lock(st);
+	st->handshakes++;
+	if (reused) {
+		if (h->ticket)
+			st->resumed_ticket++;
+		else
+			st->resumed_cache++;
+	}
+	hs_named_add(st->version, &st->other_version, SSL_get_version(s));
+	hs_named_add(st->cipher, &st->other_cipher, c ? SSL_CIPHER_get_name(c) : NULL);
+	for (i = 0; i < HS_PHASES; i++)
+		hs_hist_add(&st->phase[i], us[i]);
+	hs_unlock(st);
+	h->done = 1;
+}
+
+static void hs_info_cb(const SSL *s, int where, int ret)
+{
+	HS_STATS *st = hs_stats(SSL_get_SSL_CTX(s));
+	HS_SSL *h;
+
+	if (st == NULL || !st->enabled)
+		return;
+	if (where & SSL_CB_ALERT) {
+		hs_lock(st);
+		st->alerts[(where & SSL_CB_WRITE) ? 1 : 0][ret & 0xff]++;
+		hs_unlock(st);
+		return;
+	}
+
+	h = (HS_SSL *)SSL_get_ex_data(s, hs_ssl_idx);
+	if (where & SSL_CB_HANDSHAKE_START) {
+		if (h == NULL) {
+			h = (HS_SSL *)calloc(1, sizeof(HS_SSL));
+			if (h == NULL || !SSL_set_ex_data((SSL *)s, hs_ssl_idx, h)) {
+				free(h);
+				return;
+			}
+		} else if (!h->done)
+			return;		/* continue after early data */
+#ifdef TLS1_3_VERSION
+		else if (SSL_version(s) == TLS1_3_VERSION)
+			return;		/* post handshake message, tickets or key update */
+#endif
+		memset(h, 0, sizeof(HS_SSL));
+		h->start = hs_now();
+		return;
+	}
+	if (h == NULL || h->done)
+		return;
+	if (where & SSL_CB_HANDSHAKE_DONE)
+		hs_done(s, st, h);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	else if (where & SSL_CB_LOOP) {
+		int p = hs_phase_end(s);
+		if (p)
+			hs_mark(h, p, hs_now());
+	}
+#endif
+}
+
+/* size of certificate messages, to see what certificate compression saves */
+static void hs_msg_cb(int write_p, int version, int content_type, const void *buf,
+                      size_t len, SSL *s, void *arg)
+{
+	HS_STATS *st;
+	int type;
+	(void)version; (void)arg;
+	if (content_type != SSL3_RT_HANDSHAKE || len < 1)
+		return;
+	type = ((const unsigned char *)buf)[0];
+	if (type != SSL3_MT_CERTIFICATE && type != SSL3_MT_COMPRESSED_CERTIFICATE)
+		return;
+	st = hs_stats(SSL_get_SSL_CTX(s));
+	if (st == NULL || !st->enabled)
+		return;
+	hs_lock(st);
+	st->cert[write_p ? 1 : 0][type == SSL3_MT_COMPRESSED_CERTIFICATE].count++;
+	st->cert[write_p ? 1 : 0][type == SSL3_MT_COMPRESSED_CERTIFICATE].bytes += (long)len;
+	hs_unlock(st);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/* only to see ticket is used by server, decisions are what OpenSSL makes */
+static SSL_TICKET_RETURN hs_ticket_cb(SSL *s, SSL_SESSION *ss, const unsigned char *keyname,
+                                      size_t keyname_len, SSL_TICKET_STATUS status, void *arg)
+{
+	HS_SSL *h = (HS_SSL *)SSL_get_ex_data(s, hs_ssl_idx);
+	(void)ss; (void)keyname; (void)keyname_len; (void)arg;
+	switch (status) {
+	case SSL_TICKET_SUCCESS:
+		if (h)
+			h->ticket = 1;
+		return SSL_TICKET_RETURN_USE;
+	case SSL_TICKET_SUCCESS_RENEW:
+		if (h)
+			h->ticket = 1;
+		return SSL_TICKET_RETURN_USE_RENEW;
+	case SSL_TICKET_NO_DECRYPT:
+	case SSL_TICKET_EMPTY:
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	case SSL_TICKET_NONE:
+		return SSL_TICKET_RETURN_IGNORE;
+	default:
+		return SSL_TICKET_RETURN_ABORT;
+	}
+}
+#endif
+
+static HS_STATS *hs_attach(SSL_CTX *ctx)
+{
+	HS_STATS *st;
+	if (hs_ctx_idx < 0) {
+		hs_ctx_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, hs_ctx_free);
+		hs_ssl_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, hs_ssl_free);
+		if (hs_ctx_idx < 0 || hs_ssl_idx < 0) {
+			hs_ctx_idx = -1;
+			return NULL;
+		}
+	}
+	st = hs_stats(ctx);
+	if (st == NULL) {
+		st = (HS_STATS *)calloc(1, sizeof(HS_STATS));
+		if (st == NULL)
+			return NULL;
+#ifdef PTHREADS
+		pthread_mutex_init(&st->lock, NULL);
+#endif
+		if (!SSL_CTX_set_ex_data(ctx, hs_ctx_idx, st)) {
+			hs_ctx_free(NULL, st, NULL, 0, 0, NULL);
+			return NULL;
+		}
+	}
+	return st;
+}
+
+static void hs_push_named(lua_State *L, const HS_NAMED *n, long other)
+{
+	int i;
+	lua_newtable(L);
+	for (i = 0; i < HS_NAMES && n[i].name; i++) {
+		lua_pushinteger(L, n[i].count);
+		lua_setfield(L, -2, n[i].name);
+	}
+	if (other) {
+		lua_pushinteger(L, other);
+		lua_setfield(L, -2, "other");
+	}
+}
+
+static void hs_push_alerts(lua_State *L, const long *alerts)
+{
+	int i;
+	lua_newtable(L);
+	for (i = 0; i < 256; i++) {
+		if (alerts[i]) {
+			lua_pushinteger(L, alerts[i]);
+			lua_setfield(L, -2, SSL_alert_desc_string_long(i));
+		}
+	}
+}
+
+static void hs_push_cert(lua_State *L, const HS_BYTES *b)
+{
+	lua_newtable(L);
+	lua_pushinteger(L, b[0].count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, b[0].bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, b[1].count);
+	lua_setfield(L, -2, "compressed");
+	lua_pushinteger(L, b[1].bytes);
+	lua_setfield(L, -2, "compressed_bytes");
+}
+
+static void hs_push_hist(lua_State *L, const HS_HIST *h)
+{
+	int i;
+	lua_newtable(L);
+	lua_pushinteger(L, h->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->sum);
+	lua_setfield(L, -2, "sum");
+	lua_newtable(L);
+	for (i = 0; i < HS_BUCKETS; i++) {
+		lua_pushinteger(L, h->bucket[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "buckets");
+}
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:telemetry([boolean enable]) -> boolean {{{1
+	collect handshake counters and phase timings of ssl made by ctx, read
+	them with ssl_ctx:handshake_stats(). info and message callback of ctx
+	are taken, on server ticket callback too. ssl moved to other ctx by sni router
+	are counted on that ctx
+*/
+LUA_FUNCTION(openssl_ssl_ctx_telemetry)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	HS_STATS *st = hs_stats(ctx);
+	if (!lua_isnoneornil(L, 2)) {
+		int enable = auxiliar_checkboolean(L, 2);
+		if (enable && st == NULL) {
+			st = hs_attach(ctx);
+			if (st == NULL)
+				luaL_error(L, "out of memory");
+		}
+		if (st) {
+			st->enabled = enable;
+			SSL_CTX_set_info_callback(ctx, enable ? hs_info_cb : NULL);
+			SSL_CTX_set_msg_callback(ctx, enable ? hs_msg_cb : NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+			SSL_CTX_set_session_ticket_cb(ctx, NULL, enable ? hs_ticket_cb : NULL, NULL);
+#endif
+		}
+	}
+	lua_pushboolean(L, st && st->enabled);
+	return 1;
+}
+/* }}} */
+
+/*  ssl_ctx:handshake_stats([boolean reset=false]) -> table {{{1
+	snapshot of telemetry, nil, "not enabled" when telemetry never enabled
+	{
+	  handshakes, full, resumed, resumed_cache, resumed_ticket,
+	  version = {[name] = count}, cipher = {[name] = count},
+	  alert = {sent = {[description] = count}, received = {...}},
+	  bounds = {100, 250, ...}, upper bound of buckets in microseconds
+	  phase = {hello, key_exchange, finished, total}, each is
+	    {count, sum in microseconds, buckets = {count, ...}}
+	  certificate = {sent = {...}, received = {...}}, Certificate messages
+	    {count, bytes, compressed, compressed_bytes}, compressed is
+	    CompressedCertificate of ssl_ctx:cert_compression
+	}
+*/
+LUA_FUNCTION(openssl_ssl_ctx_handshake_stats)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	int reset = lua_isnoneornil(L, 2) ? 0 : auxiliar_checkboolean(L, 2);
+	HS_STATS *st = hs_stats(ctx);
+	HS_STATS *copy;
+	int i;
+
+	if (st == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "not enabled");
+		return 2;
+	}
+	copy = (HS_STATS *)malloc(sizeof(HS_STATS));
+	if (copy == NULL)
+		luaL_error(L, "out of memory");
+	hs_lock(st);
+	memcpy(copy, st, sizeof(HS_STATS));
+	if (reset) {
+		st->handshakes = st->resumed_cache = st->resumed_ticket = 0;
+		st->other_version = st->other_cipher = 0;
+		memset(st->alerts, 0, sizeof(st->alerts));
+		memset(st->version, 0, sizeof(st->version));
+		memset(st->cipher, 0, sizeof(st->cipher));
+		memset(st->phase, 0, sizeof(st->phase));
+		memset(st->cert, 0, sizeof(st->cert));
+	}
+	hs_unlock(st);
+
+	lua_newtable(L);
+	lua_pushinteger(L, copy->handshakes);
+	lua_setfield(L, -2, "handshakes");
+	lua_pushinteger(L, copy->handshakes - copy->resumed_cache - copy->resumed_ticket);
+	lua_setfield(L, -2, "full");
+	lua_pushinteger(L, copy->resumed_cache + copy->resumed_ticket);
+	lua_setfield(L, -2, "resumed");
+	lua_pushinteger(L, copy->resumed_cache);
+	lua_setfield(L, -2, "resumed_cache");
+	lua_pushinteger(L, copy->resumed_ticket);
+	lua_setfield(L, -2, "resumed_ticket");
+
+	hs_push_named(L, copy->version, copy->other_version);
+	lua_setfield(L, -2, "version");
+	hs_push_named(L, copy->cipher, copy->other_cipher);
+	lua_setfield(L, -2, "cipher");
+
+	lua_newtable(L);
+	hs_push_alerts(L, copy->alerts[1]);
+	lua_setfield(L, -2, "sent");
+	hs_push_alerts(L, copy->alerts[0]);
+	lua_setfield(L, -2, "received");
+	lua_setfield(L, -2, "alert");
+
+	lua_newtable(L);
+	for (i = 0; i < HS_BUCKETS - 1; i++) {
+		lua_pushnumber(L, hs_bucket_bound[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "bounds");
+
+	lua_newtable(L);
+	for (i = 0; i < HS_PHASES; i++) {
+		hs_push_hist(L, &copy->phase[i]);
+		lua_setfield(L, -2, hs_phase_name[i]);
+	}
+	lua_setfield(L, -2, "phase");
+
+	lua_newtable(L);
+	hs_push_cert(L, copy->cert[1]);
+	lua_setfield(L, -2, "sent");
+	hs_push_cert(L, copy->cert[0]);
+	lua_setfield(L, -2, "received");
+	lua_setfield(L, -2, "certificate");
+	free(copy);
+	return 1;
+}
+/* }}} */
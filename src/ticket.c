@@ -0,0 +1,435 @@
+/*=========================================================================*\
+* ssl session ticket keys
+* lua-openssl toolkit
+*
+* all workers and hosts load same keys, a ticket issued by one is accepted
+* by others. first key encrypts new tickets, others only decrypt, ticket of
+* an old key is renewed with first key. keys set is swapped as a whole, a
+* handshake in progress keeps using the set it got.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+#include <openssl/hmac.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
+
+/*
+ * a key is 48 bytes:  name[16] hmac[16] aes[16], AES-128-CBC, HMAC-SHA256
+ *       or 80 bytes:  name[16] hmac[32] aes[32], AES-256-CBC, HMAC-SHA256
+ */
+#define TICKET_NAME		16
+#define TICKET_KEY48		48
+#define TICKET_KEY80		80
+
+typedef struct {
+	unsigned char name[TICKET_NAME];
+	unsigned char hmac[32];
+	unsigned char aes[32];
+	int size;			/* 16 or 32 */
+} TICKET_KEY;
+
+typedef struct {
+	int refs;
+	int count;
+	TICKET_KEY keys[1];		/* keys[0] encrypts */
+} TICKET_KEYS;
+
+struct ticket_ctx_st {
+	int refs;
+#ifdef PTHREADS
+	pthread_mutex_t lock;
+#endif
+	TICKET_KEYS *keys;
+	char *path;			/* watched file */
+	int keylen;
+	int interval;			/* seconds between stat of path */
+	time_t checked;
+	time_t mtime;
+	off_t fsize;
+};
+
+static void ticket_lock(TICKET_CTX *t)
+{
+#ifdef PTHREADS
+	pthread_mutex_lock(&t->lock);
+#else
+	(void)t;
+#endif
+}
+
+static void ticket_unlock(TICKET_CTX *t)
+{
+#ifdef PTHREADS
+	pthread_mutex_unlock(&t->lock);
+#else
+	(void)t;
+#endif
+}
+
+/* keys released when t is locked */
+static void ticket_keys_release(TICKET_KEYS *keys)
+{
+	if (keys && --keys->refs == 0) {
+		OPENSSL_cleanse(keys, sizeof(TICKET_KEYS) + (keys->count - 1) * sizeof(TICKET_KEY));
+		free(keys);
+	}
+}
+
+/* zeroed set of count keys */
+static TICKET_KEYS *ticket_keys_new(int count)
+{
+	TICKET_KEYS *keys = (TICKET_KEYS *)malloc(sizeof(TICKET_KEYS) + (count - 1) * sizeof(TICKET_KEY));
+	if (keys) {
+		memset(keys, 0, sizeof(TICKET_KEYS) + (count - 1) * sizeof(TICKET_KEY));
+		keys->refs = 1;
+		keys->count = count;
+	}
+	return keys;
+}
+
+static int ticket_key_set(TICKET_KEY *k, const unsigned char *data, size_t len)
+{
+	if (len != TICKET_KEY48 && len != TICKET_KEY80)
+		return 0;
+	k->size = len == TICKET_KEY48 ? 16 : 32;
+	memcpy(k->name, data, TICKET_NAME);
+	memcpy(k->hmac, data + TICKET_NAME, k->size);
+	memcpy(k->aes, data + TICKET_NAME + k->size, k->size);
+	return 1;
+}
+
+/* swap keys set of t, old set freed when no handshake use it */
+static void ticket_ctx_swap(TICKET_CTX *t, TICKET_KEYS *keys)
+{
+	TICKET_KEYS *old;
+	ticket_lock(t);
+	old = t->keys;
+	t->keys = keys;
+	ticket_keys_release(old);
+	ticket_unlock(t);
+}
+
+/* file is keys of keylen bytes, current first */
+static TICKET_KEYS *ticket_keys_load(const char *path, int keylen, const char **err)
+{
+	TICKET_KEYS *keys = NULL;
+	unsigned char *buf = NULL;
+	struct stat st;
+	size_t len = 0;
+	int i;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		*err = strerror(errno);
+		return NULL;
+	}
+	if (fstat(fileno(fp), &st) != 0) {
+		*err = strerror(errno);
+		fclose(fp);
+		return NULL;
+	}
+	if (st.st_size == 0 || st.st_size % keylen != 0 || st.st_size / keylen > INT_MAX) {
+		*err = "file size is not multiple of key length";
+		fclose(fp);
+		return NULL;
+	}
+	len = (size_t)st.st_size;
+	buf = (unsigned char *)OPENSSL_malloc(len);
+	if (buf == NULL) {
+		*err = "out of memory";
+		fclose(fp);
+		return NULL;
+	}
+	/* file changed size under us, maybe in the middle of write */
+	if (fread(buf, 1, len, fp) != len || fgetc(fp) != EOF) {
+		*err = "file changed while reading";
+		fclose(fp);
+		goto done;
+	}
+	fclose(fp);
+	keys = ticket_keys_new((int)(len / keylen));
+	if (keys == NULL) {
+		*err = "out of memory";
+		goto done;
+	}
+	for (i = 0; i < keys->count; i++)
+		ticket_key_set(&keys->keys[i], buf + i * keylen, keylen);
+done:
+	OPENSSL_cleanse(buf, len);
+	OPENSSL_free(buf);
+	return keys;
+}
+
+/* reload watched file when it changed, at most once every interval */
+static void ticket_ctx_watch(TICKET_CTX *t)
+{
+	struct stat st;
+	time_t now = time(NULL);
+	TICKET_KEYS *keys;
+	const char *err;
+
+	ticket_lock(t);
+	if (t->path && now - t->checked >= t->interval) {
+		t->checked = now;
+		if (stat(t->path, &st) == 0 && (st.st_mtime != t->mtime || st.st_size != t->fsize)) {
+			/* keep old keys when new file is broken, maybe in the middle of
+			   write, and look again next interval */
+			keys = ticket_keys_load(t->path, t->keylen, &err);
+			if (keys) {
+				ticket_keys_release(t->keys);
+				t->keys = keys;
+				t->mtime = st.st_mtime;
+				t->fsize = st.st_size;
+			}
+		}
+	}
+	ticket_unlock(t);
+}
+
+static TICKET_KEYS *ticket_ctx_get(TICKET_CTX *t)
+{
+	TICKET_KEYS *keys;
+	ticket_ctx_watch(t);
+	ticket_lock(t);
+	keys = t->keys;
+	if (keys)
+		keys->refs++;
+	ticket_unlock(t);
+	return keys;
+}
+
+static void ticket_ctx_put(TICKET_CTX *t, TICKET_KEYS *keys)
+{
+	ticket_lock(t);
+	ticket_keys_release(keys);
+	ticket_unlock(t);
+}
+
+static TICKET_CTX *ticket_ctx_new(void)
+{
+	TICKET_CTX *t = (TICKET_CTX *)malloc(sizeof(TICKET_CTX));
+	if (t) {
+		memset(t, 0, sizeof(TICKET_CTX));
+		t->refs = 1;
+#ifdef PTHREADS
+		pthread_mutex_init(&t->lock, NULL);
+#endif
+	}
+	return t;
+}
+
+void openssl_ticket_ctx_free(TICKET_CTX *t)
+{
+	int refs;
+	if (t == NULL)
+		return;
+	ticket_lock(t);
+	refs = --t->refs;
+	ticket_unlock(t);
+	if (refs > 0)
+		return;
+	ticket_keys_release(t->keys);
+	free(t->path);
+#ifdef PTHREADS
+	pthread_mutex_destroy(&t->lock);
+#endif
+	free(t);
+}
+
+/****************************** SSL_CTX callback ******************************/
+static int ticket_ctx_idx = -1;
+
+static void ticket_ctx_ex_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	openssl_ticket_ctx_free((TICKET_CTX *)ptr);
+}
+
+TICKET_CTX *openssl_ssl_ctx_ticket_ctx(SSL_CTX *ctx)
+{
+	if (ticket_ctx_idx < 0 || ctx == NULL)
+		return NULL;
+	return SSL_CTX_get_ex_data(ctx, ticket_ctx_idx);
+}
+
+static int ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	TICKET_CTX *t = openssl_ssl_ctx_ticket_ctx(openssl_ssl_session_ctx(s));
+	TICKET_KEYS *keys = t ? ticket_ctx_get(t) : NULL;
+	TICKET_KEY *k = NULL;
+	int ret = 0;
+	int i;
+
+	if (keys == NULL)
+		return enc ? -1 : 0;
+	if (enc) {
+		k = &keys->keys[0];
+		if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0) {
+			ret = -1;
+			goto done;
+		}
+		memcpy(name, k->name, TICKET_NAME);
+		EVP_EncryptInit_ex(ectx, k->size == 16 ? EVP_aes_128_cbc() : EVP_aes_256_cbc(), NULL, k->aes, iv);
+		ret = 1;
+	} else {
+		for (i = 0; i < keys->count && k == NULL; i++)
+			if (memcmp(name, keys->keys[i].name, TICKET_NAME) == 0)
+				k = &keys->keys[i];
+		/* unknown key, full handshake */
+		if (k == NULL)
+			goto done;
+		EVP_DecryptInit_ex(ectx, k->size == 16 ? EVP_aes_128_cbc() : EVP_aes_256_cbc(), NULL, k->aes, iv);
+		/* decrypted with old key, issue new ticket */
+		ret = k == &keys->keys[0] ? 1 : 2;
+	}
+	HMAC_Init_ex(hctx, k->hmac, k->size, EVP_sha256(), NULL);
+done:
+	ticket_ctx_put(t, keys);
+	return ret;
+}
+
+static TICKET_CTX *ticket_ctx_attach(SSL_CTX *ctx, const char **err)
+{
+	TICKET_CTX *t = openssl_ssl_ctx_ticket_ctx(ctx);
+	if (t)
+		return t;
+	if (ticket_ctx_idx < 0) {
+		ticket_ctx_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, ticket_ctx_ex_free);
+		if (ticket_ctx_idx < 0) {
+			*err = "SSL_CTX_get_ex_new_index fail";
+			return NULL;
+		}
+	}
+	t = ticket_ctx_new();
+	if (t == NULL) {
+		*err = "out of memory";
+		return NULL;
+	}
+	SSL_CTX_set_ex_data(ctx, ticket_ctx_idx, t);
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_cb);
+	return t;
+}
+
+/* use keys of t in ctx, ctx keep a reference of t */
+int openssl_ssl_ctx_set_ticket_ctx(SSL_CTX *ctx, TICKET_CTX *t)
+{
+	const char *err;
+	TICKET_CTX *old;
+	if (ticket_ctx_attach(ctx, &err) == NULL)
+		return 0;
+	old = openssl_ssl_ctx_ticket_ctx(ctx);
+	if (old == t)
+		return 1;
+	ticket_lock(t);
+	t->refs++;
+	ticket_unlock(t);
+	SSL_CTX_set_ex_data(ctx, ticket_ctx_idx, t);
+	openssl_ticket_ctx_free(old);
+	return 1;
+}
+
+/****************************** lua api ******************************/
+/*  ssl_ctx:ticket_keys(table keys) -> boolean {{{1
+	ssl_ctx:ticket_keys(string path [, number keylen=80 [, number interval=60]]) -> boolean
+	ssl_ctx:ticket_keys() -> table
+	every key is 48 or 80 bytes string, keys[1] encrypts new tickets, others
+	only decrypt and the ticket is renewed. path is a file of keys, checked
+	every interval seconds and reloaded when changed. with no argument,
+	return names of keys in use
+*/
+LUA_FUNCTION(openssl_ssl_ctx_ticket_keys)
+{
+	SSL_CTX *ctx = CHECK_OBJECT(1, SSL_CTX, "openssl.ssl_ctx");
+	TICKET_CTX *t;
+	TICKET_KEYS *keys;
+	const char *err = NULL;
+	int i;
+
+	if (lua_isnoneornil(L, 2)) {
+		t = openssl_ssl_ctx_ticket_ctx(ctx);
+		keys = t ? ticket_ctx_get(t) : NULL;
+		if (keys == NULL) {
+			lua_pushnil(L);
+			return 1;
+		}
+		lua_newtable(L);
+		for (i = 0; i < keys->count; i++) {
+			lua_pushlstring(L, (const char *)keys->keys[i].name, TICKET_NAME);
+			lua_rawseti(L, -2, i + 1);
+		}
+		ticket_ctx_put(t, keys);
+		return 1;
+	}
+
+	if (lua_istable(L, 2)) {
+		int n = lua_objlen(L, 2);
+		luaL_argcheck(L, n > 0, 2, "empty keys");
+		keys = ticket_keys_new(n);
+		if (keys == NULL)
+			luaL_error(L, "out of memory");
+		for (i = 0; i < n; i++) {
+			size_t len;
+			const char *data;
+			lua_rawgeti(L, 2, i + 1);
+			data = lua_tolstring(L, -1, &len);
+			if (data == NULL || !ticket_key_set(&keys->keys[i], (const unsigned char *)data, len)) {
+				ticket_keys_release(keys);
+				luaL_argerror(L, 2, "key must be 48 or 80 bytes string");
+			}
+			lua_pop(L, 1);
+		}
+		t = ticket_ctx_attach(ctx, &err);
+		if (t == NULL) {
+			ticket_keys_release(keys);
+			luaL_error(L, "%s", err);
+		}
+		ticket_lock(t);
+		free(t->path);
+		t->path = NULL;
+		ticket_unlock(t);
+		ticket_ctx_swap(t, keys);
+	} else {
+		const char *path = luaL_checkstring(L, 2);
+		int keylen = luaL_optint(L, 3, TICKET_KEY80);
+		int interval = luaL_optint(L, 4, 60);
+		struct stat st;
+		char *dup;
+
+		luaL_argcheck(L, keylen == TICKET_KEY48 || keylen == TICKET_KEY80, 3, "must be 48 or 80");
+		if (stat(path, &st) != 0 || (keys = ticket_keys_load(path, keylen, &err)) == NULL) {
+			lua_pushnil(L);
+			lua_pushstring(L, err ? err : strerror(errno));
+			return 2;
+		}
+		t = ticket_ctx_attach(ctx, &err);
+		dup = t ? (char *)malloc(strlen(path) + 1) : NULL;
+		if (dup == NULL) {
+			ticket_keys_release(keys);
+			luaL_error(L, "%s", t ? "out of memory" : err);
+		}
+		strcpy(dup, path);
+		ticket_lock(t);
+		free(t->path);
+		t->path = dup;
+		t->keylen = keylen;
+		t->interval = interval;
+		t->checked = time(NULL);
+		t->mtime = st.st_mtime;
+		t->fsize = st.st_size;
+		ticket_unlock(t);
+		ticket_ctx_swap(t, keys);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+/* }}} */
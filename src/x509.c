@@ -22,6 +22,9 @@
 \*=========================================================================*/
 #include "openssl.h"
 #include "sk.h"
+#ifdef PTHREADS
+#include <pthread.h>
+#endif
 
 void add_assoc_x509_extension(lua_State*L, const char* key, STACK_OF(X509_EXTENSION)* exts, BIO* bio)
 {
@@ -362,14 +365,16 @@ LUA_FUNCTION(openssl_x509_check)
 	lua_pushboolean(L,X509_check_private_key(cert, key));
 	return 1;
     }else{
-	STACK_OF(X509)* cert_stack = lua_isnoneornil(L,2) ? 
+	X509_STORE * store = auxiliar_isclass(L, "openssl.x509_store", 2) ?
+		CHECK_OBJECT(2,X509_STORE,"openssl.x509_store") : NULL;
+	STACK_OF(X509)* cert_stack = lua_isnoneornil(L,2) || store ?
 		NULL : CHECK_OBJECT(2,STACK_OF(X509),"openssl.stack_of_x509");
 	STACK_OF(X509)* untrustedchain = lua_isnoneornil(L,3) ? 
 		NULL : CHECK_OBJECT(3,STACK_OF(X509),"openssl.stack_of_x509");
 	const char* spurpose = luaL_optstring(L,4, NULL);
 	int purpose = spurpose==NULL?0:get_cert_purpose(spurpose);
 
-	X509_STORE * cainfo = setup_verify(cert_stack);
+	X509_STORE * cainfo = store ? store : setup_verify(cert_stack);
 	int ret = check_cert(cainfo, cert, untrustedchain, purpose);
 	if (ret != 0 && ret != 1) {
 		lua_pushnil(L);
@@ -379,12 +384,212 @@ LUA_FUNCTION(openssl_x509_check)
 		lua_pushboolean(L,ret);
 		ret = 1;
 	}
-	X509_STORE_free(cainfo);
+	if (cainfo != store)
+		X509_STORE_free(cainfo);
 	return ret;
     }
 }
 /* }}} */
 
+/* {{{ batch verify */
+typedef struct {
+    X509_STORE *store;
+    X509 **certs;
+    STACK_OF(X509) **chains;
+    int *status;
+    int *depth;
+    int num;
+    int purpose;
+    int next;
+#ifdef PTHREADS
+    pthread_mutex_t lock;
+#endif
+} VERIFY_BATCH;
+
+static int verify_batch_next(VERIFY_BATCH *batch)
+{
+    int i;
+#ifdef PTHREADS
+    pthread_mutex_lock(&batch->lock);
+#endif
+    i = batch->next < batch->num ? batch->next++ : -1;
+#ifdef PTHREADS
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    return i;
+}
+
+/* every worker owns one X509_STORE_CTX, reused for each certificate it picks up */
+static void *verify_batch_worker(void *arg)
+{
+    VERIFY_BATCH *batch = (VERIFY_BATCH*)arg;
+    X509_STORE_CTX *csc = X509_STORE_CTX_new();
+    int i;
+
+    while ((i = verify_batch_next(batch)) >= 0) {
+        if (csc == NULL || !X509_STORE_CTX_init(csc, batch->store, batch->certs[i], batch->chains[i])) {
+            batch->status[i] = X509_V_ERR_OUT_OF_MEM;
+            batch->depth[i] = 0;
+            continue;
+        }
+        if (batch->purpose > 0)
+            X509_STORE_CTX_set_purpose(csc, batch->purpose);
+        if (X509_verify_cert(csc) > 0) {
+            batch->status[i] = X509_V_OK;
+            batch->depth[i] = -1;
+        } else {
+            batch->status[i] = X509_STORE_CTX_get_error(csc);
+            batch->depth[i] = X509_STORE_CTX_get_error_depth(csc);
+            if (batch->status[i] == X509_V_OK)
+                batch->status[i] = X509_V_ERR_UNSPECIFIED;
+        }
+        X509_STORE_CTX_cleanup(csc);
+    }
+    if (csc)
+        X509_STORE_CTX_free(csc);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    ERR_remove_thread_state(NULL);
+#endif
+    return NULL;
+}
+
+/* 1.0 caches extensions lazily without lock, fill the cache before going parallel */
+static void verify_batch_warm(STACK_OF(X509) *sk)
+{
+    int i;
+    for (i = 0; sk && i < sk_X509_num(sk); i++)
+        X509_check_purpose(sk_X509_value(sk, i), -1, 0);
+}
+
+static int verify_batch_run(VERIFY_BATCH *batch, int threads)
+{
+#ifdef PTHREADS
+    pthread_t tids[64];
+    int i, n = 0;
+
+    if (threads > (int)(sizeof(tids)/sizeof(tids[0])))
+        threads = sizeof(tids)/sizeof(tids[0]);
+    if (threads > batch->num)
+        threads = batch->num;
+    /* worker always takes the lock, single thread path too */
+    pthread_mutex_init(&batch->lock, NULL);
+    if (threads <= 1) {
+        verify_batch_worker(batch);
+        pthread_mutex_destroy(&batch->lock);
+        return 1;
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tids[n], NULL, verify_batch_worker, batch) == 0)
+            n++;
+    }
+    /* failed to spawn any, leave the work to caller thread */
+    if (n == 0)
+        verify_batch_worker(batch);
+    for (i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&batch->lock);
+    return n;
+#else
+    (void)threads;
+    verify_batch_worker(batch);
+    return 1;
+#endif
+}
+
+/*  openssl.x509_verify_many(table certs, openssl.x509_store|openssl.stack_of_x509 ca,
+	[openssl.stack_of_x509|table untrusted=nil [, string purpose=nil [, number threads=4]]])
+	-> table status, table depth {{{1
+    verify every certificate of #1 against ca in a pool of native threads.
+    if #3 is a stack_of_x509, it is shared untrusted chain for all certificates,
+    if #3 is a table, #3[i] is the untrusted chain of #1[i].
+    status[i] is X509_V_OK or verify error code of #1[i], depth[i] is depth
+    of failure in chain, -1 when verify ok.
+*/
+LUA_FUNCTION(openssl_x509_verify_many)
+{
+    VERIFY_BATCH batch;
+    X509_STORE *cainfo = NULL;
+    STACK_OF(X509) *shared = NULL;
+    const char* spurpose;
+    int threads, i;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    batch.num = lua_objlen(L, 1);
+    if (auxiliar_isclass(L, "openssl.x509_store", 2))
+        batch.store = CHECK_OBJECT(2, X509_STORE, "openssl.x509_store");
+    else
+        batch.store = NULL;
+    if (batch.store == NULL)
+        luaL_checkudata(L, 2, "openssl.stack_of_x509");
+    if (auxiliar_isclass(L, "openssl.stack_of_x509", 3))
+        shared = CHECK_OBJECT(3, STACK_OF(X509), "openssl.stack_of_x509");
+    else if (!lua_isnoneornil(L, 3))
+        luaL_checktype(L, 3, LUA_TTABLE);
+    spurpose = luaL_optstring(L, 4, NULL);
+    batch.purpose = spurpose == NULL ? 0 : get_cert_purpose(spurpose);
+    threads = luaL_optint(L, 5, 4);
+    batch.next = 0;
+
+    /* arrays live in userdata, luaL_error below does not leak */
+    batch.certs = (X509**)lua_newuserdata(L, (batch.num + 1) *
+        (sizeof(X509*) + sizeof(STACK_OF(X509)*) + 2 * sizeof(int)));
+    batch.chains = (STACK_OF(X509)**)(batch.certs + batch.num + 1);
+    batch.status = (int*)(batch.chains + batch.num + 1);
+    batch.depth = batch.status + batch.num + 1;
+
+    for (i = 0; i < batch.num; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        batch.certs[i] = CHECK_OBJECT(-1, X509, "openssl.x509");
+        lua_pop(L, 1);
+        batch.chains[i] = shared;
+        if (shared == NULL && lua_istable(L, 3)) {
+            lua_rawgeti(L, 3, i + 1);
+            if (!lua_isnil(L, -1))
+                batch.chains[i] = CHECK_OBJECT(-1, STACK_OF(X509), "openssl.stack_of_x509");
+            lua_pop(L, 1);
+        }
+        X509_check_purpose(batch.certs[i], -1, 0);
+        if (batch.chains[i] != shared)
+            verify_batch_warm(batch.chains[i]);
+    }
+    verify_batch_warm(shared);
+
+    if (batch.store == NULL) {
+        STACK_OF(X509) *calist = CHECK_OBJECT(2, STACK_OF(X509), "openssl.stack_of_x509");
+        verify_batch_warm(calist);
+        batch.store = cainfo = setup_verify(calist);
+        if (cainfo == NULL)
+            luaL_error(L, "#2 setup verify store failed");
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    else {
+        STACK_OF(X509_OBJECT) *objs = batch.store->objs;
+        for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+            X509_OBJECT *obj = sk_X509_OBJECT_value(objs, i);
+            if (obj->type == X509_LU_X509)
+                X509_check_purpose(obj->data.x509, -1, 0);
+        }
+    }
+#endif
+
+    verify_batch_run(&batch, threads);
+    if (cainfo)
+        X509_STORE_free(cainfo);
+
+    lua_newtable(L);
+    for (i = 0; i < batch.num; i++) {
+        lua_pushinteger(L, batch.status[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_newtable(L);
+    for (i = 0; i < batch.num; i++) {
+        lua_pushinteger(L, batch.depth[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 2;
+}
+/* }}} */
+
 LUA_FUNCTION(openssl_x509_free)
 {
     X509 *cert = CHECK_OBJECT(1,X509,"openssl.x509");
@@ -403,7 +608,7 @@ LUA_FUNCTION(openssl_x509_public_key)
 {
     X509 *cert = CHECK_OBJECT(1,X509,"openssl.x509");
     EVP_PKEY *pkey = X509_get_pubkey(cert);
-    PUSH_OBJECT(pkey,"openssl.evp_pkey");
+    PUSH_OBJECT_REF(pkey,"openssl.evp_pkey",EVP_PKEY_free);
     return 1;
 }
 
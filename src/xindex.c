@@ -0,0 +1,667 @@
+/*=========================================================================*\
+* x509 index routines
+* lua-openssl toolkit
+*
+* In memory certificate index, hash tables on subject name, issuer name,
+* subjectKeyIdentifier, authorityKeyIdentifier, serial and SHA-256
+* fingerprint.
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <openssl/ssl.h>
+
+enum {
+	XINDEX_SUBJECT,
+	XINDEX_ISSUER,
+	XINDEX_SKID,
+	XINDEX_AKID,
+	XINDEX_SERIAL,
+	XINDEX_FINGERPRINT,
+	XINDEX_MAX
+};
+
+typedef struct xindex_node_st {
+	struct xindex_node_st *next;
+	unsigned long hash;
+	unsigned char *key;		/* NULL for name tables, compared by X509_NAME_cmp */
+	int keylen;
+	X509 *cert;
+} XINDEX_NODE;
+
+typedef struct {
+	XINDEX_NODE **buckets;
+	unsigned int size;		/* always power of 2 */
+	unsigned int num;
+} XINDEX_TABLE;
+
+struct x509_index_st {
+	int references;
+	int num;
+	XINDEX_TABLE tabs[XINDEX_MAX];
+};
+
+static unsigned long xindex_hash_bytes(const unsigned char *p, int len)
+{
+	/* FNV-1a */
+	unsigned long h = 2166136261UL;
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+static int xindex_key_copy(const unsigned char *p, int len, unsigned char **key, int *keylen, unsigned long *hash)
+{
+	if (p == NULL || len <= 0)
+		return 0;
+	*key = malloc(len);
+	if (*key == NULL)
+		return 0;
+	memcpy(*key, p, len);
+	*keylen = len;
+	*hash = xindex_hash_bytes(p, len);
+	return 1;
+}
+
+static int xindex_key_bn(BIGNUM *bn, unsigned char **key, int *keylen, unsigned long *hash)
+{
+	int ret = 0;
+	if (bn) {
+		unsigned char *p = malloc(BN_num_bytes(bn) + 1);
+		int len = BN_bn2bin(bn, p);
+		/* serial zero has no magnitude bytes */
+		if (len == 0)
+			p[len++] = 0;
+		ret = xindex_key_copy(p, len, key, keylen, hash);
+		free(p);
+	}
+	return ret;
+}
+
+static const ASN1_OCTET_STRING *xindex_skid(X509 *x)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return X509_get0_subject_key_id(x);
+#else
+	/* fill x->skid and x->akid */
+	X509_check_purpose(x, -1, -1);
+	return x->skid;
+#endif
+}
+
+static const ASN1_OCTET_STRING *xindex_akid(X509 *x)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return X509_get0_authority_key_id(x);
+#else
+	X509_check_purpose(x, -1, -1);
+	return x->akid ? x->akid->keyid : NULL;
+#endif
+}
+
+/* key of certificate in table kind, return 0 if certificate not has it */
+static int xindex_key(X509 *x, int kind, unsigned char **key, int *keylen, unsigned long *hash)
+{
+	*key = NULL;
+	*keylen = 0;
+	switch (kind) {
+	case XINDEX_SUBJECT:
+		*hash = X509_NAME_hash(X509_get_subject_name(x));
+		return 1;
+	case XINDEX_ISSUER:
+		*hash = X509_NAME_hash(X509_get_issuer_name(x));
+		return 1;
+	case XINDEX_SKID:
+	case XINDEX_AKID:
+	{
+		const ASN1_OCTET_STRING *os = kind == XINDEX_SKID ? xindex_skid(x) : xindex_akid(x);
+		return os ? xindex_key_copy(os->data, os->length, key, keylen, hash) : 0;
+	}
+	case XINDEX_SERIAL:
+	{
+		BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(x), NULL);
+		int ret = xindex_key_bn(bn, key, keylen, hash);
+		BN_free(bn);
+		return ret;
+	}
+	case XINDEX_FINGERPRINT:
+	{
+		unsigned char md[EVP_MAX_MD_SIZE];
+		unsigned int n = 0;
+		if (!X509_digest(x, EVP_sha256(), md, &n))
+			return 0;
+		return xindex_key_copy(md, n, key, keylen, hash);
+	}
+	}
+	return 0;
+}
+
+static int xindex_match(int kind, XINDEX_NODE *node, unsigned long hash,
+                        X509_NAME *name, const unsigned char *key, int keylen)
+{
+	if (node->hash != hash)
+		return 0;
+	if (kind == XINDEX_SUBJECT)
+		return name == NULL || X509_NAME_cmp(X509_get_subject_name(node->cert), name) == 0;
+	if (kind == XINDEX_ISSUER)
+		return name == NULL || X509_NAME_cmp(X509_get_issuer_name(node->cert), name) == 0;
+	return node->keylen == keylen && memcmp(node->key, key, keylen) == 0;
+}
+
+/* first matched node when from is NULL, or the next one after from */
+static XINDEX_NODE *xindex_find(X509_INDEX *idx, int kind, XINDEX_NODE *from,
+                                unsigned long hash, X509_NAME *name, const unsigned char *key, int keylen)
+{
+	XINDEX_TABLE *t = &idx->tabs[kind];
+	XINDEX_NODE *node;
+	if (t->size == 0)
+		return NULL;
+	node = from ? from->next : t->buckets[hash & (t->size - 1)];
+	for (; node; node = node->next) {
+		if (xindex_match(kind, node, hash, name, key, keylen))
+			return node;
+	}
+	return NULL;
+}
+
+static int xindex_table_grow(XINDEX_TABLE *t)
+{
+	unsigned int size = t->size ? t->size * 2 : 64;
+	unsigned int i;
+	XINDEX_NODE **buckets = calloc(size, sizeof(XINDEX_NODE *));
+	if (buckets == NULL)
+		return 0;
+	for (i = 0; i < t->size; i++) {
+		XINDEX_NODE *node = t->buckets[i];
+		while (node) {
+			XINDEX_NODE *next = node->next;
+			node->next = buckets[node->hash & (size - 1)];
+			buckets[node->hash & (size - 1)] = node;
+			node = next;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->size = size;
+	return 1;
+}
+
+static void xindex_node_free(XINDEX_NODE *node)
+{
+	free(node->key);
+	free(node);
+}
+
+static int xindex_table_insert(XINDEX_TABLE *t, XINDEX_NODE *node)
+{
+	XINDEX_NODE **slot;
+	if (t->num >= t->size && !xindex_table_grow(t))
+		return 0;
+	slot = &t->buckets[node->hash & (t->size - 1)];
+	node->next = *slot;
+	*slot = node;
+	t->num++;
+	return 1;
+}
+
+static void xindex_table_unlink(XINDEX_TABLE *t, unsigned long hash, X509 *cert)
+{
+	XINDEX_NODE **slot;
+	if (t->size == 0)
+		return;
+	for (slot = &t->buckets[hash & (t->size - 1)]; *slot; slot = &(*slot)->next) {
+		if ((*slot)->cert == cert) {
+			XINDEX_NODE *node = *slot;
+			*slot = node->next;
+			xindex_node_free(node);
+			t->num--;
+			return;
+		}
+	}
+}
+
+/* return indexed certificate same as x (by fingerprint), or NULL */
+static X509 *xindex_lookup_cert(X509_INDEX *idx, X509 *x)
+{
+	unsigned char *key;
+	int keylen;
+	unsigned long hash;
+	XINDEX_NODE *node;
+
+	if (!xindex_key(x, XINDEX_FINGERPRINT, &key, &keylen, &hash))
+		return NULL;
+	node = xindex_find(idx, XINDEX_FINGERPRINT, NULL, hash, NULL, key, keylen);
+	free(key);
+	return node ? node->cert : NULL;
+}
+
+/* add certificate, return 1 added, 0 already indexed, -1 failed */
+static int xindex_add(X509_INDEX *idx, X509 *x)
+{
+	int i;
+	if (xindex_lookup_cert(idx, x))
+		return 0;
+
+	for (i = XINDEX_MAX - 1; i >= 0; i--) {
+		XINDEX_NODE *node;
+		unsigned char *key;
+		int keylen;
+		unsigned long hash;
+
+		if (!xindex_key(x, i, &key, &keylen, &hash)) {
+			/* every indexed certificate must be reachable by fingerprint */
+			if (i == XINDEX_FINGERPRINT)
+				return -1;
+			continue;
+		}
+		node = malloc(sizeof(XINDEX_NODE));
+		if (node) {
+			node->hash = hash;
+			node->key = key;
+			node->keylen = keylen;
+			node->cert = x;
+		}
+		if (node == NULL || !xindex_table_insert(&idx->tabs[i], node)) {
+			free(key);
+			free(node);
+			if (i == XINDEX_FINGERPRINT)
+				return -1;
+		}
+	}
+	X509_up_ref(x);
+	idx->num++;
+	return 1;
+}
+
+static int xindex_remove(X509_INDEX *idx, X509 *x)
+{
+	int i;
+	X509 *cert = xindex_lookup_cert(idx, x);
+	if (cert == NULL)
+		return 0;
+	for (i = 0; i < XINDEX_MAX; i++) {
+		unsigned char *key;
+		int keylen;
+		unsigned long hash;
+		if (xindex_key(cert, i, &key, &keylen, &hash)) {
+			xindex_table_unlink(&idx->tabs[i], hash, cert);
+			free(key);
+		}
+	}
+	X509_free(cert);
+	idx->num--;
+	return 1;
+}
+
+void openssl_x509_index_free(X509_INDEX *idx)
+{
+	int i;
+	unsigned int j;
+	if (--idx->references > 0)
+		return;
+	for (i = 0; i < XINDEX_MAX; i++) {
+		XINDEX_TABLE *t = &idx->tabs[i];
+		for (j = 0; j < t->size; j++) {
+			XINDEX_NODE *node = t->buckets[j];
+			while (node) {
+				XINDEX_NODE *next = node->next;
+				/* fingerprint table hold the certificate reference */
+				if (i == XINDEX_FINGERPRINT)
+					X509_free(node->cert);
+				xindex_node_free(node);
+				node = next;
+			}
+		}
+		free(t->buckets);
+	}
+	free(idx);
+}
+
+/* best issuer of x in index, prefer one in its validity period, borrowed reference */
+X509 *openssl_x509_index_issuer(X509_INDEX *idx, X509 *x)
+{
+	X509_NAME *name = X509_get_issuer_name(x);
+	unsigned long hash = X509_NAME_hash(name);
+	XINDEX_NODE *node = NULL;
+	X509 *found = NULL;
+
+	while ((node = xindex_find(idx, XINDEX_SUBJECT, node, hash, name, NULL, 0)) != NULL) {
+		if (X509_check_issued(node->cert, x) != X509_V_OK)
+			continue;
+		if (X509_cmp_current_time(X509_get_notBefore(node->cert)) < 0
+		        && X509_cmp_current_time(X509_get_notAfter(node->cert)) > 0)
+			return node->cert;
+		if (found == NULL)
+			found = node->cert;
+	}
+	return found;
+}
+
+/****************************** verify path ******************************/
+static int xindex_store_idx = -1;
+
+static void xindex_store_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (ptr)
+		openssl_x509_index_free((X509_INDEX *)ptr);
+}
+
+static X509_INDEX *xindex_from_store(X509_STORE *store)
+{
+	if (xindex_store_idx < 0 || store == NULL)
+		return NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return X509_STORE_get_ex_data(store, xindex_store_idx);
+#else
+	return CRYPTO_get_ex_data(&store->ex_data, xindex_store_idx);
+#endif
+}
+
+static int xindex_get_issuer(X509 **issuer, X509_STORE_CTX *ctx, X509 *x)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_INDEX *idx = xindex_from_store(X509_STORE_CTX_get0_store(ctx));
+#else
+	X509_INDEX *idx = xindex_from_store(ctx->ctx);
+#endif
+	X509 *found = idx ? openssl_x509_index_issuer(idx, x) : NULL;
+	if (found) {
+		X509_up_ref(found);
+		*issuer = found;
+		return 1;
+	}
+	return openssl_x509_store_get1_issuer(issuer, ctx, x);
+}
+
+/* make verification with store find issuers in idx, store keep a reference of idx.
+   issuers found in idx are trusted as if added to store */
+int openssl_x509_store_attach_index(X509_STORE *store, X509_INDEX *idx)
+{
+	X509_INDEX *old;
+	int ret;
+	if (xindex_store_idx < 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		xindex_store_idx = X509_STORE_get_ex_new_index(0, NULL, NULL, NULL, xindex_store_free);
+#else
+		xindex_store_idx = CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_X509_STORE, 0, NULL, NULL, NULL, xindex_store_free);
+#endif
+		if (xindex_store_idx < 0)
+			return 0;
+	}
+	old = xindex_from_store(store);
+	if (old == idx)
+		return 1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ret = X509_STORE_set_ex_data(store, xindex_store_idx, idx);
+#else
+	ret = CRYPTO_set_ex_data(&store->ex_data, xindex_store_idx, idx);
+#endif
+	if (!ret)
+		return 0;
+	idx->references++;
+	if (old)
+		openssl_x509_index_free(old);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_set_get_issuer(store, xindex_get_issuer);
+#else
+	store->get_issuer = xindex_get_issuer;
+#endif
+	return 1;
+}
+
+/****************************** lua binding ******************************/
+static int xindex_add_value(lua_State *L, X509_INDEX *idx, int i)
+{
+	int n = 0;
+	if (auxiliar_isclass(L, "openssl.x509", i)) {
+		X509 *x = CHECK_OBJECT(i, X509, "openssl.x509");
+		n = xindex_add(idx, x) > 0;
+	} else if (auxiliar_isclass(L, "openssl.stack_of_x509", i)) {
+		STACK_OF(X509) *sk = CHECK_OBJECT(i, STACK_OF(X509), "openssl.stack_of_x509");
+		int j;
+		for (j = 0; j < sk_X509_num(sk); j++)
+			n += xindex_add(idx, sk_X509_value(sk, j)) > 0;
+	} else if (lua_istable(L, i)) {
+		int j, len = lua_objlen(L, i);
+		for (j = 1; j <= len; j++) {
+			X509 *x;
+			lua_rawgeti(L, i, j);
+			x = CHECK_OBJECT(-1, X509, "openssl.x509");
+			n += xindex_add(idx, x) > 0;
+			lua_pop(L, 1);
+		}
+	} else
+		luaL_typerror(L, i, "openssl.x509, openssl.stack_of_x509 or table");
+	return n;
+}
+
+/* push result of walk on table kind as array of x509 */
+static int xindex_push_found(lua_State *L, X509_INDEX *idx, int kind,
+                             unsigned long hash, X509_NAME *name, const unsigned char *key, int keylen)
+{
+	XINDEX_NODE *node = NULL;
+	int n = 0;
+	lua_newtable(L);
+	while ((node = xindex_find(idx, kind, node, hash, name, key, keylen)) != NULL) {
+		X509_up_ref(node->cert);
+		PUSH_OBJECT_REF(node->cert, "openssl.x509", X509_free);
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
+static int xindex_unhex(const char *s, size_t len, unsigned char *out)
+{
+	size_t i;
+	for (i = 0; i < len; i++) {
+		int c = s[i], v;
+		if (c >= '0' && c <= '9') v = c - '0';
+		else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+		else return 0;
+		if (i % 2)
+			out[i / 2] |= v;
+		else
+			out[i / 2] = v << 4;
+	}
+	return len % 2 == 0;
+}
+
+/* openssl.x509_index([x509|sk_x509|table certs]) => x509_index */
+LUA_FUNCTION(openssl_x509_index_new)
+{
+	X509_INDEX *idx = calloc(1, sizeof(X509_INDEX));
+	if (idx == NULL)
+		luaL_error(L, "memory allocation failed");
+	idx->references = 1;
+	PUSH_OBJECT(idx, "openssl.x509_index");
+	if (!lua_isnoneornil(L, 1))
+		xindex_add_value(L, idx, 1);
+	return 1;
+}
+
+static int openssl_x509_index_add(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	lua_pushinteger(L, xindex_add_value(L, idx, 2));
+	return 1;
+}
+
+static int openssl_x509_index_remove(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	X509 *x = CHECK_OBJECT(2, X509, "openssl.x509");
+	lua_pushboolean(L, xindex_remove(idx, x));
+	return 1;
+}
+
+static int xindex_by_name(lua_State *L, int kind)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	X509_NAME *name = NULL;
+	unsigned long hash;
+	if (auxiliar_isclass(L, "openssl.x509", 2)) {
+		X509 *x = CHECK_OBJECT(2, X509, "openssl.x509");
+		name = X509_get_subject_name(x);
+		hash = X509_NAME_hash(name);
+	} else if (lua_type(L, 2) == LUA_TSTRING) {
+		/* same format as hash field of x509:parse() */
+		hash = strtoul(lua_tostring(L, 2), NULL, 16);
+	} else
+		hash = (unsigned long)luaL_checknumber(L, 2);
+	return xindex_push_found(L, idx, kind, hash, name, NULL, 0);
+}
+
+/* index:by_subject(x509 cert|string hash) -> table, certs with subject same as subject of cert */
+static int openssl_x509_index_by_subject(lua_State *L)
+{
+	return xindex_by_name(L, XINDEX_SUBJECT);
+}
+
+/* index:by_issuer(x509 cacert|string hash) -> table, certs issued by subject of cacert */
+static int openssl_x509_index_by_issuer(lua_State *L)
+{
+	return xindex_by_name(L, XINDEX_ISSUER);
+}
+
+static int xindex_by_octets(lua_State *L, int kind)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	size_t len;
+	const unsigned char *key = (const unsigned char *)luaL_checklstring(L, 2, &len);
+	return xindex_push_found(L, idx, kind, xindex_hash_bytes(key, len), NULL, key, len);
+}
+
+static int openssl_x509_index_by_ski(lua_State *L)
+{
+	return xindex_by_octets(L, XINDEX_SKID);
+}
+
+static int openssl_x509_index_by_aki(lua_State *L)
+{
+	return xindex_by_octets(L, XINDEX_AKID);
+}
+
+/* index:by_serial(string hexserial) -> table */
+static int openssl_x509_index_by_serial(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	const char *serial = luaL_checkstring(L, 2);
+	BIGNUM *bn = NULL;
+	unsigned char *key;
+	int keylen, ok;
+	unsigned long hash;
+
+	if (!BN_hex2bn(&bn, serial))
+		luaL_error(L, "#2 must be hex encoded serial number");
+	ok = xindex_key_bn(bn, &key, &keylen, &hash);
+	BN_free(bn);
+	if (!ok)
+		return 0;
+	xindex_push_found(L, idx, XINDEX_SERIAL, hash, NULL, key, keylen);
+	free(key);
+	return 1;
+}
+
+/* index:by_fingerprint(string sha256) -> x509, fingerprint can be binary or hex encoded */
+static int openssl_x509_index_by_fingerprint(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	size_t len;
+	const char *fp = luaL_checklstring(L, 2, &len);
+	unsigned char md[EVP_MAX_MD_SIZE];
+	XINDEX_NODE *node;
+
+	if (len == 2 * (size_t)EVP_MD_size(EVP_sha256())) {
+		if (!xindex_unhex(fp, len, md))
+			luaL_error(L, "#2 invalid hex encoded fingerprint");
+		fp = (const char *)md;
+		len /= 2;
+	}
+	node = xindex_find(idx, XINDEX_FINGERPRINT, NULL, xindex_hash_bytes((const unsigned char *)fp, len),
+	                   NULL, (const unsigned char *)fp, len);
+	if (node == NULL)
+		return 0;
+	X509_up_ref(node->cert);
+	PUSH_OBJECT_REF(node->cert, "openssl.x509", X509_free);
+	return 1;
+}
+
+/* index:issuers_of(x509 cert) -> table, indexed certs which issued cert */
+static int openssl_x509_index_issuers_of(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	X509 *x = CHECK_OBJECT(2, X509, "openssl.x509");
+	X509_NAME *name = X509_get_issuer_name(x);
+	unsigned long hash = X509_NAME_hash(name);
+	XINDEX_NODE *node = NULL;
+	int n = 0;
+
+	lua_newtable(L);
+	while ((node = xindex_find(idx, XINDEX_SUBJECT, node, hash, name, NULL, 0)) != NULL) {
+		if (X509_check_issued(node->cert, x) != X509_V_OK)
+			continue;
+		X509_up_ref(node->cert);
+		PUSH_OBJECT_REF(node->cert, "openssl.x509", X509_free);
+		lua_rawseti(L, -2, ++n);
+	}
+	return 1;
+}
+
+/* index:attach(ssl_ctx|x509_store obj) -> boolean, verify with obj will lookup issuers in index,
+   every indexed cert is a trust anchor of obj */
+static int openssl_x509_index_attach(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	X509_STORE *store;
+	if (auxiliar_isclass(L, "openssl.x509_store", 2))
+		store = CHECK_OBJECT(2, X509_STORE, "openssl.x509_store");
+	else
+		store = SSL_CTX_get_cert_store(CHECK_OBJECT(2, SSL_CTX, "openssl.ssl_ctx"));
+	lua_pushboolean(L, openssl_x509_store_attach_index(store, idx));
+	return 1;
+}
+
+static int openssl_x509_index_count(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	lua_pushinteger(L, idx->num);
+	return 1;
+}
+
+static int openssl_x509_index_gc(lua_State *L)
+{
+	X509_INDEX *idx = CHECK_OBJECT(1, X509_INDEX, "openssl.x509_index");
+	openssl_x509_index_free(idx);
+	return 0;
+}
+
+static luaL_Reg x509_index_funcs[] = {
+	{"add",			openssl_x509_index_add},
+	{"remove",		openssl_x509_index_remove},
+	{"by_subject",		openssl_x509_index_by_subject},
+	{"by_issuer",		openssl_x509_index_by_issuer},
+	{"by_ski",		openssl_x509_index_by_ski},
+	{"by_aki",		openssl_x509_index_by_aki},
+	{"by_serial",		openssl_x509_index_by_serial},
+	{"by_fingerprint",	openssl_x509_index_by_fingerprint},
+	{"issuers_of",		openssl_x509_index_issuers_of},
+	{"attach",		openssl_x509_index_attach},
+	{"count",		openssl_x509_index_count},
+
+	{"__len",		openssl_x509_index_count},
+	{"__gc",		openssl_x509_index_gc},
+	{"__tostring",		auxiliar_tostring},
+
+	{NULL,			NULL},
+};
+
+int openssl_register_x509_index(lua_State *L)
+{
+	auxiliar_newclass(L, "openssl.x509_index", x509_index_funcs);
+	return 0;
+}
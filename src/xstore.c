@@ -0,0 +1,626 @@
+/*=========================================================================*\
+* x509 store routines
+* lua-openssl toolkit
+*
+* This product includes PHP software, freely available from <http://www.php.net/software/>
+* Author:  george zhao <zhaozg(at)gmail.com>
+\*=========================================================================*/
+#include "openssl.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/****************************** snapshot ******************************/
+/*
+ * snapshot file layout, integers are 32bits big endian
+ *
+ *   "LOSNAP01"                   magic
+ *   count                        number of certificates
+ *   flags                        reserved, 0
+ *   count * {hash, offset, len}  sorted by subject name hash
+ *   DER data                     offset is from start of file
+ *
+ * file is mapped readonly so prefork workers share the pages, a certificate
+ * is only parsed by d2i when verification asks issuer with its subject.
+ */
+#define XSNAP_MAGIC		"LOSNAP01"
+#define XSNAP_HEADER		16
+#define XSNAP_ENTRY		12
+
+typedef struct {
+	const unsigned char *data;
+	size_t size;
+	int mapped;
+	unsigned long count;
+	X509 **certs;		/* parsed on first use */
+} XSNAP;
+
+typedef struct {
+	unsigned long hash;
+	const unsigned char *der;
+	int len;
+} XSNAP_ITEM;
+
+static unsigned long xsnap_get32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16)
+	       | ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+static void xsnap_put32(unsigned char *p, unsigned long v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static void xsnap_free(XSNAP *snap)
+{
+	unsigned long i;
+	for (i = 0; snap->certs && i < snap->count; i++) {
+		if (snap->certs[i])
+			X509_free(snap->certs[i]);
+	}
+	OPENSSL_free(snap->certs);
+#ifndef _WIN32
+	if (snap->mapped)
+		munmap((void *)snap->data, snap->size);
+	else
+#endif
+		OPENSSL_free((void *)snap->data);
+	OPENSSL_free(snap);
+}
+
+static int xsnap_check(XSNAP *snap)
+{
+	unsigned long i, off, len;
+	if (snap->size < XSNAP_HEADER || memcmp(snap->data, XSNAP_MAGIC, 8) != 0)
+		return 0;
+	snap->count = xsnap_get32(snap->data + 8);
+	if (snap->count > (snap->size - XSNAP_HEADER) / XSNAP_ENTRY)
+		return 0;
+	for (i = 0; i < snap->count; i++) {
+		const unsigned char *e = snap->data + XSNAP_HEADER + i * XSNAP_ENTRY;
+		off = xsnap_get32(e + 4);
+		len = xsnap_get32(e + 8);
+		if (off > snap->size || len > snap->size - off || len == 0)
+			return 0;
+		if (i > 0 && xsnap_get32(e - XSNAP_ENTRY) > xsnap_get32(e))
+			return 0;
+	}
+	return 1;
+}
+
+static XSNAP *xsnap_open(const char *path)
+{
+	XSNAP *snap = OPENSSL_malloc(sizeof(XSNAP));
+	if (snap == NULL)
+		return NULL;
+	memset(snap, 0, sizeof(XSNAP));
+#ifndef _WIN32
+	{
+		struct stat st;
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			OPENSSL_free(snap);
+			return NULL;
+		}
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED) {
+				snap->data = p;
+				snap->size = (size_t)st.st_size;
+				snap->mapped = 1;
+			}
+		}
+		close(fd);
+	}
+#endif
+	if (snap->data == NULL) {
+		FILE *fp = fopen(path, "rb");
+		long n = -1;
+		unsigned char *buf = NULL;
+		if (fp && fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+			buf = OPENSSL_malloc(n);
+			if (buf && fread(buf, 1, n, fp) != (size_t)n) {
+				OPENSSL_free(buf);
+				buf = NULL;
+			}
+		}
+		if (fp)
+			fclose(fp);
+		snap->data = buf;
+		snap->size = buf ? (size_t)n : 0;
+	}
+	if (snap->data == NULL || !xsnap_check(snap)) {
+		if (snap->data == NULL) {
+			OPENSSL_free(snap);
+			return NULL;
+		}
+		xsnap_free(snap);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (snap->count > 0) {
+		snap->certs = OPENSSL_malloc(snap->count * sizeof(X509 *));
+		if (snap->certs == NULL) {
+			xsnap_free(snap);
+			return NULL;
+		}
+		memset(snap->certs, 0, snap->count * sizeof(X509 *));
+	}
+	return snap;
+}
+
+/* parse entry i once, concurrent verifies may race here, first writer wins */
+static X509 *xsnap_cert(X509_STORE *store, XSNAP *snap, unsigned long i)
+{
+	const unsigned char *e = snap->data + XSNAP_HEADER + i * XSNAP_ENTRY;
+	const unsigned char *p;
+	X509 *x = snap->certs[i];
+	if (x)
+		return x;
+	p = snap->data + xsnap_get32(e + 4);
+	x = d2i_X509(NULL, &p, (long)xsnap_get32(e + 8));
+	if (x == NULL)
+		return NULL;
+	X509_check_purpose(x, -1, 0);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_lock(store);
+#else
+	(void)store;
+	CRYPTO_w_lock(CRYPTO_LOCK_X509_STORE);
+#endif
+	if (snap->certs[i] == NULL) {
+		snap->certs[i] = x;
+		x = NULL;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_unlock(store);
+#else
+	CRYPTO_w_unlock(CRYPTO_LOCK_X509_STORE);
+#endif
+	if (x)
+		X509_free(x);
+	return snap->certs[i];
+}
+
+/* lower bound of hash in sorted entry table */
+static unsigned long xsnap_first(XSNAP *snap, unsigned long hash)
+{
+	unsigned long lo = 0, hi = snap->count;
+	while (lo < hi) {
+		unsigned long mid = lo + (hi - lo) / 2;
+		if (xsnap_get32(snap->data + XSNAP_HEADER + mid * XSNAP_ENTRY) < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static X509 *xsnap_issuer(X509_STORE *store, XSNAP *snap, X509 *x)
+{
+	unsigned long hash = X509_NAME_hash(X509_get_issuer_name(x)) & 0xffffffffUL;
+	unsigned long i;
+	X509 *found = NULL;
+
+	for (i = xsnap_first(snap, hash); i < snap->count
+	        && xsnap_get32(snap->data + XSNAP_HEADER + i * XSNAP_ENTRY) == hash; i++) {
+		X509 *c = xsnap_cert(store, snap, i);
+		if (c == NULL || X509_check_issued(c, x) != X509_V_OK)
+			continue;
+		if (X509_cmp_current_time(X509_get_notBefore(c)) < 0
+		        && X509_cmp_current_time(X509_get_notAfter(c)) > 0)
+			return c;
+		if (found == NULL)
+			found = c;
+	}
+	return found;
+}
+
+static int xsnap_store_idx = -1;
+
+static void xsnap_store_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	(void)parent; (void)ad; (void)idx; (void)argl; (void)argp;
+	if (ptr)
+		xsnap_free((XSNAP *)ptr);
+}
+
+static XSNAP *xsnap_from_store(X509_STORE *store)
+{
+	if (xsnap_store_idx < 0 || store == NULL)
+		return NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return X509_STORE_get_ex_data(store, xsnap_store_idx);
+#else
+	return CRYPTO_get_ex_data(&store->ex_data, xsnap_store_idx);
+#endif
+}
+
+/* issuer from snapshot of store if any, then from lookups of store */
+int openssl_x509_store_get1_issuer(X509 **issuer, X509_STORE_CTX *ctx, X509 *x)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE *store = X509_STORE_CTX_get0_store(ctx);
+#else
+	X509_STORE *store = ctx->ctx;
+#endif
+	XSNAP *snap = xsnap_from_store(store);
+	X509 *found = snap ? xsnap_issuer(store, snap, x) : NULL;
+	if (found) {
+		X509_up_ref(found);
+		*issuer = found;
+		return 1;
+	}
+	return X509_STORE_CTX_get1_issuer(issuer, ctx, x);
+}
+
+static int xsnap_attach(X509_STORE *store, XSNAP *snap)
+{
+	if (xsnap_store_idx < 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		xsnap_store_idx = X509_STORE_get_ex_new_index(0, NULL, NULL, NULL, xsnap_store_free);
+#else
+		xsnap_store_idx = CRYPTO_get_ex_new_index(CRYPTO_EX_INDEX_X509_STORE, 0, NULL, NULL, NULL, xsnap_store_free);
+#endif
+		if (xsnap_store_idx < 0)
+			return 0;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if (!X509_STORE_set_ex_data(store, xsnap_store_idx, snap))
+		return 0;
+	X509_STORE_set_get_issuer(store, openssl_x509_store_get1_issuer);
+#else
+	if (!CRYPTO_set_ex_data(&store->ex_data, xsnap_store_idx, snap))
+		return 0;
+	store->get_issuer = openssl_x509_store_get1_issuer;
+#endif
+	return 1;
+}
+
+static int xsnap_item_cmp(const void *a, const void *b)
+{
+	unsigned long ha = ((const XSNAP_ITEM *)a)->hash;
+	unsigned long hb = ((const XSNAP_ITEM *)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+static int xsnap_item_add(XSNAP_ITEM **items, int *num, int *cap,
+                          unsigned long hash, const unsigned char *der, int len)
+{
+	if (*num == *cap) {
+		int n = *cap ? *cap * 2 : 64;
+		XSNAP_ITEM *p = OPENSSL_realloc(*items, n * sizeof(XSNAP_ITEM));
+		if (p == NULL)
+			return 0;
+		*items = p;
+		*cap = n;
+	}
+	(*items)[*num].hash = hash;
+	(*items)[*num].der = der;
+	(*items)[*num].len = len;
+	(*num)++;
+	return 1;
+}
+
+/* write certificates of store objects and of its snapshot, without parsing snapshot,
+   items with negative len own DER allocated by i2d. file is written aside and
+   renamed over path, workers having old one mapped keep reading old pages.
+   fails with *reason set when store has CRLs, snapshot only holds certificates */
+static int xsnap_save(X509_STORE *store, const char *path, const char **reason)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	STACK_OF(X509_OBJECT) *objs = X509_STORE_get0_objects(store);
+#else
+	STACK_OF(X509_OBJECT) *objs = store->objs;
+#endif
+	XSNAP *snap = xsnap_from_store(store);
+	XSNAP_ITEM *items = NULL;
+	int i, num = 0, cap = 0, ret = 0;
+	unsigned long off, n;
+	unsigned char buf[XSNAP_HEADER];
+	FILE *fp = NULL;
+#ifndef _WIN32
+	char *tmp = NULL;
+	int fd, err;
+#endif
+
+	for (n = 0; snap && n < snap->count; n++) {
+		const unsigned char *e = snap->data + XSNAP_HEADER + n * XSNAP_ENTRY;
+		if (!xsnap_item_add(&items, &num, &cap, xsnap_get32(e),
+		                    snap->data + xsnap_get32(e + 4), (int)xsnap_get32(e + 8)))
+			goto end;
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_lock(store);
+#else
+	CRYPTO_r_lock(CRYPTO_LOCK_X509_STORE);
+#endif
+	for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+		X509_OBJECT *obj = sk_X509_OBJECT_value(objs, i);
+		unsigned char *der = NULL;
+		int len;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		int type = X509_OBJECT_get_type(obj);
+		X509 *x = X509_OBJECT_get0_X509(obj);
+#else
+		int type = obj->type;
+		X509 *x = type == X509_LU_X509 ? obj->data.x509 : NULL;
+#endif
+		if (type == X509_LU_CRL) {
+			*reason = "store has CRLs, not snapshotted";
+			break;
+		}
+		if (x == NULL)
+			continue;
+		len = i2d_X509(x, &der);
+		if (len <= 0 || !xsnap_item_add(&items, &num, &cap,
+		                                X509_NAME_hash(X509_get_subject_name(x)) & 0xffffffffUL, der, -len)) {
+			OPENSSL_free(der);
+			break;
+		}
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_STORE_unlock(store);
+#else
+	CRYPTO_r_unlock(CRYPTO_LOCK_X509_STORE);
+#endif
+	if (i < sk_X509_OBJECT_num(objs))
+		goto end;
+
+	qsort(items, num, sizeof(XSNAP_ITEM), xsnap_item_cmp);
+
+#ifndef _WIN32
+	tmp = OPENSSL_malloc(strlen(path) + 8);
+	if (tmp == NULL)
+		goto end;
+	strcpy(tmp, path);
+	strcat(tmp, ".XXXXXX");
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		OPENSSL_free(tmp);
+		tmp = NULL;
+		goto end;
+	}
+	/* mkstemp make it 0600, readers may run as other user */
+	fchmod(fd, 0644);
+	fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		goto end;
+	}
+#else
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+		goto end;
+#endif
+	memcpy(buf, XSNAP_MAGIC, 8);
+	xsnap_put32(buf + 8, num);
+	xsnap_put32(buf + 12, 0);
+	if (fwrite(buf, 1, XSNAP_HEADER, fp) != XSNAP_HEADER)
+		goto end;
+	off = XSNAP_HEADER + (unsigned long)num * XSNAP_ENTRY;
+	for (i = 0; i < num; i++) {
+		int len = items[i].len < 0 ? -items[i].len : items[i].len;
+		xsnap_put32(buf, items[i].hash);
+		xsnap_put32(buf + 4, off);
+		xsnap_put32(buf + 8, len);
+		if (fwrite(buf, 1, XSNAP_ENTRY, fp) != XSNAP_ENTRY)
+			goto end;
+		off += len;
+	}
+	for (i = 0; i < num; i++) {
+		size_t len = items[i].len < 0 ? -items[i].len : items[i].len;
+		if (fwrite(items[i].der, 1, len, fp) != len)
+			goto end;
+	}
+#ifndef _WIN32
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		goto end;
+#endif
+	ret = 1;
+end:
+	if (fp && fclose(fp) != 0)
+		ret = 0;
+#ifndef _WIN32
+	if (tmp) {
+		if (ret && rename(tmp, path) != 0)
+			ret = 0;
+		if (!ret) {
+			err = errno;
+			unlink(tmp);
+			errno = err;
+		}
+		OPENSSL_free(tmp);
+	}
+#endif
+	for (i = 0; i < num; i++) {
+		if (items[i].len < 0)
+			OPENSSL_free((void *)items[i].der);
+	}
+	OPENSSL_free(items);
+	return ret;
+}
+
+
+static int xstore_add_value(lua_State *L, X509_STORE *store, int i)
+{
+	int ret = 1;
+	if (auxiliar_isclass(L, "openssl.x509", i)) {
+		X509 *x = CHECK_OBJECT(i, X509, "openssl.x509");
+		ret = X509_STORE_add_cert(store, x);
+	} else if (auxiliar_isclass(L, "openssl.x509_crl", i)) {
+		X509_CRL *crl = CHECK_OBJECT(i, X509_CRL, "openssl.x509_crl");
+		ret = X509_STORE_add_crl(store, crl);
+	} else if (auxiliar_isclass(L, "openssl.stack_of_x509", i)) {
+		STACK_OF(X509) *sk = CHECK_OBJECT(i, STACK_OF(X509), "openssl.stack_of_x509");
+		int j;
+		for (j = 0; j < sk_X509_num(sk) && ret; j++)
+			ret = X509_STORE_add_cert(store, sk_X509_value(sk, j));
+	} else if (lua_istable(L, i)) {
+		int j, n = lua_objlen(L, i);
+		for (j = 1; j <= n && ret; j++) {
+			lua_rawgeti(L, i, j);
+			ret = xstore_add_value(L, store, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+	} else
+		luaL_typerror(L, i, "openssl.x509, openssl.x509_crl, openssl.stack_of_x509 or table");
+	/* same object already in store is not a failure */
+	if (!ret && ERR_GET_REASON(ERR_peek_last_error()) == X509_R_CERT_ALREADY_IN_HASH_TABLE) {
+		ERR_clear_error();
+		ret = 1;
+	}
+	return ret;
+}
+
+/*  openssl.x509_store_new([sk_x509|table certs]) => x509_store {{{1
+	certs can contain x509 and x509_crl objects
+*/
+LUA_FUNCTION(openssl_x509_store_new)
+{
+	X509_STORE *store = X509_STORE_new();
+	PUSH_OBJECT(store, "openssl.x509_store");
+	if (!lua_isnoneornil(L, 1) && !xstore_add_value(L, store, 1))
+		luaL_error(L, "#1 add certificate or crl to store failed");
+	return 1;
+}
+/* }}} */
+
+/* store:add(x509|x509_crl|sk_x509|table obj) -> boolean */
+static int openssl_x509_store_add(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	lua_pushboolean(L, xstore_add_value(L, store, 2));
+	return 1;
+}
+
+/*  openssl.x509_store_load_snapshot(string path) => x509_store {{{1
+	return nil and error message when fail
+*/
+LUA_FUNCTION(openssl_x509_store_load_snapshot)
+{
+	const char *path = luaL_checkstring(L, 1);
+	X509_STORE *store;
+	XSNAP *snap = xsnap_open(path);
+	if (snap == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	store = X509_STORE_new();
+	if (store == NULL || !xsnap_attach(store, snap)) {
+		xsnap_free(snap);
+		if (store)
+			X509_STORE_free(store);
+		luaL_error(L, "attach snapshot to store failed");
+	}
+	PUSH_OBJECT(store, "openssl.x509_store");
+	return 1;
+}
+/* }}} */
+
+/* store:save_snapshot(string path) -> boolean [,string err] */
+static int openssl_x509_store_save_snapshot(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	const char *path = luaL_checkstring(L, 2);
+	const char *err = NULL;
+	errno = 0;
+	if (!xsnap_save(store, path, &err)) {
+		lua_pushboolean(L, 0);
+		if (err)
+			lua_pushstring(L, err);
+		else
+			lua_pushfstring(L, "%s: %s", path, errno ? strerror(errno) : "save snapshot failed");
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* store:snapshot() -> number total, number parsed, or nil when not loaded from snapshot */
+static int openssl_x509_store_snapshot(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	XSNAP *snap = xsnap_from_store(store);
+	unsigned long i, n = 0;
+	if (snap == NULL)
+		return 0;
+	for (i = 0; i < snap->count; i++) {
+		if (snap->certs[i])
+			n++;
+	}
+	lua_pushinteger(L, snap->count);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+/* store:add_index(x509_index idx) -> boolean */
+static int openssl_x509_store_add_index(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	X509_INDEX *idx = CHECK_OBJECT(2, X509_INDEX, "openssl.x509_index");
+	lua_pushboolean(L, openssl_x509_store_attach_index(store, idx));
+	return 1;
+}
+
+/* store:load([string file [, string path]]) -> boolean */
+static int openssl_x509_store_load(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	const char *file = luaL_optstring(L, 2, NULL);
+	const char *path = luaL_optstring(L, 3, NULL);
+	int ret;
+	if (file == NULL && path == NULL)
+		ret = X509_STORE_set_default_paths(store);
+	else
+		ret = X509_STORE_load_locations(store, file, path);
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+/* store:flags(number flags) -> boolean, X509_V_FLAG_* such as crl check */
+static int openssl_x509_store_flags(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	unsigned long flags = (unsigned long)luaL_checknumber(L, 2);
+	lua_pushboolean(L, X509_STORE_set_flags(store, flags));
+	return 1;
+}
+
+static int openssl_x509_store_gc(lua_State *L)
+{
+	X509_STORE *store = CHECK_OBJECT(1, X509_STORE, "openssl.x509_store");
+	X509_STORE_free(store);
+	return 0;
+}
+
+static luaL_Reg x509_store_funcs[] = {
+	{"add",			openssl_x509_store_add},
+	{"add_index",		openssl_x509_store_add_index},
+	{"load",		openssl_x509_store_load},
+	{"flags",		openssl_x509_store_flags},
+	{"save_snapshot",	openssl_x509_store_save_snapshot},
+	{"snapshot",		openssl_x509_store_snapshot},
+
+	{"__gc",		openssl_x509_store_gc},
+	{"__tostring",		auxiliar_tostring},
+
+	{NULL,			NULL},
+};
+
+int openssl_register_x509_store(lua_State *L)
+{
+	auxiliar_newclass(L, "openssl.x509_store", x509_store_funcs);
+	return 0;
+}
@@ -23,3 +23,89 @@ function test_x509()
 end
 
 test_x509()
+
+function test_x509_index()
+        local x = openssl.x509_read(raw_data)
+        local idx = openssl.x509_index({x})
+        assert(#idx==1)
+        assert(idx:add(x)==0)
+        local t = x:parse()
+        assert(#idx:by_subject(t.hash)==1)
+        assert(#idx:by_serial(t.serialNumber)==1)
+        -- self signed, issuer of itself
+        assert(#idx:issuers_of(x)==1)
+        assert(idx:remove(x))
+        assert(#idx==0)
+end
+
+test_x509_index()
+
+function test_x509_verify_many()
+        local x = openssl.x509_read(raw_data)
+        local store = openssl.x509_store_new({x})
+        assert(x:check(store)~=nil)
+        local certs = {}
+        for i=1,16 do certs[i] = x end
+        local status, depth = openssl.x509_verify_many(certs, store, nil, nil, 4)
+        assert(#status==16 and #depth==16)
+        for i=2,16 do
+                assert(status[i]==status[1] and depth[i]==depth[1])
+        end
+        -- raw_data expired in 2012, pool and sequential check must agree
+        assert((status[1]==0)==(x:check(store)==true))
+
+        -- cert.pem is its own trust anchor, ignore its 2013 expiry
+        local ca = openssl.x509_read(readfile('cert.pem'))
+        local castore = openssl.x509_store_new({ca})
+        assert(castore:flags(0x200000)) -- X509_V_FLAG_NO_CHECK_TIME
+        assert(ca:check(castore)==true)
+        status, depth = openssl.x509_verify_many({ca, ca}, castore)
+        assert(status[1]==0 and status[2]==0 and depth[1]==-1)
+end
+
+test_x509_verify_many()
+
+function test_x509_store_snapshot()
+        local x = openssl.x509_read(raw_data)
+        local store = openssl.x509_store_new({x})
+        local path = os.tmpname()
+        assert(store:save_snapshot(path))
+        local snap = assert(openssl.x509_store_load_snapshot(path))
+        local total, parsed = snap:snapshot()
+        assert(total==1 and parsed==0)
+        local ret, err = x:check(store)
+        local sret, serr = x:check(snap)
+        assert(sret==ret and serr==err)
+        total, parsed = snap:snapshot()
+        assert(parsed==1)
+
+        -- snapshot only holds certificates, a store with CRLs is refused
+        assert(store:add(openssl.crl_new(x, os.time(), os.time() + 3600)))
+        local ok, msg = store:save_snapshot(path)
+        assert(not ok and msg=='store has CRLs, not snapshotted')
+        os.remove(path)
+end
+
+test_x509_store_snapshot()
+
+function test_x509_identity()
+        local x = openssl.x509_read(raw_data)
+        -- same native key is same lua object
+        assert(x:get_public()==x:get_public())
+        local idx = openssl.x509_index({x})
+        assert(idx:by_subject(x)[1]==x)
+end
+
+test_x509_identity()
+
+function test_sk_x509()
+        local x = openssl.x509_read(raw_data)
+        local sk = openssl.sk_x509_new({x, x})
+        assert(#sk==2)
+        assert(sk[1]==x and sk[2]==x and sk[3]==nil)
+        assert(sk:get(0)==x)
+        assert(sk:totable()[2]==x)
+        assert(sk:pop()==x and #sk==1)
+end
+
+test_sk_x509()
@@ -0,0 +1,882 @@
+local openssl = require('openssl')
+require 'util'
+
+local certfile = arg and arg[1] or 'cert.pem'
+local keyfile = arg and arg[2] or 'key.pem'
+
+-- drive handshake of srv and cli over bio pairs, ciphertext moved by this loop
+local function pump(srv, cli)
+        local n = 0
+        local out = cli:pending_output()
+        n = n + #out
+        assert(srv:feed(out) == #out)
+        out = srv:pending_output()
+        n = n + #out
+        assert(cli:feed(out) == #out)
+        return n
+end
+
+local function handshake(srv, cli)
+        local sdone, cdone
+        repeat
+                sdone = sdone or srv:do_handshake()
+                cdone = cdone or cli:do_handshake()
+        until (sdone and cdone) or pump(srv, cli) == 0
+        assert(sdone and cdone)
+        pump(srv, cli)
+end
+
+local function server_ctx(method)
+        local cert = openssl.x509_read(readfile(certfile))
+        local key = openssl.pkey_read(readfile(keyfile), false)
+        local ctx = openssl.ssl_ctx_new(method or 'SSLv23')
+        assert(ctx:use_certificate(cert))
+        assert(ctx:use_PrivateKey(key))
+        return ctx
+end
+
+function test_buffer()
+        local buf = openssl.buffer_new('hello')
+        assert(#buf == 5)
+        assert(buf:append(' world') == buf)
+        assert(buf:tostring() == 'hello world')
+        assert(buf:tostring(7) == 'world' and buf:tostring(1, 5) == 'hello')
+        assert(buf:consume(6) == 5 and buf:tostring() == 'world')
+        assert(buf:capacity(100) >= 105)
+        assert(#buf:clear() == 0 and buf:tostring() == '')
+end
+
+test_buffer()
+
+-- one mem bio is a pipe, written by one ssl and read by other
+function test_ssl_nonblock()
+        local c2s, s2c = openssl.bio_new_mem(), openssl.bio_new_mem()
+        local srv = server_ctx():ssl(c2s, s2c, true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl(s2c, c2s)
+
+        local ok, reason = srv:do_handshake()
+        assert(ok == nil and reason == 'want_read')
+        local sdone, cdone
+        for i = 1, 10 do
+                cdone = cdone or cli:do_handshake()
+                sdone = sdone or srv:do_handshake()
+        end
+        assert(sdone and cdone)
+
+        local buf = openssl.buffer_new()
+        assert(cli:write('ping') == 4)
+        assert(srv:read(buf) == 4 and buf:tostring() == 'ping')
+        ok, reason = srv:read(buf)
+        assert(ok == nil and reason == 'want_read')
+
+        -- partial write return after a record, go on from offset
+        local data = string.rep('x', 20000) .. string.rep('y', 20000)
+        local n = cli:write(data)
+        assert(n > 0 and n < #data)
+        while n < #data do
+                n = n + cli:write(data, n + 1)
+        end
+        buf:clear()
+        while srv:read(buf) do end
+        assert(buf:tostring() == data)
+
+        -- write from buffer remove bytes written
+        while #buf > 0 do
+                local left = #buf
+                n = srv:write(buf)
+                assert(n > 0 and #buf == left - n)
+        end
+        local got = {}
+        repeat
+                local s = cli:read()
+                got[#got + 1] = s
+        until not s
+        assert(table.concat(got) == data)
+end
+
+test_ssl_nonblock()
+
+function test_ssl_bio_pair()
+        local sctx = server_ctx()
+        local cctx = openssl.ssl_ctx_new('SSLv23')
+
+        local sin, snet = openssl.bio_pair()
+        local cin, cnet = openssl.bio_pair(4096)
+        local srv = sctx:ssl(sin, true)
+        local cli = cctx:ssl(cin)
+
+        local ok, reason = cli:do_handshake()
+        assert(ok == nil and reason == 'want_read')
+        handshake(srv, cli)
+
+        assert(cli:write('hello') == 5)
+        local buf = openssl.buffer_new()
+        assert(cli:pending_output(buf) > 0)
+        assert(srv:feed(buf) > 0 and #buf == 0)
+        assert(srv:read() == 'hello')
+        ok, reason = srv:read()
+        assert(ok == nil and reason == 'want_read')
+
+        -- getters take their own references, collecting them keep ssl usable
+        local r, w = srv:bio()
+        assert(r == sin and w == sin)
+        assert(srv:get_client_CA_list() ~= srv:get_client_CA_list())
+        sin, r, w = nil, nil, nil
+        collectgarbage()
+        assert(cli:write('again') == 5)
+        pump(srv, cli)
+        assert(srv:read() == 'again')
+end
+
+test_ssl_bio_pair()
+
+-- two server ctx map one cache file, like two prefork workers
+function test_session_cache_shm()
+        local SSL_OP_NO_TICKET = 0x4000
+        local path = os.tmpname()
+        local workers = {}
+        for i = 1, 2 do
+                local ctx = server_ctx()
+                ctx:options(SSL_OP_NO_TICKET)
+                ctx:session('lua-openssl-test')
+                assert(ctx:session_cache_shm(path, 1))
+                workers[i] = ctx
+        end
+        local cctx = openssl.ssl_ctx_new('SSLv23')
+
+        local srv = workers[1]:ssl(openssl.bio_pair(), true)
+        local cli = cctx:ssl((openssl.bio_pair()))
+        handshake(srv, cli)
+        cli:read()
+        -- freed without shutdown, session is not resumable
+        cli:shutdown()
+        local sess = cli:session()
+        assert(not srv:cache_hit())
+
+        srv = workers[2]:ssl(openssl.bio_pair(), true)
+        cli = cctx:ssl((openssl.bio_pair()))
+        cli:session(sess)
+        handshake(srv, cli)
+        assert(srv:cache_hit())
+
+        local st = workers[2]:session_cache_stats()
+        assert(st.hits >= 1 and st.stores >= 1 and st.entries >= 1)
+        assert(st.capacity > 0 and st.evictions == 0)
+        assert(openssl.ssl_ctx_new('SSLv23'):session_cache_stats() == nil)
+        os.remove(path)
+end
+
+test_session_cache_shm()
+
+-- tickets from one ctx resumed by another ctx with same keys
+function test_ticket_keys()
+        local old = string.rep('o', 80)
+        local new = string.rep('n', 48)
+        local function resume(sctx, sess)
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+                if sess then cli:session(sess) end
+                handshake(srv, cli)
+                cli:read()
+                cli:shutdown()
+                return srv:cache_hit(), cli:session()
+        end
+
+        local a, b, c = server_ctx(), server_ctx(), server_ctx()
+        assert(a:ticket_keys() == nil)
+        assert(a:ticket_keys({old}))
+        assert(b:ticket_keys({new, old}))
+        assert(c:ticket_keys({new}))
+        assert(#b:ticket_keys() == 2 and b:ticket_keys()[1] == string.rep('n', 16))
+
+        local hit, sess = resume(a)
+        assert(not hit)
+        -- old key decrypts and ticket is renewed with new key
+        hit = resume(b, sess)
+        assert(hit)
+        hit = resume(c, sess)
+        assert(not hit)
+
+        -- keys file reloaded when changed
+        local path = os.tmpname()
+        savefile(path, old)
+        local d = server_ctx()
+        assert(d:ticket_keys(path, 80, 0))
+        assert(d:ticket_keys()[1] == string.rep('o', 16))
+        savefile(path, new .. string.rep('x', 80 - 48) .. old)
+        hit = resume(d, sess)
+        assert(hit)
+        assert(#d:ticket_keys() == 2)
+        assert(d:ticket_keys(path .. '.none') == nil)
+        -- whole file is read, broken one keeps keys
+        savefile(path, string.rep(new, 200))
+        assert(d:ticket_keys(path, 48, 0))
+        assert(#d:ticket_keys() == 200)
+        savefile(path, string.rep(new, 200) .. 'x')
+        resume(d)
+        assert(#d:ticket_keys() == 200)
+        os.remove(path)
+end
+
+test_ticket_keys()
+
+-- TLSv1.3 with version range, suites, groups and 0-RTT early data
+function test_tls13_early_data()
+        local sctx = server_ctx('TLS')
+        assert(sctx:min_version('TLSv1.2'))
+        assert(sctx:max_version('TLSv1.3'))
+        assert(sctx:min_version() == 'TLSv1.2' and sctx:max_version() == 'TLSv1.3')
+        assert(sctx:ciphersuites('TLS_AES_128_GCM_SHA256'))
+        assert(sctx:groups('P-256:X25519'))
+        assert(sctx:max_early_data(1024) == 1024)
+        assert(sctx:anti_replay())
+        local cctx = openssl.ssl_ctx_new('TLS_client')
+        assert(cctx:min_version('TLSv1.3'))
+        local ok, err = pcall(openssl.ssl_ctx_new, 'TLSv9')
+        assert(not ok and err:find('#1:TLSv9 not supported', 1, true))
+
+        local srv = sctx:ssl(openssl.bio_pair(), true)
+        local cli = cctx:ssl((openssl.bio_pair()))
+        handshake(srv, cli)
+        cli:read()
+        cli:shutdown()
+        local _, version = cli:version()
+        assert(version == 'TLSv1.3')
+        assert(cli:current_cipher().name == 'TLS_AES_128_GCM_SHA256')
+        local sess = cli:session()
+
+        srv = sctx:ssl(openssl.bio_pair(), true)
+        cli = cctx:ssl((openssl.bio_pair()))
+        cli:session(sess)
+        assert(cli:write_early_data('ping') == 4)
+        local hello = cli:pending_output()
+        assert(srv:feed(hello) == #hello)
+        local early, d, reason = {}
+        repeat
+                d, reason = srv:read_early_data()
+                early[#early + 1] = d
+                pump(srv, cli)
+                cli:do_handshake()
+        until reason == 'finish'
+        handshake(srv, cli)
+        assert(table.concat(early) == 'ping')
+        assert(srv:early_data_status() == 'accepted')
+        assert(cli:early_data_status() == 'accepted')
+
+        -- replayed hello, session is single use
+        srv = sctx:ssl(openssl.bio_pair(), true)
+        srv:feed(hello)
+        d, reason = srv:read_early_data()
+        assert(d == nil)
+        assert(srv:early_data_status() ~= 'accepted')
+end
+
+test_tls13_early_data()
+
+-- handshake switched to ssl_ctx of servername
+function test_sni_router()
+        local default, a, b = server_ctx(), server_ctx(), server_ctx()
+        local router = default:sni_router({['www.example.com'] = a, ['*.example.org'] = b})
+        assert(#router == 2)
+        assert(router:lookup('WWW.Example.com.') == a)
+        assert(router:lookup('x.example.org') == b)
+        assert(router:lookup('x.y.example.org') == nil)
+        assert(router:lookup('example.org') == nil)
+
+        local function route(name)
+                local srv = default:ssl(openssl.bio_pair(), true)
+                local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+                if name then cli:servername(name) end
+                handshake(srv, cli)
+                return srv:ctx(), srv:servername()
+        end
+        local ctx, name = route('www.example.com')
+        assert(ctx == a and name == 'www.example.com')
+        assert(route('api.example.org') == b)
+        assert(route('nothing.test') == default)
+        assert(route() == default)
+
+        -- live provisioning
+        local c = server_ctx()
+        assert(router:add('new.example.com', c))
+        assert(route('new.example.com') == c)
+        assert(router:remove('www.example.com'))
+        assert(not router:remove('www.example.com'))
+        assert(route('www.example.com') == default)
+        for i = 1, 1000 do
+                assert(router:add('h' .. i .. '.example.net', a))
+        end
+        assert(#router == 1002)
+        assert(router:lookup('h777.example.net') == a)
+        -- router shared by other ctx
+        local other = server_ctx()
+        assert(other:sni_router(router) == router)
+end
+
+test_sni_router()
+
+function test_ssl_ctx_slot()
+        local function resume(slot, sess)
+                local srv = slot:ssl(openssl.bio_pair(), true)
+                local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+                if sess then cli:session(sess) end
+                handshake(srv, cli)
+                cli:read()
+                cli:shutdown()
+                return srv:cache_hit(), cli:session(), srv
+        end
+
+        local a = server_ctx()
+        local slot = openssl.ssl_ctx_slot(a)
+        assert(slot:get() == a and slot:generation() == 0)
+        local hit, sess, live = resume(slot)
+        assert(not hit and live:ctx() == a)
+
+        -- reloaded ctx resumes tickets issued by a, live keeps a
+        local b = server_ctx()
+        assert(slot:publish(b) == a)
+        assert(slot:get() == b and slot:generation() == 1)
+        assert(live:ctx() == a)
+        hit = resume(slot, sess)
+        assert(hit)
+
+        assert(slot:publish(server_ctx(), false) == b)
+        hit = resume(slot, sess)
+        assert(not hit)
+
+        local c = server_ctx()
+        assert(c:inherit(b))
+        hit = resume(openssl.ssl_ctx_slot(c), sess)
+        assert(hit)
+end
+
+test_ssl_ctx_slot()
+
+function test_async_keys()
+        local sctx = server_ctx()
+        local fd, reason = sctx:async_keys(2)
+        if not fd then
+                print('async_keys', reason)
+                return
+        end
+        assert(type(fd) == 'number' and sctx:async_keys() == fd)
+
+        local srv = sctx:ssl(openssl.bio_pair(), true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+        local sdone, cdone, waits = nil, nil, 0
+        repeat
+                if not sdone then
+                        sdone, reason = srv:do_handshake()
+                        -- signature runs on worker, event loop polls fd before retry
+                        while reason == 'want_async' do
+                                waits = waits + 1
+                                sdone, reason = srv:do_handshake()
+                        end
+                end
+                cdone = cdone or cli:do_handshake()
+        until (sdone and cdone) or pump(srv, cli) == 0
+        assert(sdone and cdone and waits > 0)
+        pump(srv, cli)
+        assert(sctx:async_ready() >= 1)
+
+        assert(cli:write('async') == 5)
+        pump(srv, cli)
+        assert(srv:read() == 'async')
+end
+
+test_async_keys()
+
+function test_sendfile()
+        local sctx = server_ctx()
+        local on = sctx:ktls(true)
+        assert(on == nil or on == true)
+        local srv = sctx:ssl(openssl.bio_pair(), true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+        handshake(srv, cli)
+        -- bio pair has no kernel offload, data goes through ssl:write
+        local send, recv = srv:ktls()
+        assert(send == false and recv == false)
+
+        local path = os.tmpname()
+        savefile(path, '0123456789')
+        local f = io.open(path, 'rb')
+        assert(srv:sendfile(f, 2, 5) == 5)
+        assert(srv:sendfile(f, 10, 5) == 0)
+        pump(srv, cli)
+        assert(cli:read() == '23456')
+        f:close()
+        os.remove(path)
+end
+
+test_sendfile()
+
+-- allocator and workers call module after lua_close, it must stay loaded
+function test_exit_status()
+        local lua = arg and arg[-1]
+        if not lua then return end
+        local code = string.format('package.cpath=%q require"openssl"', package.cpath)
+        local ret = os.execute(string.format('%s -e %q', lua, code))
+        assert(ret == 0 or ret == true)
+end
+
+test_exit_status()
+
+function test_low_memory()
+        local function idle(sctx)
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+                handshake(srv, cli)
+                assert(cli:write('ping') == 4)
+                pump(srv, cli)
+                assert(srv:read() == 'ping')
+                return srv, cli
+        end
+
+        local normal, low = server_ctx(), server_ctx()
+        assert(low:low_memory(true) and not normal:low_memory())
+        local a = idle(normal)
+        local b = idle(low)
+        local used, peak = a:memory_usage()
+        if not used then
+                print('memory_usage', peak)
+                return
+        end
+        local lused, lpeak = b:memory_usage()
+        assert(used > 0 and peak >= used)
+        -- buffers released when idle
+        assert(lused < used and lpeak >= lused)
+
+        local st = low:memory_stats()
+        assert(st.connections == 1 and st.bytes == lused)
+        assert(st.process > 0 and st.cached >= 0)
+        a, b = nil, nil
+        collectgarbage()
+        collectgarbage()
+        st = low:memory_stats()
+        assert(st.connections == 0 and st.bytes == 0)
+end
+
+test_low_memory()
+
+function test_telemetry()
+        local sctx = server_ctx()
+        local cctx = openssl.ssl_ctx_new('SSLv23')
+        assert(sctx:handshake_stats() == nil)
+        assert(sctx:telemetry(true) and cctx:telemetry(true))
+        sctx:session('telemetry')
+
+        local sess
+        for i = 1, 3 do
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = cctx:ssl((openssl.bio_pair()))
+                if sess then cli:session(sess) end
+                handshake(srv, cli)
+                cli:read()
+                sess = cli:session()
+                cli:shutdown()
+                pump(srv, cli)
+                assert(srv:read() == nil)
+                srv:shutdown()
+        end
+
+        local st = sctx:handshake_stats()
+        assert(st.handshakes == 3 and st.full == 1 and st.resumed == 2)
+        assert(st.resumed_ticket == 2 and st.resumed_cache == 0)
+        local n = 0
+        for _, c in pairs(st.cipher) do n = n + c end
+        assert(n == 3)
+        assert(st.alert.received['close notify'] == 3)
+        -- certificate sent in full handshake only
+        local sent = st.certificate.sent
+        assert(sent.count + sent.compressed == 1 and sent.bytes + sent.compressed_bytes > 0)
+        assert(#st.bounds + 1 == #st.phase.total.buckets)
+        for _, p in pairs(st.phase) do
+                local c = 0
+                for _, b in ipairs(p.buckets) do c = c + b end
+                assert(p.count == 3 and c == 3 and p.sum >= 0)
+        end
+        st = cctx:handshake_stats(true)
+        assert(st.handshakes == 3 and st.resumed_ticket == 2)
+        assert(st.alert.sent['close notify'] == 3)
+        local received = st.certificate.received
+        assert(received.bytes == sent.bytes and received.compressed_bytes == sent.compressed_bytes)
+        assert(cctx:handshake_stats().handshakes == 0)
+
+        assert(not sctx:telemetry(false))
+        local srv = sctx:ssl(openssl.bio_pair(), true)
+        local cli = cctx:ssl((openssl.bio_pair()))
+        handshake(srv, cli)
+        assert(sctx:handshake_stats().handshakes == 3)
+end
+
+test_telemetry()
+
+function test_ocsp_staple()
+        local cert = openssl.x509_read(readfile(certfile))
+        local key = openssl.pkey_read(readfile(keyfile), false)
+        local calls = 0
+        local function provider(ctx)
+                calls = calls + 1
+                local req = openssl.ocsp_request_new(cert, cert)
+                return openssl.ocsp_response_new(req, cert, cert, key, {})
+        end
+        local function staple(sctx, ask)
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair()))
+                if ask then assert(cli:ocsp_request()) end
+                handshake(srv, cli)
+                return cli:ocsp_staple()
+        end
+
+        local sctx = server_ctx()
+        assert(sctx:ocsp_staple('junk', cert) == nil)
+        local status, next_update = sctx:ocsp_staple(provider, cert)
+        assert(status == 'unknown' and next_update > os.time() and calls == 1)
+        local der = staple(sctx, true)
+        assert(der and openssl.ocsp_response_read(der))
+        assert(staple(sctx, false) == nil)
+        assert(sctx:ocsp_stats().served == 1)
+        -- refresh is half way to nextUpdate
+        assert(sctx:ocsp_refresh() > 0 and calls == 1)
+        assert(sctx:ocsp_refresh(true) > 0 and calls == 2)
+        assert(sctx:ocsp_staple(false))
+        assert(staple(sctx, true) == nil)
+end
+
+test_ocsp_staple()
+
+function test_ssl_client_pool()
+        local sctx = server_ctx()
+        sctx:session('client_pool')
+        local pool = openssl.ssl_client_pool(openssl.ssl_ctx_new('SSLv23'), {idle = 1})
+        local function connect(key, servername)
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = pool:ssl(key, openssl.bio_pair(), servername)
+                handshake(srv, cli)
+                -- TLSv1.3 tickets come after handshake
+                cli:read()
+                return cli, srv
+        end
+
+        local cli = connect('localhost:443')
+        assert(not cli:cache_hit())
+        assert(pool:stats().misses == 1)
+        for i = 1, 3 do
+                cli = connect('localhost:443')
+                assert(cli:cache_hit())
+        end
+        -- other destination do not share sessions
+        cli = connect('127.0.0.1:443')
+        assert(not cli:cache_hit())
+        cli = connect('localhost:443', 'other.name')
+        assert(not cli:cache_hit())
+
+        local st = pool:stats('localhost:443')
+        assert(st.hits == 3 and st.misses == 1 and st.sessions > 0)
+        cli = connect('localhost:443')
+        assert(pool:put(cli))
+        -- one idle connection per destination
+        assert(not pool:put((connect('localhost:443'))))
+        assert(pool:get('localhost:443') == cli)
+        assert(pool:get('localhost:443') == nil)
+        cli = nil
+        collectgarbage()
+        collectgarbage()
+        st = pool:stats()
+        assert(st.hits + st.misses == 8 and st.hosts == 3)
+        assert(st.resumed + st.full == 8 and st.resumed == st.hits)
+
+        pool:flush('localhost:443')
+        assert(pool:stats('localhost:443') == nil)
+        assert(not connect('localhost:443'):cache_hit())
+        pool:flush()
+        assert(pool:stats().hosts == 0)
+end
+
+test_ssl_client_pool()
+
+function test_cork_record_size()
+        local sctx = server_ctx()
+        local srv = sctx:ssl(openssl.bio_pair(65536), true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair(65536)))
+        handshake(srv, cli)
+        cli:read()
+
+        -- small writes stay in ssl until threshold
+        assert(srv:cork(100) == 100)
+        for i = 1, 9 do
+                assert(srv:write('0123456789') == 10)
+        end
+        assert(#srv:pending_output() == 0)
+        assert(srv:write('0123456789') == 10)
+        pump(srv, cli)
+        assert(cli:read() == string.rep('0123456789', 10))
+        assert(srv:write('abc') == 3)
+        assert(srv:flush() == 0)
+        pump(srv, cli)
+        assert(cli:read() == 'abc')
+        assert(srv:write('def') == 3)
+        assert(srv:cork(false) == 0)
+        pump(srv, cli)
+        assert(cli:read() == 'def')
+
+        -- one record a read, small records first
+        local small, boost, idle = srv:record_size(1024, 4096)
+        assert(small == 1024 and boost == 4096 and idle == 1000)
+        -- partial write, one record a write and a read
+        local function send(n)
+                local buf = openssl.buffer_new(n)
+                buf:append(string.rep('x', n))
+                while #buf > 0 do
+                        assert(srv:write(buf) > 0)
+                end
+                pump(srv, cli)
+                local sizes = {}
+                for s in function() return cli:read() end do
+                        sizes[#sizes + 1] = #s
+                end
+                return sizes
+        end
+        local sizes = send(8192)
+        assert(#sizes == 5 and sizes[1] == 1024 and sizes[5] == 4096)
+        assert(srv:record_size(false) == 0)
+        sizes = send(8192)
+        assert(#sizes == 1 and sizes[1] == 8192)
+        assert(srv:shutdown() == false)
+end
+
+test_cork_record_size()
+
+function test_read_all()
+        local sctx = server_ctx()
+        local srv = sctx:ssl(openssl.bio_pair(65536), true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair(65536)))
+        handshake(srv, cli)
+        cli:read()
+
+        -- many records, one call
+        for i = 1, 3 do
+                assert(srv:write('record' .. i) == 7)
+        end
+        pump(srv, cli)
+        assert(cli:read_all() == 'record1record2record3')
+        local data, reason = cli:read_all()
+        assert(data == nil and reason == 'want_read')
+
+        assert(srv:write(string.rep('x', 16384)) == 16384)
+        assert(srv:write(string.rep('y', 16384)) == 16384)
+        pump(srv, cli)
+        assert(cli:read_all(20000) == string.rep('x', 16384) .. string.rep('y', 3616))
+        local buf = openssl.buffer_new()
+        assert(cli:read_all(buf) == 16384 - 3616)
+        assert(#buf == 16384 - 3616)
+
+        srv:write('last')
+        srv:shutdown()
+        pump(srv, cli)
+        assert(cli:read_all() == 'last')
+        data, reason = cli:read_all()
+        assert(data == nil and reason == 'closed')
+end
+
+test_read_all()
+
+function test_cert_compression()
+        local sctx = server_ctx()
+        local sizes, reason = sctx:cert_compression({'zstd', 'brotli', 'zlib'})
+        if not sizes then
+                assert(reason == 'not supported')
+                return
+        end
+        -- chain compressed once here
+        for _, c in pairs(sizes) do
+                assert(c.size > 0 and c.size < c.orig)
+        end
+        local cctx = openssl.ssl_ctx_new('SSLv23')
+        assert(cctx:cert_compression({'zlib', 'zstd', 'brotli'}))
+        assert(sctx:telemetry(true))
+        local srv = sctx:ssl(openssl.bio_pair(), true)
+        local cli = cctx:ssl((openssl.bio_pair()))
+        handshake(srv, cli)
+        local st = sctx:handshake_stats().certificate.sent
+        if next(sizes) and select(2, srv:version()) == 'TLSv1.3' then
+                assert(st.compressed == 1 and st.count == 0)
+        end
+
+        assert(sctx:cert_compression(false))
+        srv = sctx:ssl(openssl.bio_pair(), true)
+        cli = cctx:ssl((openssl.bio_pair()))
+        handshake(srv, cli)
+        st = sctx:handshake_stats().certificate.sent
+        assert(st.count == 1)
+end
+
+test_cert_compression()
+
+function test_alpn()
+        local sctx = server_ctx()
+        local cctx = openssl.ssl_ctx_new('SSLv23')
+        local list = sctx:alpn({'h2', 'http/1.1'})
+        assert(list[1] == 'h2' and list[2] == 'http/1.1' and #list == 2)
+        assert(cctx:alpn({'http/1.1', 'h2'}))
+
+        local function connect(protocols)
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = cctx:ssl((openssl.bio_pair()))
+                if protocols then assert(cli:alpn(protocols)) end
+                handshake(srv, cli)
+                return srv, cli
+        end
+        -- server preference wins
+        local srv, cli = connect()
+        assert(srv:alpn_selected() == 'h2')
+        local proto, how = cli:alpn_selected()
+        assert(proto == 'h2' and how == 'alpn')
+        srv, cli = connect({'spdy/3', 'http/1.1'})
+        assert(cli:alpn_selected() == 'http/1.1')
+        -- nothing in common, go on without protocol
+        srv, cli = connect({'spdy/3'})
+        assert(cli:alpn_selected() == nil and srv:alpn_selected() == nil)
+        local st = sctx:alpn_stats()
+        assert(st.selected == 2 and st.mismatch == 1)
+
+        -- strict server refuse
+        sctx:alpn({'h2'}, true)
+        srv = sctx:ssl(openssl.bio_pair(), true)
+        cli = cctx:ssl((openssl.bio_pair()))
+        cli:alpn({'http/1.1'})
+        local ok
+        for i = 1, 4 do
+                cli:do_handshake()
+                ok = srv:do_handshake()
+                pump(srv, cli)
+        end
+        assert(not ok and cli:alpn_selected() == nil)
+        assert(not pcall(sctx.alpn, sctx, {''}))
+        assert(sctx:alpn(false) == nil and sctx:alpn() == nil)
+
+        -- NPN of TLSv1.2, client go on with its first protocol
+        sctx = server_ctx('TLSv1_2')
+        sctx:alpn({'h2'})
+        cctx = openssl.ssl_ctx_new('TLSv1_2')
+        cctx:alpn({'spdy/3'})
+        srv, cli = connect()
+        proto, how = cli:alpn_selected()
+        assert(proto == 'spdy/3' and how == 'npn')
+end
+
+test_alpn()
+
+function test_bio_custom()
+        -- two custom bio linked by buffers, like a socket layer in lua
+        local stat = {reads = 0, writes = 0}
+        local function side(inq, outq, batch)
+                return openssl.bio_new_custom{
+                        read = function(buf, n)
+                                stat.reads = stat.reads + 1
+                                if inq.closed then return false end
+                                if #inq.buf > 0 then
+                                        -- more than n is kept in bio
+                                        buf:append(inq.buf:tostring())
+                                        inq.buf:clear()
+                                end
+                        end,
+                        write = function(buf)
+                                stat.writes = stat.writes + 1
+                                if outq.full then return 0 end
+                                if outq.fail then error('broken pipe') end
+                                outq.buf:append(buf:tostring())
+                                return #buf
+                        end,
+                        batch = batch,
+                }
+        end
+        local c2s = {buf = openssl.buffer_new()}
+        local s2c = {buf = openssl.buffer_new()}
+        local sbio = side(c2s, s2c, true)
+        local cbio = side(s2c, c2s)
+        local srv = server_ctx():ssl(sbio, true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl(cbio)
+        local sdone, cdone
+        for i = 1, 10 do
+                sdone = sdone or srv:do_handshake()
+                cdone = cdone or cli:do_handshake()
+        end
+        assert(sdone and cdone)
+        cli:read()
+
+        -- client write a record a call, server collect until flush
+        stat.writes = 0
+        assert(cli:write('ping') == 4)
+        assert(cli:write('pong') == 4)
+        assert(stat.writes == 2)
+        stat.reads = 0
+        assert(srv:read_all() == 'pingpong')
+        assert(stat.reads <= 2)
+
+        -- would block leave nothing behind, write again
+        c2s.full = true
+        local ok, reason = cli:write('ping')
+        assert(ok == nil and reason == 'want_write' and #c2s.buf == 0)
+        c2s.full = nil
+        assert(cli:write('ping') == 4)
+        assert(srv:read_all() == 'ping')
+
+        stat.writes = 0
+        for i = 1, 3 do
+                assert(srv:write('r' .. i) == 2)
+        end
+        assert(stat.writes == 0 and #s2c.buf == 0)
+        s2c.full = true
+        assert(srv:flush() > 0)
+        s2c.full = nil
+        assert(srv:flush() == 0)
+        assert(stat.writes == 2)
+        assert(cli:read_all() == 'r1r2r3')
+
+        -- error of callback fail the call
+        c2s.fail = true
+        ok, reason = cli:write('lost')
+        assert(ok == nil and reason == 'syscall')
+        assert(cbio:callback_error():match('broken pipe'))
+        assert(cbio:callback_error() == nil)
+
+        -- end of stream
+        s2c.closed = true
+        ok, reason = cli:read()
+        assert(ok == nil)
+end
+
+test_bio_custom()
+
+function test_writev()
+        local bio = openssl.bio_new_mem()
+        local body = openssl.buffer_new('body ')
+        assert(bio:writev({'head ', body, '', 'tail'}) == 14)
+        assert(bio:get_mem() == 'head body tail' and #body == 0)
+
+        local srv = server_ctx():ssl(openssl.bio_pair(65536), true)
+        local cli = openssl.ssl_ctx_new('SSLv23'):ssl((openssl.bio_pair(65536)))
+        handshake(srv, cli)
+        cli:read()
+        -- small pieces packed in one record, one read
+        body = openssl.buffer_new('body ')
+        assert(srv:writev({'head ', body, 'tail'}) == 14 and #body == 0)
+        pump(srv, cli)
+        assert(cli:read() == 'head body tail')
+        assert(cli:read() == nil)
+
+        -- full records across pieces
+        local big = string.rep('x', 20000)
+        local n = srv:writev({'a', big, string.rep('y', 20000)})
+        assert(n == 40001)
+        pump(srv, cli)
+        local sizes = {}
+        for s in function() return cli:read() end do
+                sizes[#sizes + 1] = #s
+        end
+        assert(#sizes == 3 and sizes[1] == 16384 and sizes[2] == 16384)
+        assert(not pcall(srv.writev, srv, {1}))
+end
+
+test_writev()
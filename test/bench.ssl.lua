@@ -0,0 +1,200 @@
+-- in process TLS benchmark, client and server ssl talk over bio pairs
+--
+-- usage: lua bench.ssl.lua [seconds=1] [rsa_cert=cert.pem] [rsa_key=key.pem]
+--                          [ec_cert=ec-cert.pem] [ec_key=ec-key.pem]
+--
+-- one result a line: case, metric, value and unit separated by tab, lines
+-- come in fixed order, so output of two releases can be diffed
+local openssl = require('openssl')
+require 'util'
+
+local opts = {
+        seconds = 1,
+        rsa_cert = 'cert.pem',
+        rsa_key = 'key.pem',
+        ec_cert = 'ec-cert.pem',
+        ec_key = 'ec-key.pem',
+}
+for _, a in ipairs(arg or {}) do
+        local k, v = a:match('^([%w_]+)=(.*)$')
+        if k then
+                opts[k] = tonumber(v) or v
+        elseif tonumber(a) then
+                opts.seconds = tonumber(a)
+        end
+end
+
+local function report(case, metric, value, unit)
+        print(string.format('%s\t%s\t%.2f\t%s', case, metric, value, unit))
+end
+
+local function pump(srv, cli)
+        local n = 0
+        local out = cli:pending_output()
+        n = n + #out
+        srv:feed(out)
+        out = srv:pending_output()
+        n = n + #out
+        cli:feed(out)
+        return n
+end
+
+local function handshake(srv, cli)
+        local sdone, cdone
+        repeat
+                sdone = sdone or srv:do_handshake()
+                cdone = cdone or cli:do_handshake()
+        until (sdone and cdone) or pump(srv, cli) == 0
+        assert(sdone and cdone, 'handshake fail')
+        pump(srv, cli)
+        -- TLSv1.3 tickets come after handshake
+        cli:read()
+end
+
+local function server_ctx(kind, version)
+        local cert = openssl.x509_read(readfile(opts[kind .. '_cert']))
+        local key = openssl.pkey_read(readfile(opts[kind .. '_key']), false)
+        local ctx = openssl.ssl_ctx_new('TLS_server')
+        assert(ctx:use_certificate(cert))
+        assert(ctx:use_PrivateKey(key))
+        assert(ctx:min_version(version) and ctx:max_version(version))
+        ctx:session('bench')
+        return ctx
+end
+
+local function client_ctx(version)
+        local ctx = openssl.ssl_ctx_new('TLS_client')
+        assert(ctx:min_version(version) and ctx:max_version(version))
+        return ctx
+end
+
+-- run fn until time is up, return calls per second of cpu
+local function rate(fn)
+        local n = 0
+        local t0 = os.clock()
+        local t
+        repeat
+                fn()
+                n = n + 1
+                t = os.clock() - t0
+        until t >= opts.seconds
+        return n / t, n
+end
+
+local versions = {
+        {'tls1.2', 'TLSv1.2'},
+        {'tls1.3', 'TLSv1.3'},
+}
+
+local function bench_handshake()
+        for _, kind in ipairs({'rsa', 'ec'}) do
+                for _, v in ipairs(versions) do
+                        local case = kind .. '-' .. v[1]
+                        local ok, sctx = pcall(server_ctx, kind, v[2])
+                        if ok then
+                                local cctx = client_ctx(v[2])
+                                local sess
+                                report(case, 'full', rate(function()
+                                        local srv = sctx:ssl(openssl.bio_pair(), true)
+                                        local cli = cctx:ssl((openssl.bio_pair()))
+                                        handshake(srv, cli)
+                                        sess = cli:session()
+                                        cli:shutdown()
+                                        srv:shutdown()
+                                end), 'handshakes/s')
+
+                                local hits = 0
+                                local per, n = rate(function()
+                                        local srv = sctx:ssl(openssl.bio_pair(), true)
+                                        local cli = cctx:ssl((openssl.bio_pair()))
+                                        cli:session(sess)
+                                        handshake(srv, cli)
+                                        if srv:cache_hit() then
+                                                hits = hits + 1
+                                        end
+                                        sess = cli:session()
+                                        cli:shutdown()
+                                        srv:shutdown()
+                                end)
+                                report(case, 'resumed', per, 'handshakes/s')
+                                report(case, 'resumed_ratio', hits / n, 'ratio')
+                        else
+                                io.stderr:write(case, ' skipped: ', tostring(sctx), '\n')
+                        end
+                end
+        end
+end
+
+local suites = {
+        {'TLSv1.2', 'ECDHE-RSA-AES128-GCM-SHA256'},
+        {'TLSv1.2', 'ECDHE-RSA-AES256-GCM-SHA384'},
+        {'TLSv1.2', 'ECDHE-RSA-CHACHA20-POLY1305'},
+        {'TLSv1.3', 'TLS_AES_128_GCM_SHA256'},
+        {'TLSv1.3', 'TLS_AES_256_GCM_SHA384'},
+        {'TLSv1.3', 'TLS_CHACHA20_POLY1305_SHA256'},
+}
+
+local function bench_bulk()
+        for _, s in ipairs(suites) do
+                local ok, err = pcall(function()
+                        local sctx = server_ctx('rsa', s[1])
+                        if s[1] == 'TLSv1.3' then
+                                sctx:ciphersuites(s[2])
+                        else
+                                sctx:cipher_list(s[2])
+                        end
+                        local srv = sctx:ssl(openssl.bio_pair(65536), true)
+                        local cli = client_ctx(s[1]):ssl((openssl.bio_pair(65536)))
+                        handshake(srv, cli)
+                        assert(srv:current_cipher().name == s[2], 'not negotiated')
+
+                        local net, sink = openssl.buffer_new(65536), openssl.buffer_new(65536)
+                        for _, size in ipairs({1024, 4096, 16384}) do
+                                local data = string.rep('x', size)
+                                local bytes = 0
+                                local per = rate(function()
+                                        assert(cli:write(data) == size)
+                                        cli:pending_output(net)
+                                        srv:feed(net)
+                                        while srv:read(sink) do end
+                                        bytes = bytes + #sink
+                                        sink:clear()
+                                end)
+                                report(s[2] .. '-' .. size, 'bulk', per * size / 1e6, 'MB/s')
+                                assert(bytes > 0)
+                        end
+                end)
+                if not ok then
+                        io.stderr:write(s[2], ' skipped: ', tostring(err), '\n')
+                end
+        end
+end
+
+local function bench_memory()
+        for _, low in ipairs({false, true}) do
+                local case = low and 'rsa-tls1.3-low_memory' or 'rsa-tls1.3'
+                local sctx = server_ctx('rsa', 'TLSv1.3')
+                sctx:low_memory(low)
+                local srv = sctx:ssl(openssl.bio_pair(), true)
+                local cli = client_ctx('TLSv1.3'):ssl((openssl.bio_pair()))
+                handshake(srv, cli)
+                cli:write('ping')
+                pump(srv, cli)
+                srv:read()
+                local idle, peak = srv:memory_usage()
+                if not idle then
+                        io.stderr:write(case, ' memory skipped: ', tostring(peak), '\n')
+                        return
+                end
+                report(case, 'server_idle', idle, 'bytes')
+                report(case, 'server_peak', peak, 'bytes')
+                idle, peak = cli:memory_usage()
+                report(case, 'client_idle', idle, 'bytes')
+                report(case, 'client_peak', peak, 'bytes')
+        end
+end
+
+print('case\tmetric\tvalue\tunit')
+bench_handshake()
+bench_bulk()
+bench_memory()